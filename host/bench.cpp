@@ -0,0 +1,312 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+// Compares the payload codecs on real files: compressed size, decode speed
+// through the same loops the client uses, and the end-to-end time that gives
+// over links of a given speed. Decoding overlaps the network in the client,
+// so a transfer takes whichever of the two is slower. --slowdown divides the
+// measured decode speed for that estimate, to stand in for the ARM9. The
+// client's adler32 is checked against zlib's and timed on the same files.
+
+#include "adler.h"
+#include "chunker.h"
+#include "clock.h"
+#include "inflate.h"
+#include "lz4.h"
+#include "lz4enc.h"
+#include "pipeline.h"
+#include "protocol.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <zlib.h>
+
+#define MIN_BENCH_MS 500
+
+static u8 outSlot[OUT_SLOT_SIZE];
+static u8 outRing[OUT_SLOTS][OUT_SLOT_SIZE];
+
+struct Codec {
+	const char *name;
+	// Returns how much of src is sent without compression
+	size_t (*encode)(const std::vector<u8> &src, std::vector<u8> &dst);
+	size_t (*decode)(const std::vector<u8> &payload, size_t filesize);
+	std::vector<u8> payload;
+	size_t stored;
+	double decodeMBs;
+};
+
+static double storeAbove = STORE_ABOVE_DEFAULT;
+
+static bool readFile(const char *path, std::vector<u8> &data) {
+	FILE *fh = fopen(path, "rb");
+	if(!fh)
+		return false;
+	fseek(fh, 0, SEEK_END);
+	data.resize(ftell(fh));
+	fseek(fh, 0, SEEK_SET);
+	bool ok = fread(data.data(), 1, data.size(), fh) == data.size();
+	fclose(fh);
+	return ok;
+}
+
+static size_t encodeZlib(const std::vector<u8> &src, std::vector<u8> &dst) {
+	uLongf len = compressBound(src.size());
+	dst.resize(len);
+	compress(dst.data(), &len, src.data(), src.size());
+	dst.resize(len);
+	return 0;
+}
+
+// Chunks as sent: u32 size then the block
+static size_t encodeLz4(const std::vector<u8> &src, std::vector<u8> &dst) {
+	u8 block[LZ4_BOUND(LZ4_BLOCK_SIZE)];
+	dst.clear();
+	for(size_t pos = 0; pos < src.size(); pos += LZ4_BLOCK_SIZE) {
+		u32 n = src.size() - pos < LZ4_BLOCK_SIZE ? src.size() - pos : LZ4_BLOCK_SIZE;
+		u32 len = lz4EncodeBlock(src.data() + pos, n, block, sizeof(block));
+		dst.insert(dst.end(), (u8 *)&len, (u8 *)&len + 4);
+		dst.insert(dst.end(), block, block + len);
+	}
+	return 0;
+}
+
+// The inflate loop of receiveAndDecompress() without the network. Like
+// there, Z_BUF_ERROR only means a slot ended exactly with the input.
+static size_t decodeZlib(const std::vector<u8> &payload, size_t) {
+	z_stream strm = {};
+	inflateInit(&strm);
+	size_t total = 0;
+	int ret = Z_OK;
+	for(size_t pos = 0; pos < payload.size() && ret != Z_STREAM_END; pos += CHUNK_SIZE) {
+		strm.next_in = (Bytef *)payload.data() + pos;
+		strm.avail_in = payload.size() - pos < CHUNK_SIZE ? payload.size() - pos : CHUNK_SIZE;
+		do {
+			strm.next_out = outSlot;
+			strm.avail_out = sizeof(outSlot);
+			ret = inflate(&strm, Z_NO_FLUSH);
+			if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+				inflateEnd(&strm);
+				return 0;
+			}
+			total += sizeof(outSlot) - strm.avail_out;
+		} while(strm.avail_out == 0);
+	}
+	inflateEnd(&strm);
+	return total;
+}
+
+struct MemoryIo {
+	const std::vector<u8> *payload;
+	size_t pos;
+	u32 slot;
+};
+
+static const u8 *memoryInput(void *ctx, u32 *size) {
+	MemoryIo *io = (MemoryIo *)ctx;
+	if(io->pos == io->payload->size())
+		return NULL;
+	*size = io->payload->size() - io->pos < CHUNK_SIZE ? io->payload->size() - io->pos : CHUNK_SIZE;
+	io->pos += *size;
+	return io->payload->data() + io->pos - *size;
+}
+
+// Whole slots in turn, as the pipeline hands them out
+static u8 *memoryOutput(void *ctx, u32 used, u32 *avail) {
+	MemoryIo *io = (MemoryIo *)ctx;
+	if(used)
+		io->slot = (io->slot + 1) % OUT_SLOTS;
+	*avail = OUT_SLOT_SIZE;
+	return outRing[io->slot];
+}
+
+// inflateStream() as used by the client
+static size_t decodeFast(const std::vector<u8> &payload, size_t filesize) {
+	MemoryIo mem = {&payload, 0, 0};
+	InflateIo io = {&mem, memoryInput, memoryOutput, outRing[0], sizeof(outRing), 0};
+	return inflateStream(&io) == 0 ? filesize : 0;
+}
+
+static size_t encodeAdaptive(const std::vector<u8> &src, std::vector<u8> &dst) {
+	dst.clear();
+	return chunkAdaptive(src.data(), src.size(), Z_DEFAULT_COMPRESSION, storeAbove, dst);
+}
+
+// Stored chunks are only copied to the write slot, as in the client
+static size_t decodeAdaptive(const std::vector<u8> &payload, size_t) {
+	z_stream strm = {};
+	inflateInit(&strm);
+	size_t total = 0, pos = 0;
+	int ret = Z_OK;
+	while(pos < payload.size() && ret != Z_STREAM_END) {
+		u32 header;
+		memcpy(&header, payload.data() + pos, 4);
+		u32 len = header & ~CHUNK_FLAGS;
+		const u8 *data = payload.data() + pos + 4;
+		pos += 4 + len;
+
+		if(header & CHUNK_STORED) {
+			memcpy(outSlot, data, len);
+			total += len;
+			continue;
+		}
+
+		strm.next_in = (Bytef *)data;
+		strm.avail_in = len;
+		do {
+			strm.next_out = outSlot;
+			strm.avail_out = sizeof(outSlot);
+			ret = inflate(&strm, Z_NO_FLUSH);
+			if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+				inflateEnd(&strm);
+				return 0;
+			}
+			total += sizeof(outSlot) - strm.avail_out;
+		} while(strm.avail_out == 0);
+	}
+	inflateEnd(&strm);
+	return total;
+}
+
+static size_t decodeLz4(const std::vector<u8> &payload, size_t filesize) {
+	size_t total = 0, pos = 0;
+	while(total < filesize) {
+		u32 len;
+		memcpy(&len, payload.data() + pos, 4);
+		u32 want = filesize - total < LZ4_BLOCK_SIZE ? filesize - total : LZ4_BLOCK_SIZE;
+		if(lz4DecodeBlock(payload.data() + pos + 4, len, outSlot, want) < 0)
+			return 0;
+		pos += 4 + len;
+		total += want;
+	}
+	return total;
+}
+
+static double timeDecode(Codec &codec, size_t filesize) {
+	u64 start = clockTicks(), elapsed;
+	u32 runs = 0;
+	do {
+		size_t got = codec.decode(codec.payload, filesize);
+		if(got != filesize) {
+			printf("  %s: decoded %zu of %zu bytes\n", codec.name, got, filesize);
+			return 0;
+		}
+		runs++;
+		elapsed = clockTicks() - start;
+	} while(ticksToMs(elapsed) < MIN_BENCH_MS);
+	return (double)filesize * runs / (ticksToUs(elapsed) / 1e6) / 1e6;
+}
+
+// Every alignment and short length, the file in uneven pieces, and bytes
+// that are all 0xFF for the largest sums
+static bool checkAdler(const std::vector<u8> &data) {
+	size_t span = data.size() < 4096 ? data.size() : 4096;
+	for(size_t offset = 0; offset < 8 && offset < span; offset++) {
+		for(size_t len = 0; offset + len <= span; len += len < 300 ? 1 : 97) {
+			u32 want = adler32(1, data.data() + offset, len), got = adlerUpdate(ADLER_INIT, data.data() + offset, len);
+			if(got != want) {
+				printf("  adler32 %08x, zlib %08x at %zu, %zu bytes\n", got, want, offset, len);
+				return false;
+			}
+		}
+	}
+
+	u32 got = ADLER_INIT;
+	for(size_t pos = 0, n = 1; pos < data.size(); pos += n, n = n * 7 % 65537 + 1) {
+		if(n > data.size() - pos)
+			n = data.size() - pos;
+		got = adlerUpdate(got, data.data() + pos, n);
+	}
+	if(got != adler32(1, data.data(), data.size())) {
+		printf("  adler32 in pieces differs from zlib\n");
+		return false;
+	}
+
+	std::vector<u8> ones(1 << 20, 0xFF);
+	for(size_t len : {ones.size(), ones.size() - 3, (size_t)5551, (size_t)5552, (size_t)5553}) {
+		if(adlerUpdate(ADLER_INIT, ones.data() + 1, len - 1) != adler32(1, ones.data() + 1, len - 1)) {
+			printf("  adler32 of %zu 0xFF bytes differs from zlib\n", len - 1);
+			return false;
+		}
+	}
+	return true;
+}
+
+static double timeAdler(const std::vector<u8> &data, bool zlib) {
+	u64 start = clockTicks(), elapsed;
+	u32 runs = 0;
+	volatile u32 sink;
+	do {
+		sink = zlib ? adler32(1, data.data(), data.size()) : adlerUpdate(ADLER_INIT, data.data(), data.size());
+		runs++;
+		elapsed = clockTicks() - start;
+	} while(ticksToMs(elapsed) < MIN_BENCH_MS);
+	(void)sink;
+	return (double)data.size() * runs / (ticksToUs(elapsed) / 1e6) / 1e6;
+}
+
+int main(int argc, char **argv) {
+	std::vector<double> links;
+	double slowdown = 1;
+	int first = 1;
+	for(; first + 1 < argc && argv[first][0] == '-'; first += 2) {
+		if(strcmp(argv[first], "--link") == 0)
+			links.push_back(atof(argv[first + 1]));
+		else if(strcmp(argv[first], "--slowdown") == 0)
+			slowdown = atof(argv[first + 1]);
+		else if(strcmp(argv[first], "--store-above") == 0)
+			storeAbove = atof(argv[first + 1]);
+		else
+			break;
+	}
+	if(first >= argc || argv[first][0] == '-' || slowdown <= 0) {
+		printf("usage: %s [--link KiB/s]... [--slowdown factor] [--store-above ratio] file...\n", argv[0]);
+		return 1;
+	}
+	if(links.empty()) {
+		// Roughly a DS and a DSi close to the AP
+		links.push_back(200);
+		links.push_back(800);
+	}
+
+	clockInit();
+	for(int i = first; i < argc; i++) {
+		std::vector<u8> data;
+		if(!readFile(argv[i], data)) {
+			printf("%s: can't read\n", argv[i]);
+			return 1;
+		}
+
+		Codec codecs[] = {
+			{"zlib", encodeZlib, decodeZlib},
+			{"zlib fast", encodeZlib, decodeFast},
+			{"zlib+stored", encodeAdaptive, decodeAdaptive},
+			{"lz4", encodeLz4, decodeLz4},
+		};
+
+		printf("%s, %zu bytes\n", argv[i], data.size());
+		for(Codec &codec : codecs) {
+			codec.stored = codec.encode(data, codec.payload);
+			codec.decodeMBs = timeDecode(codec, data.size());
+			printf("  %-11s %9zu bytes (%5.1f%%), decode %8.2f MB/s, %7.2f ms", codec.name, codec.payload.size(),
+			       100.0 * codec.payload.size() / data.size(), codec.decodeMBs,
+			       codec.decodeMBs ? data.size() / (codec.decodeMBs * 1e3) : 0.0);
+			for(double link : links) {
+				double air = codec.payload.size() / (link * 1024);
+				double cpu = codec.decodeMBs ? data.size() * slowdown / (codec.decodeMBs * 1e6) : 0;
+				printf(", %g KiB/s: %.2f s", link, air > cpu ? air : cpu);
+			}
+			if(codec.stored)
+				printf(", %.1f%% stored", 100.0 * codec.stored / data.size());
+			printf("\n");
+		}
+
+		if(!checkAdler(data))
+			return 1;
+		printf("  adler32     %8.2f MB/s, zlib %8.2f MB/s\n", timeAdler(data, false), timeAdler(data, true));
+	}
+	return 0;
+}
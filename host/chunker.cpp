@@ -0,0 +1,57 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#include "chunker.h"
+#include "pipeline.h"
+#include "protocol.h"
+
+#include <string.h>
+#include <zlib.h>
+
+static void putChunk(std::vector<u8> &out, u32 header, const u8 *data, u32 size) {
+	out.insert(out.end(), (u8 *)&header, (u8 *)&header + 4);
+	out.insert(out.end(), data, data + size);
+}
+
+size_t chunkAdaptive(const u8 *src, size_t size, int level, double storeAbove, std::vector<u8> &out) {
+	static u8 buf[CHUNK_SIZE * 2];
+	z_stream strm = {}, snap;
+	deflateInit(&strm, level);
+
+	size_t stored = 0;
+	for(size_t pos = 0; pos < size; pos += CHUNK_SIZE) {
+		u32 n = size - pos < CHUNK_SIZE ? size - pos : CHUNK_SIZE;
+
+		// Try it, and roll the stream back if it didn't pay
+		deflateCopy(&snap, &strm);
+		strm.next_in = (Bytef *)src + pos;
+		strm.avail_in = n;
+		strm.next_out = buf;
+		strm.avail_out = sizeof(buf);
+		deflate(&strm, Z_SYNC_FLUSH);
+		u32 len = sizeof(buf) - strm.avail_out;
+
+		// A deflated chunk must still fit in a receive slot
+		if(len < n * storeAbove && len <= CHUNK_SIZE) {
+			putChunk(out, len, buf, len);
+			deflateEnd(&snap);
+		} else {
+			putChunk(out, n | CHUNK_STORED, src + pos, n);
+			deflateEnd(&strm);
+			deflateCopy(&strm, &snap);
+			deflateEnd(&snap);
+			stored += n;
+		}
+	}
+
+	// The stream end, with its checksum of the deflated part
+	strm.next_in = NULL;
+	strm.avail_in = 0;
+	strm.next_out = buf;
+	strm.avail_out = sizeof(buf);
+	deflate(&strm, Z_FINISH);
+	putChunk(out, sizeof(buf) - strm.avail_out, buf, sizeof(buf) - strm.avail_out);
+	deflateEnd(&strm);
+	return stored;
+}
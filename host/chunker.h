@@ -0,0 +1,22 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#ifndef CHUNKER_H
+#define CHUNKER_H
+
+#include "platform.h"
+
+#include <vector>
+
+// Blocks that deflate to more than this fraction of their size aren't worth
+// the client's inflate time
+#define STORE_ABOVE_DEFAULT (15.0 / 16)
+
+// Deflates src one CHUNK_SIZE block at a time and appends the framed chunks
+// (u32 size, payload) to out. Blocks that don't shrink below storeAbove are
+// sent as CHUNK_STORED instead and left out of the deflate stream. Returns
+// how many of src's bytes went out stored.
+size_t chunkAdaptive(const u8 *src, size_t size, int level, double storeAbove, std::vector<u8> &out);
+
+#endif // CHUNKER_H
@@ -0,0 +1,122 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+// POSIX stand-in for main.cpp: receives files into ./nds/ over loopback and
+// reports how the link behaved instead of launching them.
+
+#include "clock.h"
+#include "link.h"
+#include "manifest.h"
+#include "netio.h"
+#include "pipeline.h"
+#include "task.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static void onInterrupt(int) {
+	netCancel();
+}
+
+static LinkSession session;
+
+static void printStats(void) {
+	u64 elapsed = clockTicks() - netStats.startTicks;
+	if(netStats.pingTicks)
+		printf("ping -> accept:   %.3f ms%s\n", ticksToUs(netStats.acceptTicks - netStats.pingTicks) / 1000.0,
+		       session.reassociated ? " (associated)" : " (reused session)");
+	if(netStats.rtts)
+		printf("handshake RTT:    %.3f ms (%u)\n", ticksToUs(netStats.rttTicks / netStats.rtts) / 1000.0, netStats.rtts);
+	if(pipelineStats.endTicks) {
+		const PipelineStats &ps = pipelineStats;
+		u64 transfer = ps.endTicks - ps.startTicks;
+		printf("transfer:         %.3f ms, %.2f MB/s out\n", ticksToUs(transfer) / 1000.0,
+		       transfer ? ps.bytesOut / (ticksToUs(transfer) / 1e6) / 1e6 : 0.0);
+		if(ps.firstOutTicks) {
+			printf("first output:     %.3f ms\n", ticksToUs(ps.firstOutTicks - ps.startTicks) / 1000.0);
+			printf("accept -> output: %.3f ms\n", ticksToUs(ps.firstOutTicks - netStats.acceptTicks) / 1000.0);
+		}
+		printf("network stalls:   %u (%.3f ms), receive ring full %u\n", ps.netStalls,
+		       ticksToUs(ps.netStallTicks) / 1000.0, ps.ringFull);
+		if(ps.storedBytes)
+			printf("stored chunks:    %zu of %zu bytes skipped inflate\n", ps.storedBytes, ps.bytesOut);
+		if(ps.nacks)
+			printf("retransmitted:    %zu of %zu bytes (%u bad chunks, %u NACKs)\n", ps.retransmitBytes,
+			       ps.bytesIn, ps.badChunks, ps.nacks);
+		printf("write stalls:     %u (%.3f ms), %u writes in %.3f ms\n", ps.writeStalls,
+		       ticksToUs(ps.writeStallTicks) / 1000.0, ps.writes, ticksToUs(ps.writeTicks) / 1000.0);
+		printf("phases:           recv %.3f ms, decode %.3f ms, source %.3f ms (%u reads), resume %.3f ms\n",
+		       ticksToUs(ps.recvTicks) / 1000.0, ticksToUs(ps.decodeTicks) / 1000.0, ticksToUs(ps.sourceTicks) / 1000.0,
+		       ps.sourceReads, ticksToUs(ps.resumeTicks) / 1000.0);
+	}
+	const ManifestStats &ms = manifestStats;
+	printf("checksums:        %u known, %u read; idle hashed %u files, %zu bytes in %.3f ms\n", ms.hits, ms.reads,
+	       ms.idleFiles, ms.idleBytes, ticksToUs(ms.idleTicks) / 1000.0);
+	printf("idle in select:   %.1f%% (%u waits, %u frames)\n",
+	       elapsed ? 100.0 * netStats.waitTicks / elapsed : 0.0, netStats.waits, netStats.yields);
+	printf("task CPU:         ");
+	for(int i = 0; const TaskStats *ts = taskStats(i); i++)
+		printf("%s%s %.3f ms (%u)", i ? ", " : "", ts->name, ticksToUs(ts->cpuTicks) / 1000.0, ts->resumes);
+	printf("\n");
+}
+
+int main(int argc, char **argv) {
+	// -b ip listens on that address only, for running a fleet on loopback,
+	// -t file records each transfer over the last, -r file replays one as
+	// fast as it decodes and -R file at the recorded pace
+	int arg = 1;
+	const char *replayPath = NULL;
+	bool realtime = false;
+	while(argc > arg + 1 && argv[arg][0] == '-') {
+		if(strcmp(argv[arg], "-b") == 0) {
+			session.bindAddress = inet_addr(argv[arg + 1]);
+		} else if(strcmp(argv[arg], "-t") == 0) {
+			session.tracePath = argv[arg + 1];
+		} else if(strcmp(argv[arg], "-r") == 0 || strcmp(argv[arg], "-R") == 0) {
+			replayPath = argv[arg + 1];
+			realtime = argv[arg][1] == 'R';
+		} else {
+			break;
+		}
+		arg += 2;
+	}
+	int count = argc > arg ? atoi(argv[arg]) : 0;
+
+	struct sigaction sa = {};
+	sa.sa_handler = onInterrupt;
+	sigaction(SIGINT, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	clockInit();
+	mkdir("nds", 0777);
+
+	if(replayPath) {
+		char filename[256];
+		char arg0[256];
+		bool ret = session.replay(replayPath, realtime, filename, arg0);
+		printf("\n%s %s\n", ret ? "Replayed" : "!!Failed!!", filename);
+		printStats();
+		return ret ? 0 : 1;
+	}
+
+	for(int i = 0; count == 0 || i < count; i++) {
+		char filename[256];
+		char arg0[256];
+		bool ret = session.receive(filename, arg0);
+		printf("\n");
+		if(!ret) {
+			printf("!!Failed!!\n");
+			printStats();
+			return 1;
+		}
+		printf("Received %s\nArgs: %s\n", filename, arg0);
+		printStats();
+	}
+
+	session.disconnect();
+	return 0;
+}
@@ -0,0 +1,86 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#include "heap.h"
+
+#include <atomic>
+#include <errno.h>
+#include <malloc.h>
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t align, size_t size);
+void __libc_free(void *ptr);
+}
+
+static std::atomic<size_t> live, peak;
+
+static void *track(void *ptr) {
+	if(ptr) {
+		size_t now = live += malloc_usable_size(ptr);
+		size_t old = peak;
+		while(now > old && !peak.compare_exchange_weak(old, now))
+			;
+	}
+	return ptr;
+}
+
+static void untrack(void *ptr) {
+	if(ptr)
+		live -= malloc_usable_size(ptr);
+}
+
+size_t heapLive(void) {
+	return live;
+}
+
+size_t heapPeak(void) {
+	return peak;
+}
+
+void heapResetPeak(void) {
+	peak = live.load();
+}
+
+extern "C" void *malloc(size_t size) {
+	return track(__libc_malloc(size));
+}
+
+extern "C" void *calloc(size_t count, size_t size) {
+	return track(__libc_calloc(count, size));
+}
+
+extern "C" void *realloc(void *ptr, size_t size) {
+	size_t old = ptr ? malloc_usable_size(ptr) : 0;
+	void *moved = __libc_realloc(ptr, size);
+	// On failure the old block is still there, realloc(ptr, 0) frees it
+	if(moved || size == 0) {
+		live -= old;
+		track(moved);
+	}
+	return moved;
+}
+
+extern "C" void free(void *ptr) {
+	untrack(ptr);
+	__libc_free(ptr);
+}
+
+extern "C" void *memalign(size_t align, size_t size) {
+	return track(__libc_memalign(align, size));
+}
+
+extern "C" void *aligned_alloc(size_t align, size_t size) {
+	return track(__libc_memalign(align, size));
+}
+
+extern "C" int posix_memalign(void **ptr, size_t align, size_t size) {
+	void *block = track(__libc_memalign(align, size));
+	if(!block)
+		return ENOMEM;
+	*ptr = block;
+	return 0;
+}
@@ -0,0 +1,18 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <stddef.h>
+
+// Live heap accounting, for programs that link heap.o. It wraps glibc's
+// allocator, so every malloc() in the process is counted.
+size_t heapLive(void);
+size_t heapPeak(void);
+
+// Starts a new peak from what is allocated now
+void heapResetPeak(void);
+
+#endif // HEAP_H
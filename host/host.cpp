@@ -0,0 +1,141 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+// dslink-host: sends a file or a tree to a dslink-delta client. It speaks
+// both handshakes of protocol.h and every payload mode, so it is the sender
+// the client is measured against and changes to the wire format can be made
+// on both ends at once.
+
+#include "sender.h"
+#include "clock.h"
+#include "pipeline.h"
+#include "protocol.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static bool valueOption(int argc, char **argv, int &i, const char *name, const char **value) {
+	if(strcmp(argv[i], name) != 0 || i + 1 >= argc)
+		return false;
+	*value = argv[++i];
+	return true;
+}
+
+static void usage(const char *argv0) {
+	printf("usage: %s [options] file [args...]\n"
+	       "       %s [options] --sync dir [args...]\n"
+	       "  -a, --address ip    client to ping instead of broadcasting, repeatable\n"
+	       "  --port n            ping and connect here, e.g. through dslink-shaper\n"
+	       "  --name path         where the file goes under /nds\n"
+	       "  --base file         the client's current copy, sends a delta. Repeatable,\n"
+	       "                      the client's beacon says which one it has\n"
+	       "  --mode zlib|delta|lz4|signature\n"
+	       "  --block n           signature block size\n"
+	       "  --level n           zlib level\n"
+	       "  --store-above ratio send blocks that deflate worse than this as they are\n"
+	       "  --checked           CRC framing with NACKed resends\n"
+	       "  --corrupt n         damage every nth chunk once, with --checked\n"
+	       "  --resume            ask v1 clients for their interrupted copy too\n"
+	       "  --no-resume         always send the whole file\n"
+	       "  --no-cache          send even what the client kept from before\n"
+	       "  --v1                use the v1 handshake\n"
+	       "  --remote dir        the synced tree's directory under /nds\n"
+	       "  --base-dir dir      the client's current copy of the tree, for deltas\n"
+	       "  --delete            remove files the tree no longer has\n"
+	       "  --run path          file in the tree to launch\n"
+	       "  --fleet n           broadcast the file to n clients at once\n"
+	       "  --fleet-to ip       where the fleet datagrams go (default broadcast)\n"
+	       "  --rate KB/s         fleet datagram rate, 0 for unpaced (default 256)\n"
+	       "  --stats             per phase timings\n"
+	       "  --stats-log file    append the client's own timings to a CSV file\n",
+	       argv0, argv0);
+}
+
+int main(int argc, char **argv) {
+	int i = 1;
+	for(; i < argc && argv[i][0] == '-'; i++) {
+		const char *value;
+		if(strcmp(argv[i], "--") == 0) {
+			i++;
+			break;
+		} else if(valueOption(argc, argv, i, "-a", &value) || valueOption(argc, argv, i, "--address", &value)) {
+			hostOptions.addresses.push_back(value);
+		} else if(valueOption(argc, argv, i, "--name", &hostOptions.name) || valueOption(argc, argv, i, "--sync", &hostOptions.sync) || valueOption(argc, argv, i, "--remote", &hostOptions.remote)
+				|| valueOption(argc, argv, i, "--base-dir", &hostOptions.baseDir) || valueOption(argc, argv, i, "--run", &hostOptions.run)
+				|| valueOption(argc, argv, i, "--fleet-to", &hostOptions.fleetTo) || valueOption(argc, argv, i, "--stats-log", &hostOptions.statsLog)) {
+			continue;
+		} else if(valueOption(argc, argv, i, "--base", &value)) {
+			hostOptions.bases.push_back(value);
+		} else if(valueOption(argc, argv, i, "--mode", &value)) {
+			hostOptions.mode = strcmp(value, "zlib") == 0 ? MODE_ZLIB : strcmp(value, "delta") == 0 ? MODE_DELTA
+			         : strcmp(value, "lz4") == 0 ? MODE_LZ4 : strcmp(value, "signature") == 0 ? MODE_SIGNATURE : -2;
+		} else if(valueOption(argc, argv, i, "--block", &value)) {
+			hostOptions.blockSize = atoi(value);
+		} else if(valueOption(argc, argv, i, "--fleet", &value)) {
+			hostOptions.fleet = atoi(value);
+		} else if(valueOption(argc, argv, i, "--rate", &value)) {
+			hostOptions.rate = atof(value) * 1e3;
+		} else if(valueOption(argc, argv, i, "--port", &value)) {
+			hostOptions.port = atoi(value);
+		} else if(valueOption(argc, argv, i, "--level", &value)) {
+			hostOptions.level = atoi(value);
+		} else if(valueOption(argc, argv, i, "--store-above", &value)) {
+			hostOptions.storeAbove = atof(value);
+		} else if(valueOption(argc, argv, i, "--corrupt", &value)) {
+			hostOptions.corruptEvery = atoi(value);
+		} else if(strcmp(argv[i], "--checked") == 0) {
+			hostOptions.checked = true;
+		} else if(strcmp(argv[i], "--resume") == 0) {
+			hostOptions.resume = 1;
+		} else if(strcmp(argv[i], "--no-resume") == 0) {
+			hostOptions.resume = 0;
+		} else if(strcmp(argv[i], "--no-cache") == 0) {
+			hostOptions.cache = false;
+		} else if(strcmp(argv[i], "--v1") == 0) {
+			hostOptions.version = PROTOCOL_V1;
+		} else if(strcmp(argv[i], "--delete") == 0) {
+			hostOptions.remove = true;
+		} else if(strcmp(argv[i], "--stats") == 0) {
+			hostOptions.stats = true;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	const char *file = NULL;
+	if(!hostOptions.sync && i < argc)
+		file = argv[i++];
+	for(; i < argc; i++)
+		hostOptions.args.push_back(argv[i]);
+	if((!file && !hostOptions.sync) || hostOptions.mode == -2 || (hostOptions.sync && (hostOptions.mode == MODE_DELTA || hostOptions.mode == MODE_SIGNATURE))
+			|| (hostOptions.blockSize && (hostOptions.blockSize < SIG_MIN_BLOCK || hostOptions.blockSize > CHUNK_SIZE))
+			|| (hostOptions.fleet && (hostOptions.sync || !hostOptions.bases.empty() || hostOptions.mode >= 0))) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	clockInit();
+	u64 start = clockTicks();
+
+	bool ok;
+	if(hostOptions.fleet) {
+		std::vector<sockaddr_in> clients;
+		std::vector<Hello> hellos;
+		ok = discoverFleet(clients, hellos) && sendFleet(clients, hellos, file);
+	} else {
+		sockaddr_in client;
+		Hello hello;
+		ok = discover(&client, &hello, hostOptions.sync ? NULL : remoteName(file).c_str()) && (hostOptions.sync ? sendTree(client, hello) : sendFile(client, hello, file));
+	}
+
+	if(hostOptions.stats) {
+		printHostStats();
+		printf("total:            %.3f ms\n", ticksToUs(clockTicks() - start) / 1000.0);
+	}
+	return ok ? 0 : 1;
+}
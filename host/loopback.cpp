@@ -0,0 +1,564 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+// End to end transfers over loopback: the client's receive path runs in a
+// child process and the sender of dslink-host in this one. Each run over a
+// corpus of ROM sizes and payload modes reports throughput, CPU time per
+// stage and the client's peak heap. --json writes one JSON object per run,
+// --baseline compares against such a file and fails on regressions. --cuts
+// drops each connection part way through, reconnects and checks the client
+// picks up where it left off.
+
+#include "clock.h"
+#include "heap.h"
+#include "link.h"
+#include "pipeline.h"
+#include "protocol.h"
+#include "resume.h"
+#include "sender.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#define WORK_DIR "loopback"
+
+struct CorpusFile {
+	std::string name;
+	std::vector<u8> data, base; // base: the previous build, for delta
+};
+
+struct ClientReport {
+	bool ok;
+	PipelineStats pipeline;
+	u64 cpuUs;
+	size_t peakHeap;
+};
+
+struct Result {
+	std::string corpus, mode;
+	size_t size, payload;
+	double e2eMBs, clientMBs;
+	double encodeMs, hostCpuMs, clientCpuMs, writeMs, stallMs;
+	size_t peakHeap;
+};
+
+static u32 rngState;
+
+static u32 rng(void) {
+	rngState ^= rngState << 13;
+	rngState ^= rngState >> 17;
+	rngState ^= rngState << 5;
+	return rngState;
+}
+
+// A stand-in ROM: code built from a small vocabulary of words, 4bpp tiles
+// that are mostly transparent, assets that are already compressed and 0xFF
+// padding, in roughly the proportions of a homebrew build
+static void makeRom(size_t size, u32 seed, std::vector<u8> &rom) {
+	rngState = seed;
+	rom.resize(size);
+	size_t code = size * 35 / 100 & ~3, tiles = code + size / 4, assets = tiles + size / 4;
+
+	u32 vocab[256];
+	for(u32 &word : vocab)
+		word = rng();
+	for(size_t pos = 0; pos < code; pos += 4) {
+		u32 r = rng();
+		// A few words are very common, like in real code
+		u32 word = r & 0x100 ? vocab[r >> 24 & 0x1F] : r & 0x200 ? vocab[r >> 24] : r;
+		memcpy(&rom[pos], &word, 4);
+	}
+	for(size_t pos = code; pos < tiles; pos++) {
+		u32 r = rng();
+		u8 lo = r % 5 < 3 ? 0 : (r >> 8 & 0xF), hi = (r >> 16) % 5 < 3 ? 0 : (r >> 24 & 0xF);
+		rom[pos] = lo | hi << 4;
+	}
+	for(size_t pos = tiles; pos < assets; pos++)
+		rom[pos] = rng();
+	memset(rom.data() + assets, 0xFF, size - assets);
+}
+
+// The next build: some code inserted near the start, which shifts the rest,
+// scattered small edits, and one asset replaced
+static void nextBuild(const std::vector<u8> &rom, u32 seed, std::vector<u8> &out) {
+	rngState = seed;
+	size_t at = rom.size() / 8 & ~3;
+	out.assign(rom.begin(), rom.begin() + at);
+	for(int i = 0; i < 1024; i++) {
+		u32 word = rng();
+		out.insert(out.end(), (u8 *)&word, (u8 *)&word + 4);
+	}
+	out.insert(out.end(), rom.begin() + at, rom.end());
+
+	for(int i = 0; i < 64; i++) {
+		size_t pos = rng() % (out.size() * 35 / 100);
+		for(size_t j = pos; j < pos + 16 && j < out.size(); j++)
+			out[j] = rng();
+	}
+	size_t asset = out.size() * 60 / 100, len = std::min<size_t>(64 * 1024, out.size() / 16);
+	for(size_t j = asset; j < asset + len; j++)
+		out[j] = rng();
+}
+
+static bool readFile(const char *path, std::vector<u8> &data) {
+	FILE *fh = fopen(path, "rb");
+	if(!fh)
+		return false;
+	fseek(fh, 0, SEEK_END);
+	data.resize(ftell(fh));
+	fseek(fh, 0, SEEK_SET);
+	bool ok = fread(data.data(), 1, data.size(), fh) == data.size();
+	fclose(fh);
+	return ok;
+}
+
+static bool writeFile(const std::string &path, const std::vector<u8> &data) {
+	FILE *fh = fopen(path.c_str(), "wb");
+	if(!fh)
+		return false;
+	bool ok = fwrite(data.data(), 1, data.size(), fh) == data.size();
+	return fclose(fh) == 0 && ok;
+}
+
+static u64 cpuUs(void) {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ull + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// Receives one transfer in a child, the report comes back over *fd. Up to
+// attempts connections, for a transfer that gets cut off.
+static pid_t startClient(int *fd, int attempts = 1) {
+	int fds[2];
+	if(pipe(fds) < 0)
+		return -1;
+	pid_t pid = fork();
+	if(pid != 0) {
+		close(fds[1]);
+		*fd = fds[0];
+		return pid;
+	}
+
+	// The progress lines still cost what they cost, they just aren't shown.
+	// ./nds and the resume record end up in the work directory.
+	close(fds[0]);
+	int null = open("/dev/null", O_WRONLY);
+	dup2(null, STDOUT_FILENO);
+	if(chdir(WORK_DIR) < 0)
+		_exit(1);
+
+	static LinkSession session;
+	char filename[256], arg0[256];
+	ClientReport report = {};
+	heapResetPeak();
+	size_t heapBefore = heapLive();
+	u64 cpuBefore = cpuUs();
+	for(int i = 0; i < attempts && !report.ok; i++)
+		report.ok = session.receive(filename, arg0);
+	report.cpuUs = cpuUs() - cpuBefore;
+	report.peakHeap = heapPeak() - heapBefore;
+	report.pipeline = pipelineStats;
+	session.disconnect();
+	write(fds[1], &report, sizeof(report));
+	_exit(0);
+}
+
+// The sender's messages only matter when something goes wrong, which a cut
+// connection is not. What the client said is left in *seen.
+static bool sendQuietly(const char *path, Hello *seen = NULL, bool cut = false) {
+	fflush(stdout);
+	FILE *log = tmpfile();
+	int saved = dup(STDOUT_FILENO);
+	dup2(fileno(log), STDOUT_FILENO);
+
+	sockaddr_in client;
+	Hello hello;
+	hello = {};
+	bool ok = discover(&client, &hello, remoteName(path).c_str()) && sendFile(client, hello, path);
+	if(seen)
+		*seen = hello;
+
+	fflush(stdout);
+	dup2(saved, STDOUT_FILENO);
+	close(saved);
+	if(ok == cut) {
+		char line[256];
+		rewind(log);
+		while(fgets(line, sizeof(line), log))
+			printf("  host: %s", line);
+	}
+	fclose(log);
+	return ok;
+}
+
+// Another port puts dslink-shaper between the sender and the client
+static int sendPort = PORT;
+
+static bool runOnce(const CorpusFile &file, const std::string &mode, Result &result) {
+	std::string target = std::string(WORK_DIR "/corpus/") + file.name;
+	std::string base = target + ".base";
+	std::string received = std::string(WORK_DIR "/nds/") + file.name;
+
+	// Nothing left over from a failed run may be resumed
+	remove(WORK_DIR "/dslink.resume");
+	remove(received.c_str());
+	if((mode == "delta" || mode == "sig") && !writeFile(received, file.base))
+		return false;
+
+	hostOptions = HostOptions();
+	hostOptions.addresses = {"127.0.0.1"};
+	hostOptions.port = sendPort;
+	hostOptions.name = file.name.c_str();
+	if(mode == "raw") {
+		// Every chunk stored, so the client only copies
+		hostOptions.mode = MODE_ZLIB;
+		hostOptions.storeAbove = 0;
+	} else if(mode == "delta") {
+		hostOptions.mode = MODE_DELTA;
+		hostOptions.bases = {base.c_str()};
+	} else if(mode == "sig") {
+		// Against the client's copy, the host has none
+		hostOptions.mode = MODE_SIGNATURE;
+	} else {
+		hostOptions.mode = mode == "lz4" ? MODE_LZ4 : MODE_ZLIB;
+	}
+	hostStats = {};
+
+	int fd;
+	pid_t pid = startClient(&fd);
+	if(pid < 0)
+		return false;
+	u64 cpuBefore = cpuUs();
+	bool ok = sendQuietly(target.c_str());
+	u64 hostCpu = cpuUs() - cpuBefore;
+
+	ClientReport report = {};
+	if(ok)
+		ok = read(fd, &report, sizeof(report)) == sizeof(report) && report.ok;
+	else
+		kill(pid, SIGKILL);
+	close(fd);
+	waitpid(pid, NULL, 0);
+
+	std::vector<u8> got;
+	if(ok && (!readFile(received.c_str(), got) || got != file.data)) {
+		printf("  %s %s: received file differs\n", file.name.c_str(), mode.c_str());
+		ok = false;
+	}
+	if(!ok)
+		return false;
+
+	const PipelineStats &ps = report.pipeline;
+	u64 e2e = hostStats.connectTicks + hostStats.sendTicks + hostStats.responseTicks;
+	u64 transfer = ps.endTicks - ps.startTicks;
+	result.corpus = file.name;
+	result.mode = mode;
+	result.size = file.data.size();
+	// Both ways, the signature is on the air too
+	result.payload = hostStats.payloadBytes + hostStats.signatureBytes;
+	result.e2eMBs = e2e ? file.data.size() / (ticksToUs(e2e) / 1e6) / 1e6 : 0;
+	result.clientMBs = transfer ? ps.bytesOut / (ticksToUs(transfer) / 1e6) / 1e6 : 0;
+	// The client shares the machine, so encode is wall time and host cpu
+	// covers the encode as well as the sending
+	result.encodeMs = ticksToUs(hostStats.encodeTicks) / 1000.0;
+	result.hostCpuMs = hostCpu / 1000.0;
+	result.clientCpuMs = report.cpuUs / 1000.0;
+	result.writeMs = ticksToUs(ps.writeTicks) / 1000.0;
+	result.stallMs = ticksToUs(ps.netStallTicks) / 1000.0;
+	result.peakHeap = report.peakHeap;
+	return true;
+}
+
+// Cuts the connection cuts times at random points in the payload, each
+// resumed from the client's record, then lets the last attempt finish
+static bool runResume(const CorpusFile &file, const std::string &mode, int cuts) {
+	std::string target = std::string(WORK_DIR "/corpus/") + file.name;
+	std::string base = target + ".base";
+	std::string received = std::string(WORK_DIR "/nds/") + file.name;
+
+	remove(WORK_DIR "/dslink.resume");
+	remove(received.c_str());
+	if(mode == "delta" && !writeFile(received, file.base))
+		return false;
+
+	hostOptions = HostOptions();
+	hostOptions.addresses = {"127.0.0.1"};
+	hostOptions.port = sendPort;
+	hostOptions.name = file.name.c_str();
+	hostOptions.resume = 1;
+	hostOptions.mode = mode == "delta" ? MODE_DELTA : mode == "lz4" ? MODE_LZ4 : MODE_ZLIB;
+	if(mode == "delta")
+		hostOptions.bases = {base.c_str()};
+	hostStats = {};
+
+	int fd;
+	pid_t pid = startClient(&fd, cuts + 1);
+	if(pid < 0)
+		return false;
+
+	// Past the first record, which only comes once resumeInterval() bytes
+	// are written
+	std::string offsets;
+	bool ok = true;
+	for(int i = 0; i <= cuts && ok; i++) {
+		hostOptions.cutAt = i < cuts ? 0.5 + (rng() % 1000) / 2500.0 : 0;
+		Hello hello;
+		bool sent = sendQuietly(target.c_str(), &hello, i < cuts);
+		if(i > 0 && (hello.resumeOffset == 0 || hello.resumeName != file.name)) {
+			printf("  %s %s: no resume offer after cut %d\n", file.name.c_str(), mode.c_str(), i);
+			ok = false;
+		} else if(sent != (i == cuts)) {
+			printf("  %s %s: attempt %d %s\n", file.name.c_str(), mode.c_str(), i + 1, sent ? "wasn't cut" : "failed");
+			ok = false;
+		}
+		if(i > 0)
+			offsets += (i > 1 ? ", " : "") + std::to_string(hello.resumeOffset);
+	}
+
+	ClientReport report = {};
+	if(ok)
+		ok = read(fd, &report, sizeof(report)) == sizeof(report) && report.ok;
+	else
+		kill(pid, SIGKILL);
+	close(fd);
+	waitpid(pid, NULL, 0);
+
+	std::vector<u8> got;
+	if(ok && (!readFile(received.c_str(), got) || got != file.data)) {
+		printf("  %s %s: received file differs after %d cuts\n", file.name.c_str(), mode.c_str(), cuts);
+		ok = false;
+	}
+	if(ok)
+		printf("%-16s %-6s resumed from %s\n", file.name.c_str(), mode.c_str(), offsets.c_str());
+	return ok;
+}
+
+static void writeJson(FILE *fh, const Result &r) {
+	fprintf(fh, "{\"corpus\":\"%s\",\"mode\":\"%s\",\"size\":%zu,\"payload\":%zu,\"e2e_mbs\":%.3f,"
+	        "\"client_mbs\":%.3f,\"encode_ms\":%.3f,\"host_cpu_ms\":%.3f,\"client_cpu_ms\":%.3f,"
+	        "\"decode_cpu_ms\":%.3f,\"write_ms\":%.3f,\"net_stall_ms\":%.3f,\"peak_heap\":%zu}\n",
+	        r.corpus.c_str(), r.mode.c_str(), r.size, r.payload, r.e2eMBs, r.clientMBs, r.encodeMs, r.hostCpuMs,
+	        r.clientCpuMs, r.clientCpuMs - r.writeMs, r.writeMs, r.stallMs, r.peakHeap);
+}
+
+// Only reads what writeJson() writes
+static bool jsonNumber(const char *line, const char *key, double *value) {
+	char pattern[64];
+	snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+	const char *p = strstr(line, pattern);
+	return p && sscanf(p + strlen(pattern), "%lf", value) == 1;
+}
+
+static bool jsonString(const char *line, const char *key, std::string &value) {
+	char pattern[64];
+	snprintf(pattern, sizeof(pattern), "\"%s\":\"", key);
+	const char *p = strstr(line, pattern);
+	if(!p)
+		return false;
+	p += strlen(pattern);
+	const char *end = strchr(p, '"');
+	if(!end)
+		return false;
+	value.assign(p, end);
+	return true;
+}
+
+// Slower end to end or more client CPU by more than tolerance percent
+static int compareBaseline(const char *path, const std::vector<Result> &results, double tolerance) {
+	FILE *fh = fopen(path, "r");
+	if(!fh) {
+		printf("%s: can't read\n", path);
+		return -1;
+	}
+
+	printf("\nagainst %s:\n", path);
+	int regressions = 0;
+	char line[1024];
+	while(fgets(line, sizeof(line), fh)) {
+		std::string corpus, mode;
+		double e2e, cpu;
+		if(!jsonString(line, "corpus", corpus) || !jsonString(line, "mode", mode)
+				|| !jsonNumber(line, "e2e_mbs", &e2e) || !jsonNumber(line, "client_cpu_ms", &cpu))
+			continue;
+		for(const Result &r : results) {
+			if(r.corpus != corpus || r.mode != mode)
+				continue;
+			double e2eChange = 100 * (r.e2eMBs - e2e) / e2e, cpuChange = 100 * (r.clientCpuMs - cpu) / cpu;
+			bool worse = e2eChange < -tolerance || cpuChange > tolerance;
+			printf("  %-16s %-6s %9.2f MB/s (%+6.1f%%), client cpu %9.3f ms (%+6.1f%%)%s\n", corpus.c_str(),
+			       mode.c_str(), r.e2eMBs, e2eChange, r.clientCpuMs, cpuChange, worse ? "  REGRESSED" : "");
+			regressions += worse;
+		}
+	}
+	fclose(fh);
+	return regressions;
+}
+
+static size_t parseSize(const char *text) {
+	char *end;
+	size_t size = strtoul(text, &end, 10);
+	if(*end == 'K' || *end == 'k')
+		size <<= 10;
+	else if(*end == 'M' || *end == 'm')
+		size <<= 20;
+	return size;
+}
+
+static void split(const char *list, std::vector<std::string> &out) {
+	out.clear();
+	for(const char *p = list; *p;) {
+		const char *comma = strchr(p, ',');
+		size_t len = comma ? (size_t)(comma - p) : strlen(p);
+		out.emplace_back(p, len);
+		p += len + (comma ? 1 : 0);
+	}
+}
+
+int main(int argc, char **argv) {
+	const char *sizes = "256K,1M,4M,16M", *modes = "raw,zlib,delta", *jsonPath = NULL, *baseline = NULL;
+	int runs = 3, cuts = 0;
+	u32 seed = time(NULL);
+	double tolerance = 5;
+	int first = 1;
+	for(; first + 1 < argc && argv[first][0] == '-'; first += 2) {
+		if(strcmp(argv[first], "--sizes") == 0)
+			sizes = argv[first + 1];
+		else if(strcmp(argv[first], "--modes") == 0)
+			modes = argv[first + 1];
+		else if(strcmp(argv[first], "--runs") == 0)
+			runs = atoi(argv[first + 1]);
+		else if(strcmp(argv[first], "--json") == 0)
+			jsonPath = argv[first + 1];
+		else if(strcmp(argv[first], "--baseline") == 0)
+			baseline = argv[first + 1];
+		else if(strcmp(argv[first], "--tolerance") == 0)
+			tolerance = atof(argv[first + 1]);
+		else if(strcmp(argv[first], "--port") == 0)
+			sendPort = atoi(argv[first + 1]);
+		else if(strcmp(argv[first], "--cuts") == 0)
+			cuts = atoi(argv[first + 1]);
+		else if(strcmp(argv[first], "--seed") == 0)
+			seed = strtoul(argv[first + 1], NULL, 0);
+		else
+			break;
+	}
+	if((first < argc && argv[first][0] == '-') || runs < 1 || cuts < 0) {
+		printf("usage: %s [--sizes 256K,1M,...] [--modes raw,zlib,delta,lz4,sig] [--runs n]\n"
+		       "       [--json out.json] [--baseline old.json] [--tolerance percent]\n"
+		       "       [--port shaper port] [--cuts n] [--seed n] [file...]\n", argv[0]);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	clockInit();
+	mkdir(WORK_DIR, 0777);
+	mkdir(WORK_DIR "/corpus", 0777);
+	mkdir(WORK_DIR "/nds", 0777);
+
+	// Synthetic ROMs of each size, then any real ones given
+	std::vector<CorpusFile> corpus;
+	std::vector<std::string> list;
+	split(sizes, list);
+	for(const std::string &size : list) {
+		CorpusFile file;
+		file.name = "rom-" + size + ".nds";
+		makeRom(parseSize(size.c_str()), 1, file.base);
+		nextBuild(file.base, 2, file.data);
+		corpus.push_back(file);
+	}
+	for(int i = first; i < argc; i++) {
+		CorpusFile file;
+		const char *slash = strrchr(argv[i], '/');
+		file.name = slash ? slash + 1 : argv[i];
+		if(!readFile(argv[i], file.base)) {
+			printf("%s: can't read\n", argv[i]);
+			return 1;
+		}
+		nextBuild(file.base, 2, file.data);
+		corpus.push_back(file);
+	}
+	for(const CorpusFile &file : corpus) {
+		std::string path = std::string(WORK_DIR "/corpus/") + file.name;
+		if(!writeFile(path, file.data) || !writeFile(path + ".base", file.base)) {
+			printf("%s: can't write\n", path.c_str());
+			return 1;
+		}
+	}
+
+	split(modes, list);
+	printf("%-16s %-6s %10s %9s %9s %9s %9s %9s %9s %9s %9s\n", "corpus", "mode", "payload", "e2e MB/s",
+	       "cli MB/s", "encode", "host cpu", "cli cpu", "write", "stalls", "heap KiB");
+
+	std::vector<Result> results;
+	bool failed = false;
+	for(const CorpusFile &file : corpus) {
+		for(const std::string &mode : list) {
+			// The median run by end to end speed
+			std::vector<Result> tries;
+			for(int i = 0; i < runs; i++) {
+				Result result;
+				if(!runOnce(file, mode, result))
+					break;
+				tries.push_back(result);
+			}
+			if((int)tries.size() != runs) {
+				printf("%-16s %-6s failed\n", file.name.c_str(), mode.c_str());
+				failed = true;
+				continue;
+			}
+			std::sort(tries.begin(), tries.end(), [](const Result &a, const Result &b) { return a.e2eMBs < b.e2eMBs; });
+			const Result &r = tries[runs / 2];
+			printf("%-16s %-6s %10zu %9.2f %9.2f %9.1f %9.1f %9.1f %9.1f %9.1f %9zu\n", r.corpus.c_str(),
+			       r.mode.c_str(), r.payload, r.e2eMBs, r.clientMBs, r.encodeMs, r.hostCpuMs, r.clientCpuMs,
+			       r.writeMs, r.stallMs, r.peakHeap / 1024);
+			results.push_back(r);
+		}
+	}
+	printf("times in ms, CPU for the cpu columns, wall for encode, write and stalls\n");
+
+	// Files too small for a record before the cut have nothing to resume
+	if(cuts) {
+		printf("\nresume, %d cuts each, seed %u:\n", cuts, (unsigned)seed);
+		rngState = seed ? seed : 1;
+		for(const CorpusFile &file : corpus) {
+			for(const std::string &mode : list) {
+				if(mode != "zlib" && mode != "delta" && mode != "lz4")
+					continue;
+				if(file.data.size() < 4 * RESUME_INTERVAL_MIN) {
+					printf("%-16s %-6s too small to resume\n", file.name.c_str(), mode.c_str());
+					continue;
+				}
+				if(!runResume(file, mode, cuts)) {
+					printf("%-16s %-6s resume failed\n", file.name.c_str(), mode.c_str());
+					failed = true;
+				}
+			}
+		}
+	}
+
+	if(jsonPath) {
+		FILE *fh = fopen(jsonPath, "w");
+		if(!fh) {
+			printf("%s: can't write\n", jsonPath);
+			return 1;
+		}
+		for(const Result &r : results)
+			writeJson(fh, r);
+		fclose(fh);
+	}
+
+	int regressions = baseline ? compareBaseline(baseline, results, tolerance) : 0;
+	return failed || regressions != 0 ? 1 : 0;
+}
@@ -0,0 +1,96 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#include "lz4enc.h"
+
+#include <string.h>
+
+#define HASH_BITS 12
+#define MIN_MATCH 4
+#define LAST_LITERALS 5 // the format ends every block with at least this many literals
+#define MATCH_LIMIT 12  // and no match may start closer than this to the end
+#define MAX_OFFSET 65535
+
+static inline u32 read32(const u8 *p) {
+	u32 v;
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static inline u32 hash(u32 v) {
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static u8 *putLength(u8 *op, u32 len) {
+	for(; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+	return op;
+}
+
+static u8 *putSequence(u8 *op, const u8 *lit, u32 litLen, u32 offset, u32 matchLen) {
+	u8 *token = op++;
+	*token = (litLen >= 15 ? 15 : litLen) << 4;
+	if(litLen >= 15)
+		op = putLength(op, litLen - 15);
+	memcpy(op, lit, litLen);
+	op += litLen;
+	if(matchLen == 0)
+		return op;
+
+	*op++ = offset;
+	*op++ = offset >> 8;
+	matchLen -= MIN_MATCH;
+	*token |= matchLen >= 15 ? 15 : matchLen;
+	if(matchLen >= 15)
+		op = putLength(op, matchLen - 15);
+	return op;
+}
+
+// A sequence is at most a token, the literals and their length bytes, two
+// offset bytes and the match length bytes
+static inline bool fits(u32 used, u32 litLen, u32 matchLen, u32 capacity) {
+	return used + 1 + litLen + litLen / 255 + 1 + 2 + matchLen / 255 + 1 <= capacity;
+}
+
+int lz4EncodeBlock(const u8 *src, u32 size, u8 *dst, u32 capacity) {
+	// Positions plus one so that zero means empty
+	static u32 table[1 << HASH_BITS];
+	memset(table, 0, sizeof(table));
+
+	u8 *op = dst;
+	u32 ip = 0, anchor = 0, misses = 0;
+	if(size > MATCH_LIMIT) {
+		u32 limit = size - MATCH_LIMIT;
+		while(ip < limit) {
+			u32 v = read32(src + ip);
+			u32 h = hash(v);
+			u32 ref = table[h];
+			table[h] = ip + 1;
+
+			if(ref == 0 || ip - (ref - 1) > MAX_OFFSET || read32(src + ref - 1) != v) {
+				// Skip faster through data that isn't matching
+				ip += 1 + (misses++ >> 6);
+				continue;
+			}
+			ref--;
+			misses = 0;
+
+			u32 len = MIN_MATCH;
+			while(ip + len < size - LAST_LITERALS && src[ref + len] == src[ip + len])
+				len++;
+
+			if(!fits(op - dst, ip - anchor, len, capacity))
+				return -1;
+			op = putSequence(op, src + anchor, ip - anchor, ip - ref, len);
+			ip += len;
+			anchor = ip;
+		}
+	}
+
+	if(!fits(op - dst, size - anchor, 0, capacity))
+		return -1;
+	op = putSequence(op, src + anchor, size - anchor, 0, 0);
+	return op - dst;
+}
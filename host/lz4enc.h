@@ -0,0 +1,15 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#ifndef LZ4ENC_H
+#define LZ4ENC_H
+
+#include "platform.h"
+
+// Greedy single-probe LZ4 block compressor, the host side of lz4.h. Returns
+// the compressed size, or -1 if it would not fit in capacity, which never
+// happens with LZ4_BOUND(size).
+int lz4EncodeBlock(const u8 *src, u32 size, u8 *dst, u32 capacity);
+
+#endif // LZ4ENC_H
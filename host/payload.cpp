@@ -0,0 +1,225 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#include "payload.h"
+#include "chunker.h"
+#include "lz4.h"
+#include "lz4enc.h"
+#include "pipeline.h"
+#include "protocol.h"
+#include "signature.h"
+#include "transfer.h"
+
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+#include "xdelta3.h"
+
+static void splitChunks(const u8 *data, size_t size, Payload &out) {
+	for(size_t pos = 0; pos < size; pos += CHUNK_SIZE) {
+		size_t n = size - pos < CHUNK_SIZE ? size - pos : CHUNK_SIZE;
+		out.push_back({0, std::vector<u8>(data + pos, data + pos + n)});
+	}
+}
+
+void encodeZlib(const u8 *src, size_t size, int level, Payload &out) {
+	uLongf len = compressBound(size);
+	std::vector<u8> stream(len);
+	compress2(stream.data(), &len, src, size, level);
+	splitChunks(stream.data(), len, out);
+}
+
+void encodeLz4(const u8 *src, size_t size, Payload &out) {
+	u8 block[LZ4_BOUND(LZ4_BLOCK_SIZE)];
+	for(size_t pos = 0; pos < size; pos += LZ4_BLOCK_SIZE) {
+		u32 n = size - pos < LZ4_BLOCK_SIZE ? size - pos : LZ4_BLOCK_SIZE;
+		int len = lz4EncodeBlock(src + pos, n, block, sizeof(block));
+		out.push_back({0, std::vector<u8>(block, block + len)});
+	}
+}
+
+size_t encodeStored(const u8 *src, size_t size, int level, double storeAbove, Payload &out) {
+	std::vector<u8> framed;
+	size_t stored = chunkAdaptive(src, size, level, storeAbove, framed);
+	for(size_t pos = 0; pos < framed.size();) {
+		u32 header;
+		memcpy(&header, framed.data() + pos, 4);
+		u32 len = header & ~CHUNK_FLAGS;
+		const u8 *data = framed.data() + pos + 4;
+		out.push_back({header & CHUNK_FLAGS, std::vector<u8>(data, data + len)});
+		pos += 4 + len;
+	}
+	return stored;
+}
+
+bool encodeDelta(const u8 *base, size_t baseSize, const u8 *src, size_t size, u32 window, Payload &out) {
+	xd3_stream stream;
+	xd3_config config;
+	xd3_init_config(&config, XD3_ADLER32);
+	config.winsize = window;
+	if(xd3_config_stream(&stream, &config) != 0)
+		return false;
+
+	// The whole base is in memory, blocks are handed out as they are asked for.
+	// max_winsize is how much of it is indexed for matches, all of it.
+	xd3_source source = {};
+	source.blksize = XDELTA_SRC_BLOCK;
+	source.max_winsize = baseSize;
+	source.curblkno = (xoff_t)-1;
+	xd3_set_source_and_size(&stream, &source, baseSize);
+
+	std::vector<u8> delta;
+	size_t pos = 0;
+	bool ok = true, more = true;
+	while(ok && more) {
+		u32 n = size - pos < window ? size - pos : window;
+		if(n < window) {
+			xd3_set_flags(&stream, XD3_FLUSH | stream.flags);
+			more = false;
+		}
+		xd3_avail_input(&stream, src + pos, n);
+		pos += n;
+
+		// Until xdelta wants the next window
+		int ret;
+		while(ok && (ret = xd3_encode_input(&stream)) != XD3_INPUT) {
+			switch(ret) {
+				case XD3_OUTPUT:
+					delta.insert(delta.end(), stream.next_out, stream.next_out + stream.avail_out);
+					xd3_consume_output(&stream);
+					break;
+				case XD3_GETSRCBLK: {
+					xoff_t start = source.getblkno * source.blksize;
+					source.curblkno = source.getblkno;
+					source.curblk = base + start;
+					source.onblk = baseSize - start < source.blksize ? baseSize - start : source.blksize;
+					break;
+				}
+				case XD3_GOTHEADER:
+				case XD3_WINSTART:
+				case XD3_WINFINISH:
+					break;
+				default:
+					printf("xdelta: %s\n", stream.msg ? stream.msg : xd3_strerror(ret));
+					ok = false;
+					break;
+			}
+		}
+	}
+
+	xd3_close_stream(&stream);
+	xd3_free_stream(&stream);
+	if(ok)
+		splitChunks(delta.data(), delta.size(), out);
+	return ok;
+}
+
+void encodeSlices(const u8 *src, size_t size, std::vector<Slice> &out) {
+	u8 block[LZ4_BOUND(FLEET_MAX_SLICE)];
+	for(size_t pos = 0; pos < size;) {
+		u32 n = size - pos < FLEET_MAX_SLICE ? size - pos : FLEET_MAX_SLICE;
+		int len = lz4EncodeBlock(src + pos, n, block, sizeof(block));
+		// Shrink to the ratio this one got, with a little to spare
+		while(len > FLEET_PAYLOAD && n > FLEET_PAYLOAD) {
+			n = std::max<u32>(FLEET_PAYLOAD, (u64)n * FLEET_PAYLOAD / len * 15 / 16);
+			len = lz4EncodeBlock(src + pos, n, block, sizeof(block));
+		}
+
+		if(len > FLEET_PAYLOAD || (u32)len >= n)
+			out.push_back({(u32)pos, (u16)n, std::vector<u8>(src + pos, src + pos + n)});
+		else
+			out.push_back({(u32)pos, (u16)n, std::vector<u8>(block, block + len)});
+		pos += n;
+	}
+}
+
+// Appends an op to the last chunk, or starts a new one if it won't fit
+static void putOp(Payload &out, const u32 header[2], const u8 *data, u32 size) {
+	if(out.empty() || out.back().data.size() + 8 + size > CHUNK_SIZE)
+		out.push_back({0, {}});
+	std::vector<u8> &chunk = out.back().data;
+	chunk.insert(chunk.end(), (const u8 *)header, (const u8 *)header + 8);
+	chunk.insert(chunk.end(), data, data + size);
+}
+
+static void putLiteral(Payload &out, const u8 *src, size_t size) {
+	u8 block[LZ4_BOUND(LZ4_BLOCK_SIZE)];
+	for(size_t pos = 0; pos < size; pos += LZ4_BLOCK_SIZE) {
+		u32 n = size - pos < LZ4_BLOCK_SIZE ? size - pos : LZ4_BLOCK_SIZE;
+		int len = lz4EncodeBlock(src + pos, n, block, sizeof(block));
+		bool packed = len < (int)n;
+		u32 header[2] = {n, packed ? (u32)len : n};
+		putOp(out, header, packed ? block : src + pos, header[1]);
+	}
+}
+
+void encodeSignature(const u8 *src, size_t size, u32 blockSize, const std::vector<u32> &signature, Payload &out) {
+	// Blocks sorted by rolling checksum, with a bitmap of them to skip the
+	// search at most offsets
+	u32 count = signature.size() / 2;
+	std::vector<u32> order(count);
+	std::vector<bool> seen(1 << 16);
+	for(u32 i = 0; i < count; i++) {
+		order[i] = i;
+		seen[(signature[2 * i] ^ signature[2 * i] >> 16) & 0xFFFF] = true;
+	}
+	std::sort(order.begin(), order.end(), [&](u32 a, u32 b) { return signature[2 * a] < signature[2 * b]; });
+
+	size_t pos = 0, literal = 0;
+	u32 weak = 0, copyFirst = 0, copyCount = 0;
+	bool rolling = false;
+	while(pos + blockSize <= size) {
+		weak = rolling ? rollChecksum(weak, src[pos - 1], src[pos + blockSize - 1], blockSize) : rollingChecksum(src + pos, blockSize);
+		rolling = true;
+
+		// The block after the last copy wins, it extends the copy
+		s64 match = -1;
+		if(seen[(weak ^ weak >> 16) & 0xFFFF]) {
+			auto it = std::lower_bound(order.begin(), order.end(), weak, [&](u32 i, u32 sum) { return signature[2 * i] < sum; });
+			u32 strong = 0;
+			for(bool hashed = false; it != order.end() && signature[2 * *it] == weak; ++it) {
+				if(!hashed) {
+					strong = crc32(0, src + pos, blockSize);
+					hashed = true;
+				}
+				if(signature[2 * *it + 1] != strong)
+					continue;
+				match = *it;
+				if(copyCount && *it == copyFirst + copyCount)
+					break;
+			}
+		}
+		if(match < 0) {
+			pos++;
+			continue;
+		}
+
+		if(copyCount && (literal < pos || match != copyFirst + copyCount)) {
+			u32 header[2] = {SIG_COPY | copyCount, copyFirst};
+			putOp(out, header, NULL, 0);
+			copyCount = 0;
+		}
+		putLiteral(out, src + literal, pos - literal);
+		if(!copyCount)
+			copyFirst = match;
+		copyCount++;
+		pos += blockSize;
+		literal = pos;
+		rolling = false;
+	}
+
+	if(copyCount) {
+		u32 header[2] = {SIG_COPY | copyCount, copyFirst};
+		putOp(out, header, NULL, 0);
+	}
+	putLiteral(out, src + literal, size - literal);
+}
+
+size_t payloadSize(const Payload &payload) {
+	size_t size = 0;
+	for(const Chunk &chunk : payload)
+		size += chunk.data.size();
+	return size;
+}
@@ -0,0 +1,50 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include "platform.h"
+
+#include <vector>
+
+// One payload chunk as the client receives it, before framing
+struct Chunk {
+	u32 flags; // CHUNK_
+	std::vector<u8> data;
+};
+
+typedef std::vector<Chunk> Payload;
+
+// Host side encoders for each transfer mode. Every chunk fits a receive slot.
+void encodeZlib(const u8 *src, size_t size, int level, Payload &out);
+void encodeLz4(const u8 *src, size_t size, Payload &out);
+
+// zlib with incompressible blocks sent as CHUNK_STORED, see chunker.h.
+// Returns how many bytes of src went out stored.
+size_t encodeStored(const u8 *src, size_t size, int level, double storeAbove, Payload &out);
+
+// VCDIFF of src against base, in windows of the given size. False if
+// xdelta fails.
+bool encodeDelta(const u8 *base, size_t baseSize, const u8 *src, size_t size, u32 window, Payload &out);
+
+// MODE_SIGNATURE ops that rebuild src from the client's file, given its
+// signature as rolling checksum and crc32 pairs of each block
+void encodeSignature(const u8 *src, size_t size, u32 blockSize, const std::vector<u32> &signature, Payload &out);
+
+size_t payloadSize(const Payload &payload);
+
+// A MODE_FLEET datagram body: file[offset:offset+size] as one LZ4 block, or
+// as is when data.size() == size
+struct Slice {
+	u32 offset;
+	u16 size;
+	std::vector<u8> data;
+};
+
+// Cuts src into slices that each fit one datagram, as long as LZ4 keeps
+// them under FLEET_PAYLOAD bytes
+void encodeSlices(const u8 *src, size_t size, std::vector<Slice> &out);
+
+#endif // PAYLOAD_H
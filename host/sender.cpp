@@ -0,0 +1,1286 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#include "sender.h"
+#include "adler.h"
+#include "clock.h"
+#include "payload.h"
+#include "pipeline.h"
+#include "protocol.h"
+#include "signature.h"
+#include "transfer.h"
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <netinet/tcp.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <zlib.h>
+
+#define DISCOVERY_TRIES 10
+#define DISCOVERY_WAIT_MS 300
+// The client writes the last slots to SD before it answers
+#define RESPONSE_TIMEOUT_MS 30000
+#define FLEET_MAX_ROUNDS 32
+#define FLEET_SETTLE_MS 20
+
+HostOptions hostOptions;
+HostStats hostStats;
+
+static const char *modeName(int mode) {
+	static const char *names[] = {"zlib", "delta", "legacy", "sync", "lz4", "fleet", "signature", "cached"};
+	return mode >= 0 && mode <= MODE_CACHED ? names[mode] : "?";
+}
+
+static bool readFile(const char *path, std::vector<u8> &data) {
+	FILE *fh = fopen(path, "rb");
+	if(!fh)
+		return false;
+	fseek(fh, 0, SEEK_END);
+	data.resize(ftell(fh));
+	fseek(fh, 0, SEEK_SET);
+	bool ok = fread(data.data(), 1, data.size(), fh) == data.size();
+	fclose(fh);
+	return ok;
+}
+
+static u32 checksum(const u8 *data, size_t size) {
+	return adlerUpdate(ADLER_INIT, data, size);
+}
+
+static const u8 *get(const u8 *p, void *data, int size) {
+	memcpy(data, p, size);
+	return p + size;
+}
+
+static void put(std::vector<u8> &buf, const void *data, size_t size) {
+	buf.insert(buf.end(), (const u8 *)data, (const u8 *)data + size);
+}
+
+// The hello after SEND_MAGIC_DELTA, see protocol.h
+static void parseHello(const u8 *p, int len, Hello *hello) {
+	*hello = {};
+	if(len < 39)
+		return;
+
+	u32 limits[4], state[4];
+	u8 namelen;
+	p = get(p, &hello->version, 1);
+	p = get(p, &hello->flags, 1);
+	p = get(p, &hello->codecs, 2);
+	p = get(p, limits, sizeof(limits));
+	p = get(p, &hello->secondary, 1);
+	p = get(p, &hello->resumeMode, 1);
+	p = get(p, state, sizeof(state));
+	p = get(p, &namelen, 1);
+	hello->maxChunk = limits[0];
+	hello->freeRam = limits[1];
+	hello->srcCache = limits[2];
+	hello->window = limits[3];
+	hello->resumeLen = state[0];
+	hello->resumeBase = state[1];
+	hello->resumeOffset = state[2];
+	hello->resumeChecksum = state[3];
+	if(39 + namelen > len)
+		return;
+	hello->resumeName.assign((const char *)p, namelen);
+	p += namelen;
+
+	u16 count;
+	if(!(hello->flags & HELLO_BEACON) || 39 + namelen + 18 > len)
+		return;
+	p = get(p, &hello->console, 1);
+	p = get(p, &hello->freeKiB, 4);
+	p = get(p, &hello->fileState, 1);
+	p = get(p, &hello->fileSize, 4);
+	p = get(p, &hello->fileChecksum, 4);
+	p = get(p, &hello->files, 2);
+	p = get(p, &count, 2);
+	if(39 + namelen + 18 + 8 * count > len)
+		return;
+	hello->held.resize(2 * count);
+	p = get(p, hello->held.data(), 8 * count);
+
+	int used = 39 + namelen + 18 + 8 * count;
+	u8 cached;
+	if(!(hello->flags & HELLO_CACHE) || used + 1 > len)
+		return;
+	p = get(p, &cached, 1);
+	if(used + 1 + 8 * cached <= len) {
+		hello->cached.resize(2 * cached);
+		get(p, hello->cached.data(), 8 * cached);
+	}
+}
+
+static void printBeacon(const Hello &hello) {
+	static const char *consoles[] = {"DS", "DSi", "POSIX"};
+	printf("  %s, %u KiB RAM, ", hello.console <= CONSOLE_POSIX ? consoles[hello.console] : "?", (unsigned)(hello.freeRam / 1024));
+	if(hello.freeKiB == BEACON_FREE_UNKNOWN)
+		printf("storage unknown");
+	else
+		printf("%u KiB free", (unsigned)hello.freeKiB);
+	printf(", %u files in /nds", (unsigned)hello.files);
+	if(!hello.cached.empty())
+		printf(", %zu cached builds", hello.cached.size() / 2);
+	if(hello.fileState == BEACON_FILE_PRESENT)
+		printf(", has it (%u bytes)", (unsigned)hello.fileSize);
+	else if(hello.fileState == BEACON_FILE_MISSING)
+		printf(", doesn't have it");
+	printf("\n");
+}
+
+// Pings every address until want clients have answered or the tries run
+// out, returns how many did
+static size_t discoverClients(size_t want, const char *query, std::vector<sockaddr_in> &clients, std::vector<Hello> &hellos) {
+	u64 start = clockTicks();
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	int on = 1;
+	setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+
+	std::vector<sockaddr_in> targets;
+	for(const char *address : hostOptions.addresses) {
+		sockaddr_in to = {};
+		to.sin_family = AF_INET;
+		to.sin_port = htons(hostOptions.port);
+		to.sin_addr.s_addr = inet_addr(address);
+		targets.push_back(to);
+	}
+	if(targets.empty()) {
+		sockaddr_in to = {};
+		to.sin_family = AF_INET;
+		to.sin_port = htons(hostOptions.port);
+		to.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+		targets.push_back(to);
+	}
+
+	// DS clients answer on the link port. Over loopback the POSIX client owns
+	// that port and answers the sender instead.
+	bool loopback = true;
+	for(const sockaddr_in &to : targets)
+		loopback = loopback && ntohl(to.sin_addr.s_addr) >> 24 == 127;
+	if(!loopback) {
+		sockaddr_in local = {};
+		local.sin_family = AF_INET;
+		local.sin_port = htons(PORT);
+		local.sin_addr.s_addr = htonl(INADDR_ANY);
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if(bind(sock, (sockaddr *)&local, sizeof(local)) < 0)
+			printf("can't bind port %d, DS replies will be missed\n", PORT);
+	}
+
+	// v1 pings are the bare magic, which v2 clients answer without a hello
+	const int magicLen = sizeof(RECV_MAGIC_DELTA) - 1;
+	u8 ping[magicLen + 2 + 255];
+	memcpy(ping, RECV_MAGIC_DELTA, magicLen);
+	ping[magicLen] = hostOptions.version;
+	int pingLen = hostOptions.version >= PROTOCOL_V2 ? magicLen + 1 : magicLen;
+	size_t querylen = query ? strlen(query) : 0;
+	if(hostOptions.version >= PROTOCOL_V2 && querylen > 0 && querylen < 256) {
+		ping[pingLen++] = querylen;
+		memcpy(ping + pingLen, query, querylen);
+		pingLen += querylen;
+	}
+
+	for(int tries = 0; tries < DISCOVERY_TRIES && clients.size() < want; tries++) {
+		for(const sockaddr_in &to : targets)
+			sendto(sock, ping, pingLen, 0, (const sockaddr *)&to, sizeof(to));
+
+		u64 deadline = clockTicks() + msToTicks(DISCOVERY_WAIT_MS);
+		pollfd pfd = {sock, POLLIN, 0};
+		for(u64 now; clients.size() < want && (now = clockTicks()) < deadline;) {
+			if(poll(&pfd, 1, ticksToMs(deadline - now) + 1) <= 0)
+				break;
+
+			u8 reply[2048];
+			sockaddr_in from;
+			socklen_t fromLen = sizeof(from);
+			int len = recvfrom(sock, reply, sizeof(reply), 0, (sockaddr *)&from, &fromLen);
+			const int replyMagicLen = sizeof(SEND_MAGIC_DELTA) - 1;
+			if(len < replyMagicLen || memcmp(reply, SEND_MAGIC_DELTA, replyMagicLen) != 0)
+				continue;
+
+			// Every ping gets an answer, each client only counts once
+			from.sin_port = htons(hostOptions.port);
+			bool known = false;
+			for(const sockaddr_in &client : clients)
+				known = known || client.sin_addr.s_addr == from.sin_addr.s_addr;
+			if(known)
+				continue;
+
+			Hello hello;
+			parseHello(reply + replyMagicLen, len - replyMagicLen, &hello);
+			clients.push_back(from);
+			hellos.push_back(hello);
+			printf("Found v%d client at %s\n", hello.version ? hello.version : PROTOCOL_V1, inet_ntoa(from.sin_addr));
+			if(hello.flags & HELLO_BEACON)
+				printBeacon(hello);
+		}
+	}
+
+	close(sock);
+	hostStats.discoverTicks += clockTicks() - start;
+	if(clients.empty())
+		printf("No client found\n");
+	return clients.size();
+}
+
+std::string remoteName(const char *path) {
+	const char *slash = strrchr(path, '/');
+	return hostOptions.name ? hostOptions.name : slash ? slash + 1 : path;
+}
+
+bool discover(sockaddr_in *client, Hello *hello, const char *query) {
+	std::vector<sockaddr_in> clients;
+	std::vector<Hello> hellos;
+	if(!discoverClients(1, query, clients, hellos))
+		return false;
+	*client = clients[0];
+	*hello = hellos[0];
+	return true;
+}
+
+size_t discoverFleet(std::vector<sockaddr_in> &clients, std::vector<Hello> &hellos) {
+	size_t found = discoverClients(hostOptions.fleet, NULL, clients, hellos);
+	if(found && found < (size_t)hostOptions.fleet)
+		printf("Found %zu of %d clients\n", found, hostOptions.fleet);
+	return found;
+}
+
+static int connectClient(const sockaddr_in &client) {
+	u64 start = clockTicks();
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if(connect(sock, (const sockaddr *)&client, sizeof(client)) < 0) {
+		printf("connect: %s\n", strerror(errno));
+		close(sock);
+		return -1;
+	}
+	// Chunks go out whole, headers corked onto their data, so Nagle only
+	// holds back the tail of each one. After the client has sent something
+	// itself, as in signature and sync mode, it delays its ACKs and every
+	// chunk would wait out the delay.
+	int on = 1;
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	hostStats.connectTicks += clockTicks() - start;
+	return sock;
+}
+
+// The connection to the client and how it is going
+struct Link {
+	int sock;
+	bool checked;
+	bool closed;    // the client stopped reading
+	bool responded; // what it sent next wasn't a NACK or an ACK
+	u32 acked = 0;  // checked mode: chunks the client is done with
+};
+
+enum { LINK_IDLE, LINK_RESPONSE, LINK_CLOSED };
+
+// more: the rest follows at once, hold this back to go out with it
+static bool sendAll(Link &link, const void *data, size_t size, bool more = false) {
+	const u8 *p = (const u8 *)data;
+	while(size && !link.closed) {
+		ssize_t len = send(link.sock, p, size, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+		if(len < 0 && errno == EINTR)
+			continue;
+		if(len <= 0) {
+			link.closed = true;
+			break;
+		}
+		hostStats.wireBytes += len;
+		p += len;
+		size -= len;
+	}
+	return !link.closed;
+}
+
+static bool recvAll(Link &link, void *data, size_t size) {
+	// A zero length recv() waits for data that may never come
+	if(size && recv(link.sock, data, size, MSG_WAITALL) != (ssize_t)size) {
+		link.closed = true;
+		return false;
+	}
+	return true;
+}
+
+static bool sendChunk(Link &link, const Payload &payload, u32 seq, bool corrupt) {
+	const Chunk &chunk = payload[seq];
+	u32 size = chunk.data.size();
+	u32 header[3] = {size | chunk.flags, seq, (u32)crc32(0, chunk.data.data(), size)};
+	if(!sendAll(link, header, link.checked ? 12 : 4, true))
+		return false;
+	if(!corrupt)
+		return sendAll(link, chunk.data.data(), size);
+
+	std::vector<u8> damaged = chunk.data;
+	damaged[size / 2] ^= 0xFF;
+	return sendAll(link, damaged.data(), size);
+}
+
+// Resends what the client NACKs and takes its ACKs until it sends something
+// else, stays quiet for timeoutMs or has ACKed up to acked (0 for no limit)
+static int serviceNacks(Link &link, const Payload *payload, int timeoutMs, u32 acked = 0) {
+	while(!link.closed) {
+		if(link.responded)
+			return LINK_RESPONSE;
+		if(acked && link.acked >= acked)
+			return LINK_IDLE;
+
+		pollfd pfd = {link.sock, POLLIN, 0};
+		if(poll(&pfd, 1, timeoutMs) <= 0)
+			return LINK_IDLE;
+
+		u32 nack[2];
+		int len = recv(link.sock, nack, 4, MSG_PEEK | MSG_WAITALL);
+		if(len < 4) {
+			link.closed = true;
+			break;
+		}
+		if((nack[0] != NACK_MAGIC && nack[0] != ACK_MAGIC) || !payload) {
+			link.responded = true;
+			continue;
+		}
+		if(!recvAll(link, nack, sizeof(nack)))
+			break;
+		if(nack[0] == ACK_MAGIC) {
+			if(nack[1] > link.acked)
+				link.acked = nack[1];
+			continue;
+		}
+		if(nack[1] >= payload->size()) {
+			printf("NACK for chunk %u of %zu\n", (unsigned)nack[1], payload->size());
+			link.closed = true;
+			break;
+		}
+		hostStats.nacks++;
+		hostStats.resentBytes += (*payload)[nack[1]].data.size();
+		sendChunk(link, *payload, nack[1], false);
+	}
+	return LINK_CLOSED;
+}
+
+// Stops early if the client answers before the end, which it only does when
+// it has given up on the payload
+static int sendPayload(Link &link, const Payload &payload, bool terminated) {
+	// As if the wire went, for the resume tests
+	size_t cut = hostOptions.cutAt > 0 ? payloadSize(payload) * hostOptions.cutAt : 0, sent = 0;
+	for(u32 seq = 0; seq < payload.size(); seq++) {
+		if(cut && sent + payload[seq].data.size() > cut) {
+			printf("Cutting the connection after %zu of %zu payload bytes\n", sent, payloadSize(payload));
+			shutdown(link.sock, SHUT_RDWR);
+			link.closed = true;
+			return LINK_CLOSED;
+		}
+		if(link.checked && seq >= link.acked + CHECKED_WINDOW) {
+			// The client has no slot for it until it is done with another
+			int state = serviceNacks(link, &payload, RESPONSE_TIMEOUT_MS, seq - CHECKED_WINDOW + 1);
+			if(state != LINK_IDLE)
+				return state;
+			if(seq >= link.acked + CHECKED_WINDOW) {
+				printf("no ACK for chunk %u\n", (unsigned)(seq - CHECKED_WINDOW));
+				return LINK_CLOSED;
+			}
+		}
+		bool corrupt = link.checked && hostOptions.corruptEvery && seq % hostOptions.corruptEvery == hostOptions.corruptEvery - 1;
+		if(!sendChunk(link, payload, seq, corrupt))
+			return LINK_CLOSED;
+		sent += payload[seq].data.size();
+		hostStats.chunks++;
+		int state = serviceNacks(link, &payload, 0);
+		if(state != LINK_IDLE)
+			return state;
+	}
+
+	if(terminated) {
+		u32 end[3] = {0, (u32)payload.size(), 0};
+		if(!sendAll(link, end, link.checked ? 12 : 4))
+			return LINK_CLOSED;
+	}
+	return LINK_IDLE;
+}
+
+// The last client stats record, for the log
+static u32 clientStats[STATS_COUNT];
+static bool clientReported;
+
+static bool readClientStats(Link &link) {
+	u32 count;
+	if(!recvAll(link, &count, 4) || count > 256)
+		return false;
+	memset(clientStats, 0, sizeof(clientStats));
+	for(u32 i = 0; i < count; i++) {
+		u32 field;
+		if(!recvAll(link, &field, 4))
+			return false;
+		if(i < STATS_COUNT)
+			clientStats[i] = field;
+	}
+	for(int i = 0; i < STATS_COUNT; i++)
+		hostStats.client[i] += clientStats[i];
+	hostStats.clientReports++;
+	clientReported = true;
+	return true;
+}
+
+// The final response, after the stats record if the client sends one
+static bool readResponse(Link &link, const Payload *payload, s32 *response) {
+	if(serviceNacks(link, payload, RESPONSE_TIMEOUT_MS) != LINK_RESPONSE || !recvAll(link, response, 4)
+			|| ((u32)*response == STATS_MAGIC && (!readClientStats(link) || !recvAll(link, response, 4)))) {
+		printf("no response\n");
+		return false;
+	}
+	link.responded = false;
+	return true;
+}
+
+// 3dslink style: arg0 is the path to launch, then the extra arguments, each
+// NUL terminated
+static std::string buildCmdline(const std::string &path) {
+	std::string cmdline;
+	if(!path.empty()) {
+		cmdline = "sdmc:/3ds/" + path;
+		cmdline.push_back(0);
+	}
+	for(const char *arg : hostOptions.args) {
+		cmdline += arg;
+		cmdline.push_back(0);
+	}
+	if(cmdline.size() >= 256)
+		printf("command line over 255 bytes, the client will ignore it\n");
+	return cmdline;
+}
+
+static bool sendCmdline(Link &link, const std::string &cmdline) {
+	u32 cmdlen = cmdline.size();
+	return sendAll(link, &cmdlen, 4) && sendAll(link, cmdline.data(), cmdlen);
+}
+
+static bool encode(int mode, const Hello &hello, const std::vector<u8> &target, u32 start,
+                   const std::vector<u8> *base, bool stored, Payload &payload) {
+	u64 begin = clockTicks();
+	const u8 *src = target.data() + start;
+	size_t size = target.size() - start;
+	payload.clear();
+
+	bool ok = true;
+	if(mode == MODE_DELTA)
+		ok = encodeDelta(base->data(), base->size(), src, size, hello.window ? hello.window : XDELTA_WINSIZE, payload);
+	else if(mode == MODE_LZ4)
+		encodeLz4(src, size, payload);
+	else if(stored)
+		hostStats.storedBytes += encodeStored(src, size, hostOptions.level, hostOptions.storeAbove, payload);
+	else
+		encodeZlib(src, size, hostOptions.level, payload);
+
+	hostStats.encodeTicks += clockTicks() - begin;
+	hostStats.rawBytes += size;
+	hostStats.payloadBytes += payloadSize(payload);
+	return ok;
+}
+
+// Mode flags the client can take. v2 clients list them, v1 clients only get
+// what was asked for explicitly. Files under RESUME_MIN_SIZE are quicker to
+// send again than to keep resume records for.
+static u8 modeFlags(const Hello &hello, int mode, size_t size) {
+	u8 offered = hello.version >= PROTOCOL_V2 ? hello.flags : 0xFF;
+	u8 flags = 0;
+	bool resume = hostOptions.resume == 1 || (hostOptions.resume == -1 && hello.version >= PROTOCOL_V2 && size >= RESUME_MIN_SIZE);
+	if(mode != MODE_SYNC && mode != MODE_SIGNATURE && (offered & HELLO_RESUME) && resume)
+		flags |= MODE_FLAG_RESUME;
+	if(mode != MODE_SYNC && hostOptions.checked && (offered & HELLO_CHECKED))
+		flags |= MODE_FLAG_CHECKED;
+	if((mode == MODE_ZLIB || mode == MODE_SYNC) && hostOptions.storeAbove >= 0 && (offered & HELLO_STORED))
+		flags |= MODE_FLAG_STORED;
+	if(mode != MODE_SYNC && hello.version >= PROTOCOL_V2 && (offered & HELLO_STATS))
+		flags |= MODE_FLAG_STATS;
+	return flags;
+}
+
+static bool codecOffered(const Hello &hello, int mode) {
+	if(hello.version >= PROTOCOL_V2 ? hello.codecs & 1 << mode : mode < MODE_LZ4)
+		return true;
+	printf("the client doesn't take %s\n", modeName(mode));
+	return false;
+}
+
+// Where the client's interrupted copy of this file leaves off, if it matches
+static u32 resumeStart(const Hello &hello, const std::string &name, int mode, const std::vector<u8> &target, u32 baseChecksum) {
+	if(hello.resumeName != name || hello.resumeMode != mode || hello.resumeLen != target.size()
+			|| hello.resumeBase != (mode == MODE_DELTA ? baseChecksum : 0) || hello.resumeOffset > target.size()
+			|| checksum(target.data(), hello.resumeOffset) != hello.resumeChecksum)
+		return 0;
+	return hello.resumeOffset;
+}
+
+static bool sendFileV2(const sockaddr_in &client, const Hello &hello, const std::string &name,
+                       const std::vector<u8> &target, const std::vector<u8> *base, int mode) {
+	u32 baseChecksum = base ? checksum(base->data(), base->size()) : 0;
+	std::string cmdline = buildCmdline(name);
+
+	while(true) {
+		u8 flags = modeFlags(hello, mode, target.size());
+		u32 start = flags & MODE_FLAG_RESUME ? resumeStart(hello, name, mode, target, baseChecksum) : 0;
+		Payload payload;
+		if(!encode(mode, hello, target, start, base, flags & MODE_FLAG_STORED, payload))
+			return false;
+		if(start)
+			printf("Resuming at %u\n", (unsigned)start);
+
+		// The whole request goes out at once, the only answer is the last one
+		std::vector<u8> request;
+		u8 modeByte = mode | flags;
+		u32 namelen = name.size(), filelen = target.size(), fields[2] = {mode == MODE_DELTA ? baseChecksum : 0, start};
+		u32 cmdlen = cmdline.size();
+		put(request, &modeByte, 1);
+		put(request, &namelen, 4);
+		put(request, name.data(), namelen);
+		put(request, &filelen, 4);
+		put(request, fields, sizeof(fields));
+		if(mode == MODE_DELTA && (hello.flags & HELLO_CACHE)) {
+			u32 check[2] = {(u32)base->size(), (u32)crc32(0, base->data(), base->size())};
+			put(request, check, sizeof(check));
+		}
+		put(request, &cmdlen, 4);
+		put(request, cmdline.data(), cmdlen);
+
+		int sock = connectClient(client);
+		if(sock < 0)
+			return false;
+		Link link = {sock, (flags & MODE_FLAG_CHECKED) != 0, false, false};
+		u64 sendStart = clockTicks();
+		if(sendAll(link, request.data(), request.size()))
+			sendPayload(link, payload, false);
+		u64 sent = clockTicks();
+		hostStats.sendTicks += sent - sendStart;
+
+		s32 response;
+		bool ok = readResponse(link, &payload, &response);
+		hostStats.responseTicks += clockTicks() - sent;
+		close(sock);
+		if(!ok)
+			return false;
+
+		// The client closed on us and waits for the same file again as zlib
+		if(mode == MODE_DELTA && (response == RESPONSE_NO_BASE || response == RESPONSE_BAD_BASE)) {
+			printf("The client's base doesn't match (%d), sending zlib\n", (int)response);
+			mode = MODE_ZLIB;
+			base = NULL;
+			continue;
+		}
+		if(response != RESPONSE_OK) {
+			printf("response %d\n", (int)response);
+			return false;
+		}
+		return true;
+	}
+}
+
+// About sqrt(size) as in rsync, so the signature costs about as much as the
+// new bytes of a file with a change every few blocks
+static u32 signatureBlock(size_t size) {
+	u32 block = SIG_MIN_BLOCK;
+	while(block < CHUNK_SIZE && (u64)block * block < size)
+		block <<= 1;
+	return block;
+}
+
+// The client sends the signature of its own copy and gets back the ops that
+// turn it into target. False if the connection failed, otherwise the final
+// response is in *response.
+static bool sendFileSigned(const sockaddr_in &client, const Hello &hello, const std::string &name,
+                           const std::vector<u8> &target, s32 *response) {
+	u8 flags = modeFlags(hello, MODE_SIGNATURE, 0);
+	u32 blockSize = hostOptions.blockSize ? hostOptions.blockSize : signatureBlock(target.size());
+	std::string cmdline = buildCmdline(name);
+
+	std::vector<u8> request;
+	u8 modeByte = MODE_SIGNATURE | flags;
+	u32 namelen = name.size(), filelen = target.size(), fields[2] = {checksum(target.data(), target.size()), 0};
+	u32 cmdlen = cmdline.size();
+	put(request, &modeByte, 1);
+	put(request, &namelen, 4);
+	put(request, name.data(), namelen);
+	put(request, &filelen, 4);
+	put(request, fields, sizeof(fields));
+	put(request, &cmdlen, 4);
+	put(request, cmdline.data(), cmdlen);
+	put(request, &blockSize, 4);
+
+	int sock = connectClient(client);
+	if(sock < 0)
+		return false;
+	Link link = {sock, (flags & MODE_FLAG_CHECKED) != 0, false, false};
+	u64 sendStart = clockTicks();
+	bool ok = sendAll(link, request.data(), request.size()) && recvAll(link, response, 4);
+	if(ok && *response != RESPONSE_OK) {
+		close(sock);
+		return true;
+	}
+
+	u32 count = 0;
+	std::vector<u32> signature;
+	ok = ok && recvAll(link, &count, 4);
+	if(ok && (u64)count * blockSize > 0xFFFFFFFF) {
+		printf("signature of %u blocks\n", (unsigned)count);
+		ok = false;
+	}
+	if(ok) {
+		signature.resize(2 * count);
+		ok = recvAll(link, signature.data(), 8 * count);
+		hostStats.signatureBytes += 8 + 8 * count;
+	}
+
+	Payload payload;
+	u64 encodeTicks = 0;
+	if(ok) {
+		u64 begin = clockTicks();
+		encodeSignature(target.data(), target.size(), blockSize, signature, payload);
+		encodeTicks = clockTicks() - begin;
+		hostStats.encodeTicks += encodeTicks;
+		hostStats.rawBytes += target.size();
+		hostStats.payloadBytes += payloadSize(payload);
+		ok = sendPayload(link, payload, false) != LINK_CLOSED;
+	}
+	u64 sent = clockTicks();
+	hostStats.sendTicks += sent - sendStart - encodeTicks;
+
+	ok = ok && readResponse(link, &payload, response);
+	hostStats.responseTicks += clockTicks() - sent;
+	close(sock);
+	return ok;
+}
+
+// Stop and wait: the header, a response, the resume offer when asked for,
+// the payload, a response and then the command line
+static bool sendFileV1(const sockaddr_in &client, const Hello &hello, const std::string &name,
+                       const std::vector<u8> &target, const std::vector<u8> *base, int mode) {
+	u32 baseChecksum = base ? checksum(base->data(), base->size()) : 0;
+	u8 flags = modeFlags(hello, mode, target.size());
+	Payload payload;
+	if(!encode(mode, hello, target, 0, base, flags & MODE_FLAG_STORED, payload))
+		return false;
+
+	int sock = connectClient(client);
+	if(sock < 0)
+		return false;
+	Link link = {sock, (flags & MODE_FLAG_CHECKED) != 0, false, false};
+
+	std::vector<u8> request;
+	u8 modeByte = mode | flags;
+	u32 namelen = name.size(), filelen = target.size();
+	put(request, &modeByte, 1);
+	put(request, &namelen, 4);
+	put(request, name.data(), namelen);
+	put(request, &filelen, 4);
+	if(mode == MODE_DELTA)
+		put(request, &baseChecksum, 4);
+
+	u64 sendStart = clockTicks();
+	s32 response;
+	bool ok = sendAll(link, request.data(), request.size()) && readResponse(link, NULL, &response);
+
+	// A v1 client falls back to zlib on the same connection, and repeats the
+	// same response at the end
+	u32 start = 0;
+	s32 expected = RESPONSE_OK;
+	bool reencode = false;
+	if(ok && mode == MODE_DELTA && (response == RESPONSE_NO_BASE || response == RESPONSE_BAD_BASE)) {
+		printf("The client's base doesn't match (%d), sending zlib\n", (int)response);
+		mode = MODE_ZLIB;
+		expected = response;
+		reencode = true;
+	}
+	if(ok && response != expected) {
+		printf("response %d\n", (int)response);
+		ok = false;
+	}
+	if(ok && (flags & MODE_FLAG_RESUME)) {
+		u32 offer[2];
+		ok = recvAll(link, offer, sizeof(offer));
+		if(ok && offer[0] <= target.size() && checksum(target.data(), offer[0]) == offer[1])
+			start = offer[0];
+		ok = ok && sendAll(link, &start, 4);
+		reencode |= start != 0;
+		if(start)
+			printf("Resuming at %u\n", (unsigned)start);
+	}
+	if(ok && reencode)
+		ok = encode(mode, hello, target, start, NULL, flags & MODE_FLAG_STORED, payload);
+
+	if(ok)
+		ok = sendPayload(link, payload, false) != LINK_CLOSED;
+	u64 sent = clockTicks();
+	hostStats.sendTicks += sent - sendStart;
+
+	ok = ok && readResponse(link, &payload, &response);
+	hostStats.responseTicks += clockTicks() - sent;
+	if(ok && response != expected) {
+		printf("response %d\n", (int)response);
+		ok = false;
+	}
+	ok = ok && sendCmdline(link, buildCmdline(name));
+	close(sock);
+	return ok;
+}
+
+// Whether the client has a build with this size and checksum among those it
+// kept
+static bool isCached(const Hello &hello, size_t size, u32 sum) {
+	for(size_t i = 0; i < hello.cached.size(); i += 2) {
+		if(hello.cached[i] == size && hello.cached[i + 1] == sum)
+			return true;
+	}
+	return false;
+}
+
+// Which of the bases the client has, -1 for none. Without a beacon the host
+// can only trust the one it was given. The file at the name is preferred to
+// a kept build.
+static int pickBase(const Hello &hello, const std::vector<std::vector<u8>> &bases) {
+	if(!(hello.flags & HELLO_BEACON))
+		return bases.size() == 1 ? 0 : -1;
+	int kept = -1;
+	for(size_t i = 0; i < bases.size(); i++) {
+		u32 sum = checksum(bases[i].data(), bases[i].size());
+		if(hello.fileState == BEACON_FILE_PRESENT && bases[i].size() == hello.fileSize && sum == hello.fileChecksum)
+			return i;
+		if(kept < 0 && isCached(hello, bases[i].size(), sum))
+			kept = i;
+	}
+	return kept;
+}
+
+// Puts a build the client kept back at the name, or finds it already there.
+// False if the connection failed, otherwise the response is in *response.
+static bool sendFileCached(const sockaddr_in &client, const std::string &name, const std::vector<u8> &target, s32 *response) {
+	std::string cmdline = buildCmdline(name);
+	std::vector<u8> request;
+	u8 modeByte = MODE_CACHED;
+	u32 namelen = name.size(), filelen = target.size();
+	u32 fields[4] = {checksum(target.data(), target.size()), 0, filelen, (u32)crc32(0, target.data(), target.size())};
+	u32 cmdlen = cmdline.size();
+	put(request, &modeByte, 1);
+	put(request, &namelen, 4);
+	put(request, name.data(), namelen);
+	put(request, &filelen, 4);
+	put(request, fields, sizeof(fields));
+	put(request, &cmdlen, 4);
+	put(request, cmdline.data(), cmdlen);
+
+	int sock = connectClient(client);
+	if(sock < 0)
+		return false;
+	Link link = {sock, false, false, false};
+	u64 sendStart = clockTicks();
+	bool ok = sendAll(link, request.data(), request.size());
+	u64 sent = clockTicks();
+	hostStats.sendTicks += sent - sendStart;
+	ok = ok && readResponse(link, NULL, response);
+	hostStats.responseTicks += clockTicks() - sent;
+	close(sock);
+	return ok;
+}
+
+// A client that has some other copy of the file gets a delta against it
+// from its signature
+static int pickMode(const Hello &hello, int base) {
+	if(hostOptions.mode >= 0)
+		return hostOptions.mode;
+	if(base >= 0)
+		return MODE_DELTA;
+	bool present = (hello.flags & HELLO_BEACON) && hello.fileState == BEACON_FILE_PRESENT;
+	return present && (hello.codecs & 1 << MODE_SIGNATURE) ? MODE_SIGNATURE : MODE_ZLIB;
+}
+
+// What the file needs on the card, deltas are written next to their base and
+// clients with a cache keep the old copy
+static bool storageFits(const Hello &hello, int mode, size_t size) {
+	if(!(hello.flags & HELLO_BEACON) || hello.freeKiB == BEACON_FREE_UNKNOWN)
+		return true;
+	bool beside = mode == MODE_DELTA || mode == MODE_SIGNATURE || (hello.flags & HELLO_CACHE);
+	u64 existing = hello.fileState == BEACON_FILE_PRESENT && !beside ? hello.fileSize : 0;
+	u64 needed = size > existing ? (size - existing + 1023) / 1024 : 0;
+	if(needed <= hello.freeKiB)
+		return true;
+	printf("the client has %u KiB free, this needs %u\n", (unsigned)hello.freeKiB, (unsigned)needed);
+	return false;
+}
+
+// One line per record, for adding up over many transfers and clients
+static void logClientStats(const sockaddr_in &client, const std::string &name, int mode) {
+	static const char *fields[STATS_COUNT] = {"total_us", "net_us", "recv_us", "decode_us", "source_us", "write_us", "resume_us",
+	                                          "bytes_in", "bytes_out", "source_reads", "source_bytes", "net_stalls", "writes",
+	                                          "retransmit_bytes"};
+	FILE *fh = fopen(hostOptions.statsLog, "a");
+	if(!fh) {
+		printf("%s: can't write\n", hostOptions.statsLog);
+		return;
+	}
+	if(ftell(fh) == 0) {
+		fprintf(fh, "time,client,file,mode");
+		for(const char *field : fields)
+			fprintf(fh, ",%s", field);
+		fprintf(fh, "\n");
+	}
+	fprintf(fh, "%lld,%s,%s,%s", (long long)time(NULL), inet_ntoa(client.sin_addr), name.c_str(), modeName(mode));
+	for(u32 field : clientStats)
+		fprintf(fh, ",%u", (unsigned)field);
+	fprintf(fh, "\n");
+	fclose(fh);
+}
+
+bool sendFile(const sockaddr_in &client, const Hello &hello, const char *path) {
+	std::vector<u8> target;
+	if(!readFile(path, target)) {
+		printf("%s: can't read\n", path);
+		return false;
+	}
+	std::vector<std::vector<u8>> bases(hostOptions.bases.size());
+	for(size_t i = 0; i < bases.size(); i++) {
+		if(!readFile(hostOptions.bases[i], bases[i])) {
+			printf("%s: can't read\n", hostOptions.bases[i]);
+			return false;
+		}
+	}
+
+	std::string name = remoteName(path);
+
+	// Nothing to send for a build the client has at the name or kept
+	u32 sum = checksum(target.data(), target.size());
+	bool held = (hello.fileState == BEACON_FILE_PRESENT && hello.fileSize == target.size() && hello.fileChecksum == sum)
+	            || isCached(hello, target.size(), sum);
+	if(hostOptions.mode < 0 && hostOptions.cache && held && (hello.flags & HELLO_CACHE) && codecOffered(hello, MODE_CACHED)) {
+		s32 response;
+		if(!sendFileCached(client, name, target, &response))
+			return false;
+		if(response == RESPONSE_OK) {
+			printf("Restored %s, %zu bytes, from the client's own copy\n", name.c_str(), target.size());
+			return true;
+		}
+		if(response != RESPONSE_NO_BASE) {
+			printf("response %d\n", (int)response);
+			return false;
+		}
+		printf("The client no longer has it, sending it\n");
+	}
+
+	int base = pickBase(hello, bases);
+	int mode = pickMode(hello, base);
+	if(mode == MODE_DELTA && base < 0) {
+		printf(bases.empty() ? "delta needs --base\n" : "the client has none of the bases\n");
+		return false;
+	}
+	if(!bases.empty() && mode == MODE_DELTA)
+		printf("Delta against %s\n", hostOptions.bases[base]);
+	else if(!bases.empty())
+		printf("The client has none of the bases, sending %s\n", modeName(mode));
+	if(!codecOffered(hello, mode) || !storageFits(hello, mode, target.size()))
+		return false;
+
+	clientReported = false;
+	if(mode == MODE_SIGNATURE) {
+		s32 response;
+		if(!sendFileSigned(client, hello, name, target, &response))
+			return false;
+		if(response == RESPONSE_OK) {
+			printf("Sent %s, %zu bytes\n", name.c_str(), target.size());
+			if(clientReported && hostOptions.statsLog)
+				logClientStats(client, name, mode);
+			return true;
+		}
+		if(response != RESPONSE_BAD_BASE) {
+			printf("response %d\n", (int)response);
+			return false;
+		}
+		// The client waits for the same file again
+		printf("The client's copy changed under its signature, sending zlib\n");
+		mode = MODE_ZLIB;
+	}
+
+	const std::vector<u8> *basePtr = mode == MODE_DELTA ? &bases[base] : NULL;
+	bool ok = hello.version >= PROTOCOL_V2 ? sendFileV2(client, hello, name, target, basePtr, mode)
+	                                       : sendFileV1(client, hello, name, target, basePtr, mode);
+	if(ok)
+		printf("Sent %s, %zu bytes\n", name.c_str(), target.size());
+	if(ok && clientReported && hostOptions.statsLog)
+		logClientStats(client, name, mode);
+	return ok;
+}
+
+// Regular files under root, relative to it
+static void listTree(const std::string &root, const std::string &rel, std::vector<std::string> &files) {
+	DIR *dir = opendir((root + "/" + rel).c_str());
+	if(!dir)
+		return;
+	struct dirent *ent;
+	while((ent = readdir(dir)) != NULL) {
+		if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+		std::string path = rel.empty() ? ent->d_name : rel + "/" + ent->d_name;
+		struct stat st;
+		if(stat((root + "/" + path).c_str(), &st) != 0)
+			continue;
+		if(S_ISDIR(st.st_mode))
+			listTree(root, path, files);
+		else if(S_ISREG(st.st_mode) && path.size() <= SYNC_MAX_PATH)
+			files.push_back(path);
+	}
+	closedir(dir);
+}
+
+struct RemoteFile {
+	u32 size, checksum;
+};
+
+static bool sendOp(Link &link, u8 op, const std::string &path) {
+	u16 pathlen = path.size();
+	return sendAll(link, &op, 1) && sendAll(link, &pathlen, 2) && sendAll(link, path.data(), pathlen);
+}
+
+// Checked framing is left out: a terminated payload ends at its empty chunk,
+// so a resend that comes after it would never be read
+bool sendTree(const sockaddr_in &client, const Hello &hello) {
+	std::string root = hostOptions.sync;
+	while(root.size() > 1 && root.back() == '/')
+		root.pop_back();
+	size_t slash = root.rfind('/');
+	std::string remote = hostOptions.remote ? hostOptions.remote : slash == std::string::npos ? root : root.substr(slash + 1);
+
+	std::vector<std::string> files;
+	listTree(root, "", files);
+	std::sort(files.begin(), files.end());
+
+	int fileMode = hostOptions.mode == MODE_LZ4 ? MODE_LZ4 : MODE_ZLIB;
+	if(!codecOffered(hello, MODE_SYNC) || !codecOffered(hello, fileMode))
+		return false;
+
+	bool v2 = hello.version >= PROTOCOL_V2;
+	u8 flags = modeFlags(hello, MODE_SYNC, 0);
+	std::string cmdline = buildCmdline(hostOptions.run ? remote + "/" + hostOptions.run : "");
+
+	int sock = connectClient(client);
+	if(sock < 0)
+		return false;
+	Link link = {sock, false, false, false};
+
+	// Files are encoded as they go out, that time is counted as encoding
+	u64 sendStart = clockTicks(), encodeBefore = hostStats.encodeTicks;
+	u8 modeByte = MODE_SYNC | flags;
+	u16 rootlen = remote.size();
+	bool ok = sendAll(link, &modeByte, 1);
+	if(v2)
+		ok = ok && sendCmdline(link, cmdline);
+	ok = ok && sendAll(link, &rootlen, 2) && sendAll(link, remote.data(), rootlen);
+
+	std::map<std::string, RemoteFile> manifest;
+	while(ok) {
+		u32 entry[2];
+		u16 pathlen;
+		char path[SYNC_MAX_PATH + 1];
+		ok = recvAll(link, entry, sizeof(entry)) && recvAll(link, &pathlen, 2) && pathlen <= SYNC_MAX_PATH
+		     && recvAll(link, path, pathlen);
+		if(!ok || pathlen == 0)
+			break;
+		manifest[std::string(path, pathlen)] = {entry[0], entry[1]};
+	}
+
+	for(size_t i = 0; ok && i < files.size(); i++) {
+		const std::string &path = files[i];
+		std::vector<u8> target, base;
+		if(!readFile((root + "/" + path).c_str(), target)) {
+			printf("%s: can't read\n", path.c_str());
+			ok = false;
+			break;
+		}
+
+		auto entry = manifest.find(path);
+		if(entry != manifest.end() && entry->second.size == target.size()
+				&& entry->second.checksum == checksum(target.data(), target.size())) {
+			hostStats.skipped++;
+			continue;
+		}
+
+		// Delta only against a base known to be what the client has
+		int mode = fileMode;
+		if(entry != manifest.end() && hostOptions.baseDir && readFile((std::string(hostOptions.baseDir) + "/" + path).c_str(), base)
+				&& checksum(base.data(), base.size()) == entry->second.checksum)
+			mode = MODE_DELTA;
+
+		Payload payload;
+		ok = encode(mode, hello, target, 0, &base, flags & MODE_FLAG_STORED, payload);
+		u8 op = mode == MODE_DELTA ? SYNC_DELTA : mode == MODE_LZ4 ? SYNC_LZ4 : SYNC_ZLIB;
+		u32 filelen = target.size();
+		ok = ok && sendOp(link, op, path) && sendAll(link, &filelen, 4)
+		     && sendPayload(link, payload, true) == LINK_IDLE;
+		printf("%s %s, %zu bytes\n", modeName(mode), path.c_str(), target.size());
+		hostStats.files++;
+	}
+
+	if(hostOptions.remove) {
+		for(auto &entry : manifest) {
+			if(!ok || std::binary_search(files.begin(), files.end(), entry.first))
+				continue;
+			ok = sendOp(link, SYNC_DELETE, entry.first);
+			printf("delete %s\n", entry.first.c_str());
+			hostStats.deleted++;
+		}
+	}
+	if(ok)
+		ok = sendOp(link, SYNC_END, hostOptions.run ? hostOptions.run : "");
+	u64 sent = clockTicks();
+	hostStats.sendTicks += sent - sendStart - (hostStats.encodeTicks - encodeBefore);
+
+	// Also where a client that gave up part way says why
+	s32 response;
+	bool answered = readResponse(link, NULL, &response);
+	hostStats.responseTicks += clockTicks() - sent;
+	ok = answered && response == RESPONSE_OK;
+	if(answered && response != RESPONSE_OK)
+		printf("response %d\n", (int)response);
+	if(ok && !v2)
+		ok = sendCmdline(link, cmdline);
+	close(sock);
+
+	if(ok)
+		printf("Synced %s: %u sent, %u unchanged, %u deleted\n", remote.c_str(), (unsigned)hostStats.files,
+		       (unsigned)hostStats.skipped, (unsigned)hostStats.deleted);
+	return ok;
+}
+
+// Fleet mode: the payload goes out once for every client, each connection
+// only carries the request, what is missing after each pass and the response
+
+struct FleetClient {
+	sockaddr_in addr;
+	Link link;
+	bool done;
+};
+
+// Waits at most timeoutMs for size bytes
+static bool recvWithin(Link &link, void *data, size_t size, int timeoutMs) {
+	pollfd pfd = {link.sock, POLLIN, 0};
+	if(poll(&pfd, 1, timeoutMs) <= 0) {
+		link.closed = true;
+		return false;
+	}
+	return recvAll(link, data, size);
+}
+
+static void broadcastSlices(int sock, const sockaddr_in &to, u32 session, const std::vector<Slice> &slices,
+                            const std::vector<u32> &seqs) {
+	u64 next = clockTicks();
+	for(u32 seq : seqs) {
+		const Slice &slice = slices[seq];
+		u8 datagram[FLEET_HEADER + FLEET_PAYLOAD];
+		u32 header[3] = {session, seq, slice.offset};
+		u16 sizes[2] = {slice.size, (u16)slice.data.size()};
+		memcpy(datagram, header, sizeof(header));
+		memcpy(datagram + sizeof(header), sizes, sizeof(sizes));
+		memcpy(datagram + FLEET_HEADER, slice.data.data(), slice.data.size());
+		size_t len = FLEET_HEADER + slice.data.size();
+
+		// Nothing slows a broadcast down but the host, so it is paced here
+		if(hostOptions.rate > 0) {
+			u64 now = clockTicks();
+			if(next > now + msToTicks(1))
+				usleep(ticksToUs(next - now));
+			next = std::max(next, now) + (u64)(len * CLOCK_HZ / hostOptions.rate);
+		}
+		while(sendto(sock, datagram, len, 0, (const sockaddr *)&to, sizeof(to)) < 0 && errno == ENOBUFS)
+			usleep(1000);
+		hostStats.wireBytes += len;
+	}
+}
+
+bool sendFleet(const std::vector<sockaddr_in> &clients, const std::vector<Hello> &hellos, const char *path) {
+	std::vector<u8> target;
+	if(!readFile(path, target)) {
+		printf("%s: can't read\n", path);
+		return false;
+	}
+	const char *slash = strrchr(path, '/');
+	std::string name = hostOptions.name ? hostOptions.name : slash ? slash + 1 : path;
+
+	u64 begin = clockTicks();
+	std::vector<Slice> slices;
+	encodeSlices(target.data(), target.size(), slices);
+	hostStats.encodeTicks += clockTicks() - begin;
+	hostStats.rawBytes += target.size();
+	for(const Slice &slice : slices)
+		hostStats.payloadBytes += slice.data.size();
+
+	// Datagrams from an earlier deploy that are still about don't count
+	u32 session = clockTicks() ^ clockTicks() >> 32 ^ getpid();
+	std::string cmdline = buildCmdline(name);
+	std::vector<u8> request;
+	u8 mode = MODE_FLEET;
+	// The client checks what it put together against the adler32
+	u32 namelen = name.size(), filelen = target.size(), fields[2] = {checksum(target.data(), target.size()), 0};
+	u32 cmdlen = cmdline.size();
+	u16 port = FLEET_PORT;
+	u32 count = slices.size();
+	put(request, &mode, 1);
+	put(request, &namelen, 4);
+	put(request, name.data(), namelen);
+	put(request, &filelen, 4);
+	put(request, fields, sizeof(fields));
+	put(request, &cmdlen, 4);
+	put(request, cmdline.data(), cmdlen);
+	put(request, &session, 4);
+	put(request, &port, 2);
+	put(request, &count, 4);
+
+	std::vector<FleetClient> fleet;
+	bool loopback = true;
+	for(size_t i = 0; i < clients.size(); i++) {
+		if(!(hellos[i].flags & HELLO_FLEET) || !codecOffered(hellos[i], MODE_FLEET)) {
+			printf("%s can't take a fleet transfer\n", inet_ntoa(clients[i].sin_addr));
+			continue;
+		}
+		int sock = connectClient(clients[i]);
+		if(sock < 0)
+			continue;
+		FleetClient client = {clients[i], {sock, false, false, false}, false};
+		if(sendAll(client.link, request.data(), request.size()))
+			fleet.push_back(client);
+		else
+			close(sock);
+		loopback = loopback && ntohl(clients[i].sin_addr.s_addr) >> 24 == 127;
+	}
+
+	// Everyone has to be listening before the first datagram goes
+	size_t active = 0;
+	for(FleetClient &client : fleet) {
+		s32 ready;
+		if(!recvWithin(client.link, &ready, 4, RESPONSE_TIMEOUT_MS) || ready != RESPONSE_OK) {
+			printf("%s: %s %d\n", inet_ntoa(client.addr.sin_addr), client.link.closed ? "no answer" : "response", (int)ready);
+			client.link.closed = true;
+			continue;
+		}
+		active++;
+	}
+
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	int on = 1;
+	setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+	sockaddr_in to = {};
+	to.sin_family = AF_INET;
+	to.sin_port = htons(FLEET_PORT);
+	to.sin_addr.s_addr = hostOptions.fleetTo ? inet_addr(hostOptions.fleetTo)
+	                   : loopback ? inet_addr("127.255.255.255") : htonl(INADDR_BROADCAST);
+
+	std::vector<u32> pending(count);
+	for(u32 seq = 0; seq < count; seq++)
+		pending[seq] = seq;
+
+	size_t succeeded = 0;
+	int round = 0;
+	u64 sendStart = clockTicks(), firstPass = 0;
+	for(; active && round < FLEET_MAX_ROUNDS; round++) {
+		u64 passStart = clockTicks();
+		broadcastSlices(sock, to, session, slices, pending);
+		if(round == 0) {
+			firstPass = clockTicks() - passStart;
+			hostStats.chunks += pending.size();
+			hostStats.sendTicks += firstPass;
+		} else {
+			hostStats.nacks += pending.size();
+			for(u32 seq : pending)
+				hostStats.resentBytes += slices[seq].data.size();
+		}
+		// Access points may hold broadcasts back a little, let them land
+		// before the round marker overtakes them
+		usleep(FLEET_SETTLE_MS * 1000);
+
+		u32 marker = FLEET_ROUND;
+		for(FleetClient &client : fleet) {
+			if(!client.done && !client.link.closed)
+				sendAll(client.link, &marker, 4);
+		}
+
+		std::vector<bool> wanted(count);
+		for(FleetClient &client : fleet) {
+			if(client.done || client.link.closed)
+				continue;
+			u32 ranges, range[2];
+			bool ok = recvWithin(client.link, &ranges, 4, RESPONSE_TIMEOUT_MS) && ranges <= FLEET_MAX_RANGES;
+			for(u32 i = 0; ok && i < ranges; i++) {
+				ok = recvAll(client.link, range, sizeof(range)) && range[0] <= range[1] && range[1] < count;
+				for(u32 seq = range[0]; ok && seq <= range[1]; seq++)
+					wanted[seq] = true;
+			}
+
+			s32 response = RESPONSE_FAILED;
+			if(ok && ranges == 0) {
+				ok = recvWithin(client.link, &response, 4, RESPONSE_TIMEOUT_MS);
+				client.done = true;
+				active--;
+				if(ok && response == RESPONSE_OK)
+					succeeded++;
+				else
+					printf("%s: response %d\n", inet_ntoa(client.addr.sin_addr), (int)response);
+			} else if(!ok) {
+				printf("%s: lost the connection\n", inet_ntoa(client.addr.sin_addr));
+				client.link.closed = true;
+				active--;
+			}
+		}
+
+		pending.clear();
+		for(u32 seq = 0; seq < count; seq++) {
+			if(wanted[seq])
+				pending.push_back(seq);
+		}
+	}
+	// Repair rounds and responses count as waiting for the response
+	hostStats.responseTicks += clockTicks() - sendStart - firstPass;
+
+	close(sock);
+	for(FleetClient &client : fleet)
+		close(client.link.sock);
+	if(active)
+		printf("%zu clients still missing datagrams after %d rounds\n", active, round);
+
+	printf("Sent %s, %zu bytes to %zu of %zu clients in %d rounds\n", name.c_str(), target.size(), succeeded,
+	       clients.size(), round);
+	return succeeded == clients.size() && succeeded == (size_t)hostOptions.fleet;
+}
+
+void printHostStats(void) {
+	printf("discovery:        %.3f ms\n", ticksToUs(hostStats.discoverTicks) / 1000.0);
+	printf("encode:           %.3f ms, %zu -> %zu bytes (%.1f%%)\n", ticksToUs(hostStats.encodeTicks) / 1000.0,
+	       hostStats.rawBytes, hostStats.payloadBytes, hostStats.rawBytes ? 100.0 * hostStats.payloadBytes / hostStats.rawBytes : 0.0);
+	if(hostStats.storedBytes)
+		printf("stored chunks:    %zu bytes sent without deflate\n", hostStats.storedBytes);
+	printf("connect:          %.3f ms\n", ticksToUs(hostStats.connectTicks) / 1000.0);
+	printf("send:             %.3f ms, %zu bytes in %u chunks, %.2f MB/s\n", ticksToUs(hostStats.sendTicks) / 1000.0,
+	       hostStats.wireBytes, (unsigned)hostStats.chunks,
+	       hostStats.sendTicks ? hostStats.wireBytes / (ticksToUs(hostStats.sendTicks) / 1e6) / 1e6 : 0.0);
+	printf("final response:   %.3f ms after the last byte\n", ticksToUs(hostStats.responseTicks) / 1000.0);
+	if(hostStats.signatureBytes)
+		printf("signature:        %zu bytes from the client\n", hostStats.signatureBytes);
+	if(hostStats.nacks)
+		printf("retransmitted:    %zu bytes for %u NACKs\n", hostStats.resentBytes, (unsigned)hostStats.nacks);
+	if(hostStats.clientReports) {
+		// As the client measured it, see protocol.h for what other is
+		const u64 *c = hostStats.client;
+		u64 phases = 0;
+		for(int i = STATS_NET_US; i <= STATS_RESUME_US; i++)
+			phases += c[i];
+		printf("client:           %.3f ms, net %.3f, recv %.3f, decode %.3f, source %.3f, write %.3f, resume %.3f, other %.3f\n",
+		       c[STATS_TOTAL_US] / 1000.0, c[STATS_NET_US] / 1000.0, c[STATS_RECV_US] / 1000.0, c[STATS_DECODE_US] / 1000.0,
+		       c[STATS_SOURCE_US] / 1000.0, c[STATS_WRITE_US] / 1000.0, c[STATS_RESUME_US] / 1000.0,
+		       c[STATS_TOTAL_US] > phases ? (c[STATS_TOTAL_US] - phases) / 1000.0 : 0.0);
+		printf("client I/O:       %llu bytes in, %llu out, %llu source reads (%llu bytes), %llu writes, %llu network stalls\n",
+		       (unsigned long long)c[STATS_BYTES_IN], (unsigned long long)c[STATS_BYTES_OUT], (unsigned long long)c[STATS_SOURCE_READS],
+		       (unsigned long long)c[STATS_SOURCE_BYTES], (unsigned long long)c[STATS_WRITES], (unsigned long long)c[STATS_NET_STALLS]);
+	}
+}
@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#ifndef SENDER_H
+#define SENDER_H
+
+#include "platform.h"
+#include "protocol.h"
+
+#include <netinet/in.h>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+// The host side of protocol.h, shared by dslink-host and the loopback
+// harness. What is sent and how is set in hostOptions before each transfer.
+struct HostOptions {
+	std::vector<const char *> addresses; // ping these instead of broadcasting
+	int port = PORT;            // where to ping and connect, e.g. a shaper
+	const char *name = NULL;    // under /nds on the client
+	std::vector<const char *> bases; // what the client may have now, for delta
+	const char *sync = NULL;    // local tree
+	const char *remote = NULL;  // its directory under /nds
+	const char *baseDir = NULL; // what the client has of the tree now
+	const char *run = NULL;     // file in the tree to launch
+	int mode = -1;              // MODE_, or picked from the rest
+	int level = Z_DEFAULT_COMPRESSION;
+	int version = PROTOCOL_V2;
+	int resume = -1;            // -1: whenever a v2 client offers it
+	bool checked = false, remove = false, stats = false;
+	bool cache = true;          // put back builds the client kept, unless a mode is given
+	double storeAbove = -1;     // below 0 for no stored chunks
+	u32 corruptEvery = 0;       // damage every nth chunk once, checked mode
+	double cutAt = 0;           // drop the connection this far into the payload, 0 never
+	int fleet = 0;              // clients to broadcast to at once, 0 for one
+	const char *fleetTo = NULL; // where fleet datagrams go, broadcast if NULL
+	double rate = 256e3;        // fleet datagram bytes/s, 0 unpaced
+	u32 blockSize = 0;          // signature blocks, 0 for about sqrt(size)
+	const char *statsLog = NULL; // CSV the client's stats records are appended to
+	std::vector<const char *> args;
+};
+
+struct Hello {
+	u8 version; // 0 for a v1 client
+	u8 flags;
+	u16 codecs;
+	u32 maxChunk, freeRam, srcCache, window;
+	u8 secondary;
+	u8 resumeMode;
+	u32 resumeLen, resumeBase, resumeOffset, resumeChecksum;
+	std::string resumeName;
+	// The beacon, when flags has HELLO_BEACON
+	u8 console, fileState;
+	u32 freeKiB, fileSize, fileChecksum;
+	u16 files;
+	std::vector<u32> held; // crc32 of the path and size of each listed file
+	std::vector<u32> cached; // size and adler32 of each kept build, HELLO_CACHE
+};
+
+struct HostStats {
+	u64 discoverTicks, encodeTicks, connectTicks, sendTicks, responseTicks;
+	size_t rawBytes, payloadBytes, storedBytes, wireBytes;
+	u32 chunks, nacks;
+	size_t resentBytes;
+	size_t signatureBytes; // from the client, in signature mode
+	u32 files, skipped, deleted;
+	u64 client[STATS_COUNT]; // the clients' stats records, summed
+	u32 clientReports;
+};
+
+extern HostOptions hostOptions;
+extern HostStats hostStats;
+
+// Where path goes under /nds on the client
+std::string remoteName(const char *path);
+
+// Pings until a client answers, false if none does. Beacon clients say what
+// they hold of the file named by query.
+bool discover(sockaddr_in *client, Hello *hello, const char *query);
+
+// A single file, or the tree in hostOptions.sync
+bool sendFile(const sockaddr_in &client, const Hello &hello, const char *path);
+bool sendTree(const sockaddr_in &client, const Hello &hello);
+
+// Pings until hostOptions.fleet clients answer or discover() would give up,
+// returns how many did
+size_t discoverFleet(std::vector<sockaddr_in> &clients, std::vector<Hello> &hellos);
+
+// Broadcasts the file to all of them at once, true if every one took it
+bool sendFleet(const std::vector<sockaddr_in> &clients, const std::vector<Hello> &hellos, const char *path);
+
+void printHostStats(void);
+
+#endif // SENDER_H
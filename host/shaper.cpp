@@ -0,0 +1,462 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+// dslink-shaper: a proxy for the link port that makes loopback behave like a
+// DS on Wi-Fi. Pings and connections to the listen port are passed on to
+// the client, with the bytes held back to the configured bandwidth,
+// latency, jitter, loss and stalls.
+//
+// The link is TCP, so the receiver never sees a loss or a reorder, only the
+// delay until the segment is resent or the gap is filled. That is what is
+// modelled: a lost segment arrives a retransmit timeout late, a reordered
+// one a little late, and everything behind either waits for it.
+
+#include "clock.h"
+#include "protocol.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <vector>
+
+#define SHAPER_PORT (PORT + 1)
+#define SEGMENT_SIZE 1460 // a TCP segment on Ethernet framed Wi-Fi
+
+struct Profile {
+	const char *name;
+	double bandwidth;   // bytes/s, 0 for unlimited
+	double latencyMs;   // one way
+	double jitterMs;    // added to the latency, uniformly
+	double loss;        // segments, 0-1
+	double reorder;     // segments, 0-1
+	double reorderMs;   // how late a reordered segment is
+	double rtoMs;       // how late a lost one is
+	u32 window;         // bytes in flight before the sender has to wait
+	double stallEveryMs, stallMs; // the radio going quiet, 0 for never
+};
+
+// dswifi's TCP windows are 8 KiB. DS numbers are what a DS gets from an
+// ordinary access point; a DSi in DSi mode drives the same radio with a
+// faster ARM9, so it keeps up with more of it.
+static const Profile presets[] = {
+	{"ds", 300e3, 4, 6, 0.01, 0.005, 15, 250, 8192, 4000, 120},
+	{"dsi", 600e3, 3, 4, 0.005, 0.005, 10, 200, 8192, 6000, 80},
+	{"lan", 0, 0.2, 0.1, 0, 0, 0, 0, 64 * 1024, 0, 0},
+};
+
+static Profile profile = presets[0];
+static u32 rngState = 1;
+
+static u32 rng(void) {
+	rngState ^= rngState << 13;
+	rngState ^= rngState >> 17;
+	rngState ^= rngState << 5;
+	return rngState;
+}
+
+static double uniform(void) {
+	return rng() / 4294967296.0;
+}
+
+static u64 msTicks(double ms) {
+	return ms * CLOCK_HZ / 1000;
+}
+
+// When the radio comes back from the stall t falls in, if it falls in one
+static u64 afterStall(u64 t, u64 epoch) {
+	if(profile.stallEveryMs <= 0 || profile.stallMs <= 0)
+		return t;
+	u64 every = msTicks(profile.stallEveryMs), stall = msTicks(profile.stallMs);
+	u64 phase = (t - epoch) % every;
+	return phase >= every - stall ? t + every - phase : t;
+}
+
+struct Segment {
+	u64 deliverAt;
+	std::vector<u8> data;
+	size_t sent;
+};
+
+struct Acked {
+	u64 at;
+	size_t size;
+};
+
+// One way of a proxied connection
+struct Direction {
+	int from, to;
+	std::deque<Segment> queue; // read, not yet written on
+	std::deque<Acked> acks;    // written on, not yet acknowledged to from
+	u64 linkFree, lastDeliver;
+	size_t inFlight;
+	bool eof, shut;
+	size_t bytes;
+	u32 lost, reordered, stalled; // segments
+};
+
+struct Connection {
+	int host, client;
+	u64 start;
+	Direction down, up; // to the client, back to the host
+};
+
+struct Stats {
+	u64 segments, lost, reordered, stalled;
+};
+static Stats total;
+
+static void initDirection(Direction &dir, int from, int to) {
+	dir = {};
+	dir.from = from;
+	dir.to = to;
+}
+
+static void schedule(Direction &dir, const u8 *data, size_t size, u64 now, u64 epoch) {
+	for(size_t pos = 0; pos < size; pos += SEGMENT_SIZE) {
+		size_t n = size - pos < SEGMENT_SIZE ? size - pos : SEGMENT_SIZE;
+
+		// Segments go onto the air one after another at the link's rate
+		u64 start = dir.linkFree > now ? dir.linkFree : now;
+		u64 onAir = afterStall(start, epoch);
+		if(onAir != start)
+			dir.stalled++;
+		dir.linkFree = onAir + (profile.bandwidth > 0 ? (u64)(n * CLOCK_HZ / profile.bandwidth) : 0);
+
+		u64 at = dir.linkFree + msTicks(profile.latencyMs + profile.jitterMs * uniform());
+		if(uniform() < profile.loss) {
+			at += msTicks(profile.rtoMs);
+			dir.lost++;
+		} else if(uniform() < profile.reorder) {
+			at += msTicks(profile.reorderMs);
+			dir.reordered++;
+		}
+		// The stream is in order, nothing overtakes a late segment
+		if(at < dir.lastDeliver)
+			at = dir.lastDeliver;
+		dir.lastDeliver = at;
+
+		dir.queue.push_back({at, std::vector<u8>(data + pos, data + pos + n), 0});
+		dir.inFlight += n;
+		dir.bytes += n;
+		total.segments++;
+	}
+}
+
+// Moves one direction along, returns false once it failed
+static bool pump(Direction &dir, u64 now, u64 epoch, bool readable) {
+	while(!dir.acks.empty() && dir.acks.front().at <= now) {
+		dir.inFlight -= dir.acks.front().size;
+		dir.acks.pop_front();
+	}
+
+	if(readable && !dir.eof && dir.inFlight < profile.window) {
+		u8 buf[64 * 1024];
+		size_t room = profile.window - dir.inFlight;
+		int len = recv(dir.from, buf, room < sizeof(buf) ? room : sizeof(buf), 0);
+		if(len == 0)
+			dir.eof = true;
+		else if(len > 0)
+			schedule(dir, buf, len, now, epoch);
+		else if(errno != EAGAIN && errno != EINTR)
+			return false;
+	}
+
+	while(!dir.queue.empty() && dir.queue.front().deliverAt <= now) {
+		Segment &seg = dir.queue.front();
+		int len = send(dir.to, seg.data.data() + seg.sent, seg.data.size() - seg.sent, MSG_NOSIGNAL);
+		if(len < 0) {
+			if(errno == EAGAIN || errno == EINTR)
+				break;
+			return false;
+		}
+		seg.sent += len;
+		if(seg.sent < seg.data.size())
+			break;
+		// The acknowledgement takes the same way back
+		dir.acks.push_back({now + msTicks(profile.latencyMs), seg.data.size()});
+		dir.queue.pop_front();
+	}
+
+	if(dir.eof && dir.queue.empty() && !dir.shut) {
+		shutdown(dir.to, SHUT_WR);
+		dir.shut = true;
+	}
+	return true;
+}
+
+// When the direction next has something to do without being woken
+static u64 nextEvent(const Direction &dir) {
+	u64 next = ~0ull;
+	if(!dir.queue.empty() && !dir.queue.front().sent)
+		next = dir.queue.front().deliverAt;
+	if(!dir.acks.empty() && dir.acks.front().at < next)
+		next = dir.acks.front().at;
+	return next;
+}
+
+static void report(const Connection &conn, u64 now) {
+	double seconds = ticksToUs(now - conn.start) / 1e6;
+	const Direction &down = conn.down, &up = conn.up;
+	total.lost += down.lost + up.lost;
+	total.reordered += down.reordered + up.reordered;
+	total.stalled += down.stalled + up.stalled;
+	printf("connection: %zu bytes down, %zu up in %.2f s (%.1f KB/s), %u lost, %u reordered, %u held by stalls\n",
+	       down.bytes, up.bytes, seconds, seconds > 0 ? down.bytes / seconds / 1e3 : 0.0, down.lost + up.lost,
+	       down.reordered + up.reordered, down.stalled + up.stalled);
+	fflush(stdout);
+}
+
+static void setNonBlocking(int fd) {
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+// Datagrams only carry discovery, they are delayed and lost but not rated
+struct Datagram {
+	u64 deliverAt;
+	bool toClient;
+	std::vector<u8> data;
+};
+
+static volatile sig_atomic_t interrupted;
+
+static void onInterrupt(int) {
+	interrupted = 1;
+}
+
+static bool valueOption(int argc, char **argv, int &i, const char *name, const char **value) {
+	if(strcmp(argv[i], name) != 0 || i + 1 >= argc)
+		return false;
+	*value = argv[++i];
+	return true;
+}
+
+static void usage(const char *argv0) {
+	printf("usage: %s [options] [client ip]\n"
+	       "  --preset ds|dsi|lan  start from this link (default ds)\n"
+	       "  --bandwidth KB/s     0 for unlimited\n"
+	       "  --latency ms         one way\n"
+	       "  --jitter ms          up to this much more\n"
+	       "  --loss %%             segments that need resending\n"
+	       "  --rto ms             how late a resent segment is\n"
+	       "  --reorder %%          segments that arrive late\n"
+	       "  --reorder-delay ms   how late\n"
+	       "  --window bytes       in flight before the sender waits\n"
+	       "  --stall every:ms     the radio goes quiet this long this often\n"
+	       "  --listen port        where hosts connect (default %d)\n"
+	       "  --seed n\n"
+	       "Options after --preset change that preset. Point the host at the\n"
+	       "listen port, e.g. dslink-host -a 127.0.0.1 --port %d.\n",
+	       argv0, SHAPER_PORT, SHAPER_PORT);
+}
+
+int main(int argc, char **argv) {
+	int listenPort = SHAPER_PORT;
+	const char *clientAddr = "127.0.0.1";
+	int i = 1;
+	for(; i < argc && argv[i][0] == '-'; i++) {
+		const char *value;
+		if(valueOption(argc, argv, i, "--preset", &value)) {
+			size_t p = 0;
+			while(p < sizeof(presets) / sizeof(*presets) && strcmp(presets[p].name, value) != 0)
+				p++;
+			if(p == sizeof(presets) / sizeof(*presets)) {
+				usage(argv[0]);
+				return 1;
+			}
+			profile = presets[p];
+		} else if(valueOption(argc, argv, i, "--bandwidth", &value)) {
+			profile.bandwidth = atof(value) * 1e3;
+		} else if(valueOption(argc, argv, i, "--latency", &value)) {
+			profile.latencyMs = atof(value);
+		} else if(valueOption(argc, argv, i, "--jitter", &value)) {
+			profile.jitterMs = atof(value);
+		} else if(valueOption(argc, argv, i, "--loss", &value)) {
+			profile.loss = atof(value) / 100;
+		} else if(valueOption(argc, argv, i, "--rto", &value)) {
+			profile.rtoMs = atof(value);
+		} else if(valueOption(argc, argv, i, "--reorder", &value)) {
+			profile.reorder = atof(value) / 100;
+		} else if(valueOption(argc, argv, i, "--reorder-delay", &value)) {
+			profile.reorderMs = atof(value);
+		} else if(valueOption(argc, argv, i, "--window", &value)) {
+			profile.window = atoi(value);
+		} else if(valueOption(argc, argv, i, "--stall", &value)) {
+			if(sscanf(value, "%lf:%lf", &profile.stallEveryMs, &profile.stallMs) != 2
+					|| (profile.stallEveryMs > 0 && profile.stallMs >= profile.stallEveryMs)) {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if(valueOption(argc, argv, i, "--listen", &value)) {
+			listenPort = atoi(value);
+		} else if(valueOption(argc, argv, i, "--seed", &value)) {
+			rngState = atoi(value) | 1;
+		} else {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(i < argc)
+		clientAddr = argv[i++];
+	if(i < argc || profile.window < SEGMENT_SIZE) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	struct sigaction sa = {};
+	sa.sa_handler = onInterrupt;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	clockInit();
+
+	sockaddr_in client = {};
+	client.sin_family = AF_INET;
+	client.sin_port = htons(PORT);
+	client.sin_addr.s_addr = inet_addr(clientAddr);
+
+	int on = 1;
+	sockaddr_in local = {};
+	local.sin_family = AF_INET;
+	local.sin_port = htons(listenPort);
+	local.sin_addr.s_addr = htonl(INADDR_ANY);
+	int listenTcp = socket(AF_INET, SOCK_STREAM, 0), listenUdp = socket(AF_INET, SOCK_DGRAM, 0);
+	setsockopt(listenTcp, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	// Accepted sockets inherit it, so the host sees a window the DS's size
+	int window = profile.window;
+	setsockopt(listenTcp, SOL_SOCKET, SO_RCVBUF, &window, sizeof(window));
+	if(bind(listenTcp, (sockaddr *)&local, sizeof(local)) < 0 || listen(listenTcp, 4) < 0
+			|| bind(listenUdp, (sockaddr *)&local, sizeof(local)) < 0) {
+		printf("can't listen on port %d: %s\n", listenPort, strerror(errno));
+		return 1;
+	}
+
+	// DS clients answer pings on the link port, the POSIX client answers
+	// whichever port pinged it
+	int clientUdp = socket(AF_INET, SOCK_DGRAM, 0);
+	if(ntohl(client.sin_addr.s_addr) >> 24 != 127) {
+		sockaddr_in linkPort = local;
+		linkPort.sin_port = htons(PORT);
+		setsockopt(clientUdp, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if(bind(clientUdp, (sockaddr *)&linkPort, sizeof(linkPort)) < 0)
+			printf("can't bind port %d, DS replies will be missed\n", PORT);
+	}
+
+	printf("port %d -> %s:%d, %.0f KB/s, %.1f+%.1f ms, %.1f%% loss, %.1f%% reorder, window %u",
+	       listenPort, clientAddr, PORT, profile.bandwidth / 1e3, profile.latencyMs, profile.jitterMs,
+	       profile.loss * 100, profile.reorder * 100, profile.window);
+	if(profile.stallEveryMs > 0)
+		printf(", %.0f ms stall every %.0f ms", profile.stallMs, profile.stallEveryMs);
+	printf("\n");
+	fflush(stdout);
+
+	u64 epoch = clockTicks();
+	std::vector<Connection> conns;
+	std::deque<Datagram> datagrams;
+	sockaddr_in pinger = {};
+
+	while(!interrupted) {
+		std::vector<pollfd> fds = {{listenTcp, POLLIN, 0}, {listenUdp, POLLIN, 0}, {clientUdp, POLLIN, 0}};
+		for(const Connection &conn : conns) {
+			// Only read when the window has room, otherwise poll would spin
+			fds.push_back({conn.host, (short)(conn.down.eof || conn.down.inFlight >= profile.window ? 0 : POLLIN), 0});
+			fds.push_back({conn.client, (short)(conn.up.eof || conn.up.inFlight >= profile.window ? 0 : POLLIN), 0});
+		}
+
+		u64 now = clockTicks(), next = ~0ull;
+		for(const Connection &conn : conns) {
+			u64 down = nextEvent(conn.down), up = nextEvent(conn.up);
+			next = std::min(next, std::min(down, up));
+			// A partly written segment waits on the receiver, check back soon
+			if((!conn.down.queue.empty() && conn.down.queue.front().sent)
+					|| (!conn.up.queue.empty() && conn.up.queue.front().sent))
+				next = std::min(next, now + msTicks(1));
+		}
+		if(!datagrams.empty())
+			next = std::min(next, datagrams.front().deliverAt);
+		int timeout = next == ~0ull ? -1 : next <= now ? 0 : (int)((next - now + msTicks(1) - 1) / msTicks(1));
+		if(poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR)
+			break;
+		now = clockTicks();
+
+		if(fds[0].revents & POLLIN) {
+			int host = accept(listenTcp, NULL, NULL);
+			int sock = socket(AF_INET, SOCK_STREAM, 0);
+			if(host >= 0 && connect(sock, (sockaddr *)&client, sizeof(client)) == 0) {
+				setsockopt(host, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+				setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+				setNonBlocking(host);
+				setNonBlocking(sock);
+				Connection conn;
+				conn.host = host;
+				conn.client = sock;
+				conn.start = now;
+				initDirection(conn.down, host, sock);
+				initDirection(conn.up, sock, host);
+				conns.push_back(conn);
+			} else {
+				printf("connect: %s\n", strerror(errno));
+				if(host >= 0)
+					close(host);
+				close(sock);
+			}
+		}
+
+		for(int side = 1; side <= 2; side++) {
+			if(!(fds[side].revents & POLLIN))
+				continue;
+			u8 buf[1500];
+			sockaddr_in from;
+			socklen_t fromLen = sizeof(from);
+			int len = recvfrom(fds[side].fd, buf, sizeof(buf), 0, (sockaddr *)&from, &fromLen);
+			if(len <= 0)
+				continue;
+			if(side == 1)
+				pinger = from;
+			if(uniform() < profile.loss)
+				continue;
+			u64 at = now + msTicks(profile.latencyMs + profile.jitterMs * uniform());
+			datagrams.push_back({at, side == 1, std::vector<u8>(buf, buf + len)});
+		}
+		while(!datagrams.empty() && datagrams.front().deliverAt <= now) {
+			const Datagram &dg = datagrams.front();
+			if(dg.toClient)
+				sendto(clientUdp, dg.data.data(), dg.data.size(), 0, (sockaddr *)&client, sizeof(client));
+			else if(pinger.sin_port)
+				sendto(listenUdp, dg.data.data(), dg.data.size(), 0, (sockaddr *)&pinger, sizeof(pinger));
+			datagrams.pop_front();
+		}
+
+		for(size_t c = 0; c < conns.size();) {
+			Connection &conn = conns[c];
+			const pollfd &hostFd = fds[3 + 2 * c], &clientFd = fds[4 + 2 * c];
+			bool ok = pump(conn.down, now, epoch, hostFd.revents & (POLLIN | POLLHUP | POLLERR))
+			       && pump(conn.up, now, epoch, clientFd.revents & (POLLIN | POLLHUP | POLLERR));
+			if(ok && !(conn.down.shut && conn.up.shut)) {
+				c++;
+				continue;
+			}
+			report(conn, now);
+			close(conn.host);
+			close(conn.client);
+			// fds is indexed by connection, keep the rest in step with it
+			conns.erase(conns.begin() + c);
+			fds.erase(fds.begin() + 3 + 2 * c, fds.begin() + 5 + 2 * c);
+		}
+	}
+
+	printf("%llu segments, %llu lost, %llu reordered, %llu held by stalls\n", (unsigned long long)total.segments,
+	       (unsigned long long)total.lost, (unsigned long long)total.reordered, (unsigned long long)total.stalled);
+	return 0;
+}
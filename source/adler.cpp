@@ -0,0 +1,89 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#include "adler.h"
+#include "platform.h"
+
+#define ADLER_BASE 65521
+// 16 words, as many as the prefix lanes below can take without overflowing
+#define ADLER_BLOCK 64
+// The most bytes before s2 can overflow 32 bits, rounded down to whole blocks
+#define ADLER_NMAX (5552 / ADLER_BLOCK * ADLER_BLOCK)
+#define ADLER_LANES 0x00FF00FF
+
+typedef u32 __attribute__((may_alias)) AliasU32;
+
+// 65536 is 15 mod ADLER_BASE, no division (a library call on the ARM9)
+static inline u32 reduce(u32 s) {
+	s = (s & 0xFFFF) + 15 * (s >> 16);
+	s = (s & 0xFFFF) + 15 * (s >> 16);
+	return s >= ADLER_BASE ? s - ADLER_BASE : s;
+}
+
+// Bytes two to a word in 16 bit lanes: even holds bytes 0 and 2 of every word
+// so far, odd 1 and 3, and the prefix lanes add those up again after every
+// word. That gives the position weights of s2 without touching single bytes,
+// about two instructions a byte.
+HOT_CODE static void blocks(const u32 *words, size_t count, u32 &s1, u32 &s2) {
+	while(count--) {
+		u32 even = 0, odd = 0, prefixEven = 0, prefixOdd = 0;
+		for(int i = 0; i < ADLER_BLOCK / 4; i++) {
+			u32 w = words[i];
+			even += w & ADLER_LANES;
+			odd += (w >> 8) & ADLER_LANES;
+			prefixEven += even;
+			prefixOdd += odd;
+		}
+		words += ADLER_BLOCK / 4;
+
+		u32 b0 = even & 0xFFFF, b2 = even >> 16, b1 = odd & 0xFFFF, b3 = odd >> 16;
+		u32 prefix = (prefixEven & 0xFFFF) + (prefixEven >> 16) + (prefixOdd & 0xFFFF) + (prefixOdd >> 16);
+		// Byte k of word j counts 4 * (16 - j) - k times towards s2
+		s2 += ADLER_BLOCK * s1 + 4 * prefix - (b1 + 2 * b2 + 3 * b3);
+		s1 += b0 + b1 + b2 + b3;
+	}
+}
+
+static inline void bytes(const u8 *p, size_t size, u32 &s1, u32 &s2) {
+	while(size--) {
+		s1 += *p++;
+		s2 += s1;
+	}
+}
+
+uint32_t adlerUpdate(uint32_t adler, const void *data, size_t size) {
+	const u8 *p = (const u8 *)data;
+	if(!p)
+		return ADLER_INIT;
+	u32 s1 = adler & 0xFFFF, s2 = adler >> 16;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	// Word loads must be aligned on the ARM9
+	size_t head = -(uintptr_t)p & 3;
+	if(head > size)
+		head = size;
+	bytes(p, head, s1, s2);
+	p += head;
+	size -= head;
+
+	while(size >= ADLER_BLOCK) {
+		size_t n = size < ADLER_NMAX ? size / ADLER_BLOCK : ADLER_NMAX / ADLER_BLOCK;
+		blocks((const AliasU32 *)p, n, s1, s2);
+		p += n * ADLER_BLOCK;
+		size -= n * ADLER_BLOCK;
+		s1 = reduce(s1);
+		s2 = reduce(s2);
+	}
+#endif
+
+	while(size) {
+		size_t n = size < ADLER_NMAX ? size : ADLER_NMAX;
+		bytes(p, n, s1, s2);
+		p += n;
+		size -= n;
+		s1 = reduce(s1);
+		s2 = reduce(s2);
+	}
+	return s2 << 16 | s1;
+}
@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#ifndef ADLER_H
+#define ADLER_H
+
+// The one adler32 of the client: base and resume checks, the manifest,
+// inflate and xdelta's window checks
+
+#include <stddef.h>
+#include <stdint.h>
+
+// adler32 of nothing, what zlib's adler32(0, NULL, 0) returns
+#define ADLER_INIT 1
+
+// Same results as zlib's adler32()
+uint32_t adlerUpdate(uint32_t adler, const void *data, size_t size);
+
+#endif // ADLER_H
@@ -0,0 +1,331 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#include "cache.h"
+#include "adler.h"
+#include "clock.h"
+#include "manifest.h"
+#include "platform.h"
+#include "transfer.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define CACHE_MAGIC 0x32434143 // "CAC2"
+
+struct CacheEntry {
+	u32 id;       // the file is dslink.cache/<id>.nds
+	u32 size;
+	u32 checksum; // adler32
+	u32 crc;      // crc32, tells adler32 collisions apart
+	u32 hashed;   // checksum and crc are filled in
+};
+
+// Oldest first, used entries move to the end
+static CacheEntry entries[BEACON_MAX_CACHED];
+static u32 count, nextId;
+static bool loaded;
+
+// The build being hashed in idle time
+static struct {
+	FILE *fh;
+	u32 id;
+	u32 sum, crc;
+} idle;
+
+static void cacheDir(char *path, int size) {
+	sniprintf(path, size, "%s/dslink.cache", storageRoot());
+}
+
+static void entryPath(const CacheEntry &entry, char *path, int size) {
+	sniprintf(path, size, "%s/dslink.cache/%08x.nds", storageRoot(), (unsigned)entry.id);
+}
+
+static void indexPath(char *path, int size) {
+	sniprintf(path, size, "%s/dslink.cache/index", storageRoot());
+}
+
+// Small enough to be rewritten in place, a torn write fails the CRC and the
+// builds it listed are cleared out on the next load
+static void save(void) {
+	char path[64];
+	indexPath(path, sizeof(path));
+	FILE *fh = fopen(path, "wb");
+	if(!fh)
+		return;
+	u32 header[3] = {CACHE_MAGIC, count, (u32)crc32(0, (const Bytef *)entries, count * sizeof(CacheEntry))};
+	fwrite(header, sizeof(header), 1, fh);
+	fwrite(entries, sizeof(CacheEntry), count, fh);
+	fclose(fh);
+}
+
+static void drop(u32 i) {
+	memmove(entries + i, entries + i + 1, (count - i - 1) * sizeof(CacheEntry));
+	count--;
+}
+
+// Builds nothing lists any more
+static void purge(void) {
+	char dir[32];
+	cacheDir(dir, sizeof(dir));
+	DIR *dh = opendir(dir);
+	if(!dh)
+		return;
+	struct dirent *ent;
+	while((ent = readdir(dh)) != NULL) {
+		if(ent->d_name[0] == '.')
+			continue;
+		char path[sizeof(dir) + 1 + sizeof(ent->d_name)];
+		sniprintf(path, sizeof(path), "%s/%s", dir, ent->d_name);
+		remove(path);
+	}
+	closedir(dh);
+}
+
+// Entries whose build is gone are dropped
+static void load(void) {
+	if(loaded)
+		return;
+	loaded = true;
+	char path[64];
+	indexPath(path, sizeof(path));
+	FILE *fh = fopen(path, "rb");
+	u32 header[3];
+	bool ok = fh && fread(header, sizeof(header), 1, fh) == 1 && header[0] == CACHE_MAGIC && header[1] <= BEACON_MAX_CACHED
+	          && fread(entries, sizeof(CacheEntry), header[1], fh) == header[1]
+	          && crc32(0, (const Bytef *)entries, header[1] * sizeof(CacheEntry)) == header[2];
+	if(fh)
+		fclose(fh);
+	count = ok ? header[1] : 0;
+	if(!ok)
+		purge();
+
+	nextId = 0;
+	for(u32 i = 0; i < count;) {
+		struct stat st;
+		entryPath(entries[i], path, sizeof(path));
+		if(stat(path, &st) != 0 || (u32)st.st_size != entries[i].size) {
+			drop(i);
+			continue;
+		}
+		if(entries[i].id >= nextId)
+			nextId = entries[i].id + 1;
+		i++;
+	}
+}
+
+static int find(u32 size, u32 checksum, u32 crc) {
+	for(u32 i = 0; i < count; i++) {
+		if(entries[i].hashed && entries[i].size == size && entries[i].checksum == checksum && entries[i].crc == crc)
+			return i;
+	}
+	return -1;
+}
+
+static int findId(u32 id) {
+	for(u32 i = 0; i < count; i++) {
+		if(entries[i].id == id)
+			return i;
+	}
+	return -1;
+}
+
+static void touch(u32 i) {
+	CacheEntry entry = entries[i];
+	drop(i);
+	entries[count++] = entry;
+}
+
+static void removeEntry(u32 i) {
+	char path[64];
+	entryPath(entries[i], path, sizeof(path));
+	remove(path);
+	drop(i);
+}
+
+// Down to the count and the budget with room for one more of this size
+static void evict(u32 size) {
+	u64 total = size;
+	for(u32 i = 0; i < count; i++)
+		total += entries[i].size;
+	while(count && (count >= BEACON_MAX_CACHED || total > CACHE_BUDGET)) {
+		total -= entries[0].size;
+		removeEntry(0);
+	}
+}
+
+// Both checksums of a whole file of this size, in one read
+static bool hashFile(const char *path, u32 size, u32 *checksum, u32 *crc) {
+	struct stat st;
+	if(stat(path, &st) != 0 || (u32)st.st_size != size)
+		return false;
+	FILE *fh = fopen(path, "rb");
+	if(!fh)
+		return false;
+	u32 sum = ADLER_INIT, c = crc32(0, NULL, 0);
+	size_t read;
+	while((read = fread(in, 1, CHUNK_SIZE, fh)) > 0) {
+		sum = adlerUpdate(sum, in, read);
+		c = crc32(c, in, read);
+	}
+	bool ok = !ferror(fh);
+	fclose(fh);
+	*checksum = sum;
+	*crc = c;
+	return ok;
+}
+
+// Kept without reading it, cacheIdleStep() hashes it later
+void cacheKeep(const char *path) {
+	struct stat st;
+	if(stat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || (u32)st.st_size > CACHE_BUDGET)
+		return;
+	cacheIdleStop();
+	load();
+
+	evict(st.st_size);
+	CacheEntry entry = {nextId, (u32)st.st_size, 0, 0, 0};
+	char cached[64];
+	cacheDir(cached, sizeof(cached));
+	mkdir(cached, 0777);
+	entryPath(entry, cached, sizeof(cached));
+	// Left over from a keep that didn't get to save the index
+	remove(cached);
+	if(rename(path, cached) == 0) {
+		manifestForget(path);
+		entries[count++] = entry;
+		nextId++;
+	}
+	save();
+}
+
+bool cacheLookup(u32 size, u32 checksum, u32 crc, char *path, int pathSize) {
+	load();
+	int i = find(size, checksum, crc);
+	if(i < 0)
+		return false;
+	entryPath(entries[i], path, pathSize);
+	touch(i);
+	save();
+	return true;
+}
+
+int cacheRestore(const char *path, u32 size, u32 checksum, u32 crc) {
+	// Asked for what is already there. Only a file the manifest vouches for
+	// is read, an unknown one could be a large file read at connect time.
+	u32 haveSize, haveChecksum, haveCrc;
+	if(manifestKnown(path, &haveSize, &haveChecksum) && haveSize == size && haveChecksum == checksum
+			&& hashFile(path, size, &haveChecksum, &haveCrc) && haveChecksum == checksum && haveCrc == crc)
+		return RESPONSE_OK;
+
+	cacheIdleStop();
+	load();
+	int i = find(size, checksum, crc);
+	if(i < 0)
+		return RESPONSE_NO_BASE;
+	u32 id = entries[i].id;
+	char cached[64];
+	entryPath(entries[i], cached, sizeof(cached));
+	touch(i);
+
+	// FAT can't rename onto an existing file. Keeping it may evict the build
+	// when the budget is tight.
+	cacheKeep(path);
+	manifestForget(path);
+	remove(path);
+	i = findId(id);
+	if(i < 0)
+		return RESPONSE_NO_BASE;
+	// Still listed, so it isn't left behind unindexed
+	if(rename(cached, path) != 0) {
+		iprintf("Failed to restore %s\n", path);
+		return RESPONSE_FAILED;
+	}
+	drop(i);
+	save();
+	manifestRecord(path, checksum);
+	return RESPONSE_OK;
+}
+
+u32 cacheList(u32 *pairs) {
+	load();
+	u32 listed = 0;
+	for(u32 i = 0; i < count; i++) {
+		if(!entries[i].hashed)
+			continue;
+		pairs[2 * listed] = entries[i].size;
+		pairs[2 * listed + 1] = entries[i].checksum;
+		listed++;
+	}
+	return listed;
+}
+
+// A build that was already kept goes, the one just hashed takes its place
+static void hashed(u32 i) {
+	entries[i].hashed = 1;
+	for(u32 j = 0; j < count; j++) {
+		if(j != i && entries[j].hashed && entries[j].size == entries[i].size && entries[j].checksum == entries[i].checksum
+				&& entries[j].crc == entries[i].crc) {
+			removeEntry(j);
+			break;
+		}
+	}
+}
+
+bool cacheIdleStep(u32 budgetMs) {
+	load();
+	u64 until = clockTicks() + msToTicks(budgetMs);
+	do {
+		if(!idle.fh) {
+			u32 i = 0;
+			while(i < count && entries[i].hashed)
+				i++;
+			if(i == count)
+				return false;
+			char path[64];
+			entryPath(entries[i], path, sizeof(path));
+			idle.fh = fopen(path, "rb");
+			if(!idle.fh) {
+				drop(i);
+				save();
+				continue;
+			}
+			idle.id = entries[i].id;
+			idle.sum = ADLER_INIT;
+			idle.crc = crc32(0, NULL, 0);
+			continue;
+		}
+
+		size_t read = fread(in, 1, CHUNK_SIZE, idle.fh);
+		if(read > 0) {
+			idle.sum = adlerUpdate(idle.sum, in, read);
+			idle.crc = crc32(idle.crc, in, read);
+			continue;
+		}
+		bool ok = !ferror(idle.fh);
+		fclose(idle.fh);
+		idle.fh = NULL;
+		int i = findId(idle.id);
+		if(i < 0)
+			continue;
+		if(ok) {
+			entries[i].checksum = idle.sum;
+			entries[i].crc = idle.crc;
+			hashed(i);
+		} else {
+			removeEntry(i);
+		}
+		save();
+	} while(clockTicks() < until);
+	return true;
+}
+
+void cacheIdleStop(void) {
+	if(idle.fh)
+		fclose(idle.fh);
+	idle.fh = NULL;
+}
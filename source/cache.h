@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "platform.h"
+
+// Builds that were replaced on the card, kept in dslink.cache at the root of
+// the card so going back to one is a rename rather than a transfer. Each is
+// known by its size, adler32 and crc32, hashed in idle time unless the
+// manifest already had them. Once hashed they are listed in the beacon, can
+// be restored with MODE_CACHED and serve as delta bases. The least recently
+// used go once there are more than BEACON_MAX_CACHED or they add up to over
+// CACHE_BUDGET.
+#define CACHE_BUDGET (256u << 20)
+
+// The file at path is about to be replaced, moves it into the cache if it
+// isn't there already. Whatever is left at path can be overwritten.
+void cacheKeep(const char *path);
+
+// Where the cached build with this size, adler32 and crc32 is, for a delta
+// base. False if there is none.
+bool cacheLookup(u32 size, u32 checksum, u32 crc, char *path, int pathSize);
+
+// Puts the cached build back at path, keeping what was there. Returns a
+// RESPONSE_, RESPONSE_NO_BASE if the cache doesn't have it.
+int cacheRestore(const char *path, u32 size, u32 checksum, u32 crc);
+
+// Size and adler32 pairs of the hashed builds, oldest first. Returns the
+// count, at most BEACON_MAX_CACHED.
+u32 cacheList(u32 *pairs);
+
+// Hashes the builds kept since the last step, about budgetMs at a time.
+// False once there is nothing left to hash. Stop before anything on the
+// card changes.
+bool cacheIdleStep(u32 budgetMs);
+void cacheIdleStop(void);
+
+#endif // CACHE_H
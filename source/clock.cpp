@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#include "clock.h"
+
+#ifdef ARM9
+
+// Uses timers 0 and 1, dswifi9 takes timer 3 for its own tick
+#define CLOCK_TIMER 0
+// One-shot at the bus clock / 1024, ~30 us a tick
+#define WAKE_TIMER  2
+
+static u32 lastTicks, wraps;
+
+void clockInit(void) {
+	cpuStartTiming(CLOCK_TIMER);
+	lastTicks = 0;
+	wraps = 0;
+}
+
+u64 clockTicks(void) {
+	// The 32-bit timer pair wraps every ~128 seconds, extend it to 64 bits
+	u32 now = cpuGetTiming();
+	if(now < lastTicks)
+		wraps++;
+	lastTicks = now;
+	return ((u64)wraps << 32) | now;
+}
+
+static void wake(void) {
+	timerStop(WAKE_TIMER);
+}
+
+void clockSleepUntil(u64 until) {
+	while(true) {
+		u64 now = clockTicks();
+		u64 left = until > now ? (until - now) >> 10 : 0;
+		if(!left)
+			break;
+		timerStart(WAKE_TIMER, ClockDivider_1024, 0x10000 - (left > 0xFFFF ? 0xFFFF : left), wake);
+		// Doesn't discard the flag, the timer may have fired already
+		swiIntrWait(0, IRQ_TIMER(WAKE_TIMER));
+	}
+	// Under a timer tick left
+	while(clockTicks() < until)
+		;
+}
+
+#else
+
+#include <time.h>
+
+void clockInit(void) {}
+
+u64 clockTicks(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void clockSleepUntil(u64 until) {
+	u64 now = clockTicks();
+	if(until <= now)
+		return;
+	struct timespec ts = {(time_t)((until - now) / 1000000000ull), (long)((until - now) % 1000000000ull)};
+	nanosleep(&ts, NULL);
+}
+
+#endif
@@ -0,0 +1,28 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include "platform.h"
+
+// Monotonic tick counter. On the DS this is the bus clock counted by a pair
+// of cascaded hardware timers, on POSIX it is nanoseconds.
+#ifdef ARM9
+#define CLOCK_HZ ((u64)BUS_CLOCK)
+#else
+#define CLOCK_HZ 1000000000ull
+#endif
+
+void clockInit(void);
+u64 clockTicks(void);
+// Halts the CPU until clockTicks() reaches until, for waits with nothing to
+// select() on
+void clockSleepUntil(u64 until);
+
+static inline u32 ticksToMs(u64 ticks) { return ticks * 1000 / CLOCK_HZ; }
+static inline u64 ticksToUs(u64 ticks) { return ticks * 1000000 / CLOCK_HZ; }
+static inline u64 msToTicks(u32 ms) { return (u64)ms * CLOCK_HZ / 1000; }
+
+#endif // CLOCK_H
@@ -0,0 +1,212 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#include "fleet.h"
+#include "adler.h"
+#include "cache.h"
+#include "clock.h"
+#include "lz4.h"
+#include "manifest.h"
+#include "netio.h"
+#include "progress.h"
+#include "protocol.h"
+#include "transfer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static u8 *have; // a bit per datagram
+static u32 missing;
+static u32 position; // of the output file, seeking flushes the stdio buffer
+static size_t received;
+static u32 sum, summed; // adler32 of the file up to summed, while it comes in order
+
+static bool got(u32 seq) {
+	return have[seq >> 3] & (1 << (seq & 7));
+}
+
+static int openData(u16 port) {
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in sa;
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = INADDR_ANY;
+	sa.sin_port = htons(port);
+
+	int i = 1;
+#ifndef ARM9
+	// Several clients on one machine all take the broadcasts
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i));
+#endif
+	if(bind(sock, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		iprintf("fleet port %d\n", errno);
+		closesocket(sock);
+		return -1;
+	}
+	ioctl(sock, FIONBIO, &i);
+	return sock;
+}
+
+// Takes in every datagram that is waiting. Once a write has failed they are
+// only drained until the host asks how it went.
+static void readDatagrams(int udp, FILE *fh, u32 filelen, u32 session, u32 count, int *response) {
+	int len;
+	while((len = recv(udp, in, sizeof(in), 0)) > 0) {
+		u32 header[3];
+		u16 sizes[2];
+		if(len < FLEET_HEADER || *response != RESPONSE_OK)
+			continue;
+		memcpy(header, in, sizeof(header));
+		memcpy(sizes, in + sizeof(header), sizeof(sizes));
+		u32 seq = header[1], offset = header[2], size = sizes[0], packed = sizes[1];
+		if(header[0] != session || seq >= count || got(seq) || packed != (u32)len - FLEET_HEADER
+				|| size > FLEET_MAX_SLICE || offset > filelen || size > filelen - offset)
+			continue;
+
+		const u8 *data = in + FLEET_HEADER;
+		if(packed != size) {
+			if(lz4DecodeBlock(data, packed, out, size) != (int)size)
+				continue;
+			data = out;
+		}
+		// Datagrams mostly come in order, only gaps and repairs seek
+		if((offset != position && fseek(fh, offset, SEEK_SET) != 0) || fwrite(data, 1, size, fh) != size) {
+			iprintf("fleet write failed\n");
+			*response = RESPONSE_FAILED;
+			continue;
+		}
+		position = offset + size;
+		if(offset == summed) {
+			sum = adlerUpdate(sum, data, size);
+			summed += size;
+		}
+		have[seq >> 3] |= 1 << (seq & 7);
+		missing--;
+		received += size;
+		filetotal = received;
+	}
+}
+
+// The first FLEET_MAX_RANGES runs of missing datagrams, none once done
+static bool sendMissing(int sock, u32 count, bool done) {
+	u32 report[1 + 2 * FLEET_MAX_RANGES];
+	u32 ranges = 0;
+	for(u32 seq = 0; !done && seq < count && ranges < FLEET_MAX_RANGES; seq++) {
+		if(got(seq))
+			continue;
+		report[1 + 2 * ranges] = seq;
+		while(seq + 1 < count && !got(seq + 1))
+			seq++;
+		report[2 + 2 * ranges] = seq;
+		ranges++;
+	}
+	report[0] = ranges;
+	int size = 4 + 8 * ranges;
+	return netSendAll(sock, report, size) == size;
+}
+
+// What came after the first gap is read back to finish the checksum
+static bool checkFile(FILE *fh, u32 filelen, u32 checksum) {
+	if(fflush(fh) != 0 || fseek(fh, summed, SEEK_SET) != 0)
+		return false;
+	while(summed < filelen) {
+		size_t want = filelen - summed < CHUNK_SIZE ? filelen - summed : CHUNK_SIZE;
+		if(fread(in, 1, want, fh) != want)
+			return false;
+		sum = adlerUpdate(sum, in, want);
+		summed += want;
+	}
+	return sum == checksum;
+}
+
+int receiveFleet(int sock, const char *filename, u32 filelen, u32 checksum) {
+	u32 session, count;
+	u16 port;
+	if(netRecvAll(sock, &session, 4) != 4 || netRecvAll(sock, &port, 2) != 2 || netRecvAll(sock, &count, 4) != 4) {
+		iprintf("fleet request %d\n", errno);
+		return RESPONSE_FAILED;
+	}
+
+	// Written aside, the old build stays until the new one checks out
+	int response = RESPONSE_OK, udp = -1;
+	char outPath[32];
+	dataPath(outPath, sizeof(outPath), "dslink.out");
+	FILE *fh = fopen(outPath, "w+b");
+	have = (u8 *)calloc(count / 8 + 1, 1);
+	if(!fh) {
+		iprintf("Failed to open %s\n", outPath);
+		response = RESPONSE_OPEN_FAILED;
+	} else if(!have || (udp = openData(port)) < 0) {
+		response = RESPONSE_FAILED;
+	}
+	missing = count;
+	position = 0;
+	received = 0;
+	sum = ADLER_INIT;
+	summed = 0;
+	progressBegin(filelen);
+
+	// Once every client is ready the host starts broadcasting
+	bool started = response == RESPONSE_OK;
+	bool connected = netSendAll(sock, &response, sizeof(response)) == sizeof(response);
+	int socks[2] = {udp, sock};
+	while(connected && started) {
+		int ready = netWaitReadable(socks, 2, clockTicks() + msToTicks(NET_RECV_TIMEOUT_MS));
+		if(ready < 0) {
+			iprintf("fleet %d\n", ready);
+			connected = false;
+			break;
+		}
+		if(ready == 0) {
+			readDatagrams(udp, fh, filelen, session, count, &response);
+			continue;
+		}
+
+		u32 marker;
+		if(netRecvAll(sock, &marker, 4) != 4 || marker != FLEET_ROUND) {
+			iprintf("fleet round %d\n", errno);
+			connected = false;
+			break;
+		}
+		// The end of the pass can still be queued behind the marker
+		readDatagrams(udp, fh, filelen, session, count, &response);
+		bool done = response != RESPONSE_OK || missing == 0;
+		connected = sendMissing(sock, count, done);
+		if(done)
+			break;
+	}
+
+	progressEnd(response == RESPONSE_OK && missing == 0);
+	if(udp >= 0)
+		closesocket(udp);
+	free(have);
+	have = NULL;
+	if(connected && started && response == RESPONSE_OK && !checkFile(fh, filelen, checksum)) {
+		iprintf("Mismatched checksum\n");
+		response = RESPONSE_FAILED;
+	}
+	if(fh && fclose(fh) != 0 && response == RESPONSE_OK)
+		response = RESPONSE_FAILED;
+	if(connected && started && response == RESPONSE_OK) {
+		// FAT can't rename onto an existing file
+		cacheKeep(filename);
+		manifestForget(filename);
+		remove(filename);
+		if(rename(outPath, filename) != 0) {
+			iprintf("Failed to rename to %s\n", filename);
+			response = RESPONSE_FAILED;
+		}
+	}
+	if(response != RESPONSE_OK || !connected)
+		remove(outPath);
+	if(!connected)
+		return RESPONSE_FAILED;
+
+	// Not sent after a failed start, the ready answer already said why
+	if(started) {
+		netMarkRequest();
+		netSendAll(sock, &response, sizeof(response));
+	}
+	return response;
+}
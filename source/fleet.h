@@ -0,0 +1,16 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#ifndef FLEET_H
+#define FLEET_H
+
+#include "platform.h"
+
+// Runs a MODE_FLEET transfer on sock after the v2 request: takes the
+// broadcast datagrams into a file aside, reports what is missing after each
+// pass and sends the final response. The file only replaces filename once
+// its adler32 is checksum. Returns the response.
+int receiveFleet(int sock, const char *filename, u32 filelen, u32 checksum);
+
+#endif // FLEET_H
@@ -9,6 +9,7 @@
 #include <string>
 #include <sys/stat.h>
 
+#include "iconTitle.h"
 #include "hbmenu_banner.h"
 #include "font6x8.h"
 
@@ -19,27 +20,34 @@
 #define ICON_POS_Y	80
 
 #define TEXT_WIDTH	((32-4)*8/6)
+// The title's four rows, then the progress bar and its figures
+#define TEXT_ROWS	6
+#define PROGRESS_ROW	4
+#define BAR_WIDTH	(TEXT_WIDTH-7)
 
 static int bg2, bg3;
 static u16 *sprite;
 static tNDSBanner banner;
 
+// Rows are put together here and copied to VRAM whole, as VRAM only takes
+// 16 bit writes and reading it back for every character is slow. Each row
+// is only ever written from one context, the progress rows from VBlank.
+static u8 shadow[TEXT_ROWS][TEXT_WIDTH];
+
 static inline void writecharRS (int row, int col, u16 car) {
-	// get map pointer
-	u16 *gfx   = bgGetMapPtr(bg2);
-	// get old pair of values from VRAM
-	u16 oldval = gfx[row*(512/8/2)+(col/2)];
-
-	// clear the half we will update
-	oldval &= (col%2) ? 0x00FF : 0xFF00;
-	// apply the updated half
-	oldval |= (col%2) ? (car<<8) : car;
-
-	// write back to VRAM
-	gfx[row*(512/8/2)+col/2] = oldval;
+	shadow[row][col] = car;
+}
+
+static void flushRow (int row) {
+	u16 *gfx = bgGetMapPtr(bg2) + row*(512/8/2);
+	for (int i = 0; i < TEXT_WIDTH/2; i++)
+		gfx[i] = shadow[row][2*i] | shadow[row][2*i+1]<<8;
+	// The last column shares its halfword with one past the text
+	if (TEXT_WIDTH & 1)
+		gfx[TEXT_WIDTH/2] = (gfx[TEXT_WIDTH/2] & 0xFF00) | shadow[row][TEXT_WIDTH-1];
 }
 
-static inline void writeRow (int rownum, const char* text) {
+static void writeRow (int rownum, const char* text) {
 	int i,len,p=0;
 	len=strlen(text);
 
@@ -57,6 +65,27 @@ static inline void writeRow (int rownum, const char* text) {
 	// clear right part
 	for (i=((TEXT_WIDTH-len)/2+len);i<TEXT_WIDTH;i++)
 		writecharRS (rownum, i, 0);
+
+	flushRow (rownum);
+}
+
+// Plain digits, no printf from the interrupt
+static char *putNumber (char *p, u32 n, int minDigits) {
+	char digits[10];
+	int len = 0;
+	do {
+		digits[len++] = '0' + n%10;
+		n /= 10;
+	} while (n || len < minDigits);
+	while (len)
+		*p++ = digits[--len];
+	return p;
+}
+
+static char *putString (char *p, const char *s) {
+	while (*s)
+		*p++ = *s++;
+	return p;
 }
 
 static inline void clearIcon (void) {
@@ -203,3 +232,37 @@ void iconTitleUpdate (int isdir, const std::string& name) {
 		dmaCopy(banner.palette, SPRITE_PALETTE, sizeof(banner.palette));
 	}
 }
+
+void iconTitleProgress (u32 fraction, u32 bytesPerSec, u32 eta) {
+	char line[TEXT_WIDTH+1];
+	if (fraction == PROGRESS_NONE) {
+		writeRow (PROGRESS_ROW, "");
+		writeRow (PROGRESS_ROW+1, "");
+		return;
+	}
+	if (fraction > PROGRESS_ONE)
+		fraction = PROGRESS_ONE;
+
+	char *p = line;
+	u32 filled = (fraction*BAR_WIDTH) >> 16;
+	*p++ = '[';
+	for (u32 i = 0; i < BAR_WIDTH; i++)
+		*p++ = i < filled ? '#' : '-';
+	*p++ = ']';
+	*p++ = ' ';
+	p = putNumber (p, (fraction*100) >> 16, 1);
+	*p++ = '%';
+	*p = 0;
+	writeRow (PROGRESS_ROW, line);
+
+	p = putNumber (line, bytesPerSec/1024, 1);
+	p = putString (p, " KiB/s");
+	if (bytesPerSec && fraction < PROGRESS_ONE) {
+		p = putString (p, "  ETA ");
+		p = putNumber (p, eta/60, 1);
+		*p++ = ':';
+		p = putNumber (p, eta%60, 2);
+	}
+	*p = 0;
+	writeRow (PROGRESS_ROW+1, line);
+}
@@ -4,7 +4,15 @@
 // Copyright (c) 2005 - 2013 Dave "WinterMute" Murphy
 // Copyright (c) 2005 - 2013 Claudio "sverx"
 
+#include <nds/ndstypes.h>
 #include <string>
 
 void iconTitleInit (void);
 void iconTitleUpdate (int isdir, const std::string& name);
+
+#define PROGRESS_ONE	(1 << 16)
+#define PROGRESS_NONE	0xFFFFFFFF
+// Draws the progress bar, rate and time left (in seconds) under the title,
+// safe to call from an interrupt. fraction is how far along as 16.16,
+// PROGRESS_NONE clears it.
+void iconTitleProgress (u32 fraction, u32 bytesPerSec, u32 eta);
@@ -0,0 +1,472 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#include "inflate.h"
+#include "adler.h"
+
+#include <string.h>
+
+// Codes up to this long are decoded with a single table lookup, longer ones
+// (rare, the limit is 15) bit by bit from the canonical code counts
+#define FAST_BITS 10
+
+#define MAX_BITS 15
+#define MAX_LITLEN 288
+#define MAX_DIST 32
+
+struct Huffman {
+	u16 fast[1 << FAST_BITS]; // symbol | length << 9, 0 for longer codes
+	u16 count[MAX_BITS + 1];
+	u16 symbol[MAX_LITLEN];
+};
+
+static const u16 lengthBase[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const u8 lengthExtra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const u16 distBase[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const u8 distExtra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static Huffman litlenCode, distCode, lengthCode;
+static Huffman fixedLitlen, fixedDist;
+static bool fixedBuilt;
+
+// Builds the decoding tables for code lengths. Incomplete codes are allowed
+// (a single distance code is legal), their unused patterns fail to decode.
+static bool build(Huffman *h, const u8 *lengths, int n) {
+	memset(h->count, 0, sizeof(h->count));
+	for(int i = 0; i < n; i++)
+		h->count[lengths[i]]++;
+	h->count[0] = 0;
+
+	int left = 1;
+	for(int len = 1; len <= MAX_BITS; len++) {
+		left = (left << 1) - h->count[len];
+		if(left < 0)
+			return false; // over-subscribed
+	}
+
+	u16 offs[MAX_BITS + 1];
+	offs[1] = 0;
+	for(int len = 1; len < MAX_BITS; len++)
+		offs[len + 1] = offs[len] + h->count[len];
+	for(int i = 0; i < n; i++) {
+		if(lengths[i])
+			h->symbol[offs[lengths[i]]++] = i;
+	}
+
+	// Fill every table entry whose low bits are a short code, bit reversed
+	// as deflate packs codes from their top bit
+	memset(h->fast, 0, sizeof(h->fast));
+	u32 code = 0;
+	int index = 0;
+	for(int len = 1; len <= FAST_BITS; len++) {
+		for(int i = 0; i < h->count[len]; i++, index++, code++) {
+			u32 rev = 0;
+			for(int b = 0; b < len; b++)
+				rev |= ((code >> b) & 1) << (len - 1 - b);
+			for(u32 j = rev; j < (1 << FAST_BITS); j += 1 << len)
+				h->fast[j] = h->symbol[index] | len << 9;
+		}
+		code <<= 1;
+	}
+	return true;
+}
+
+namespace {
+
+struct Decoder {
+	InflateIo *io;
+	const u8 *ip, *iend;
+	u32 bitbuf, bitcount;
+	u8 *op, *oend, *ostart;
+	u8 *ring, *ringEnd;
+	size_t total;
+	u32 adler;
+
+	// Waits for more input only when the bits are really needed, so nothing
+	// past the stream end is asked for
+	bool need(u32 n) {
+		while(bitcount < n) {
+			if(ip == iend) {
+				u32 size;
+				ip = io->input(io->ctx, &size);
+				if(!ip)
+					return false;
+				iend = ip + size;
+			}
+			bitbuf |= (u32)*ip++ << bitcount;
+			bitcount += 8;
+		}
+		return true;
+	}
+
+	// Tops the bit buffer up from input already at hand
+	void refill(void) {
+		while(bitcount <= 24 && ip != iend) {
+			bitbuf |= (u32)*ip++ << bitcount;
+			bitcount += 8;
+		}
+	}
+
+	u32 bits(u32 n) {
+		u32 v = bitbuf & ((1u << n) - 1);
+		bitbuf >>= n;
+		bitcount -= n;
+		return v;
+	}
+
+	bool commit(void) {
+		u32 used = op - ostart;
+		adler = adlerUpdate(adler, ostart, used);
+		total += used;
+		u32 avail;
+		ostart = op = io->output(io->ctx, used, &avail);
+		if(!op)
+			return false;
+		oend = op + avail;
+		return true;
+	}
+
+	int decode(const Huffman *h);
+	bool stored(void);
+	bool dynamic(void);
+	bool copy(u32 distance, u32 len);
+	bool codes(const Huffman *litlen, const Huffman *dist);
+};
+
+}
+
+HOT_CODE int Decoder::decode(const Huffman *h) {
+	refill();
+	if(bitcount < MAX_BITS && !need(bitcount >= FAST_BITS ? bitcount : FAST_BITS))
+		return -1;
+
+	u32 entry = h->fast[bitbuf & ((1 << FAST_BITS) - 1)];
+	if(entry) {
+		u32 len = entry >> 9;
+		if(len > bitcount && !need(len))
+			return -1;
+		bits(len);
+		return entry & 0x1FF;
+	}
+
+	// Canonical decode, as in zlib's contrib/puff
+	int code = 0, first = 0, index = 0;
+	for(int len = 1; len <= MAX_BITS; len++) {
+		if(!need(len))
+			return -1;
+		code |= (bitbuf >> (len - 1)) & 1;
+		int count = h->count[len];
+		if(code - count < first) {
+			bits(len);
+			return h->symbol[index + (code - first)];
+		}
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	}
+	return -1;
+}
+
+bool Decoder::stored(void) {
+	bits(bitcount & 7);
+	if(!need(32))
+		return false;
+	u32 len = bits(16);
+	if(bits(16) != (~len & 0xFFFF))
+		return false;
+
+	// Anything left in the bit buffer is whole bytes by now
+	while(len && bitcount) {
+		if(op == oend && !commit())
+			return false;
+		*op++ = bits(8);
+		len--;
+	}
+	while(len) {
+		if(ip == iend) {
+			u32 size;
+			ip = io->input(io->ctx, &size);
+			if(!ip)
+				return false;
+			iend = ip + size;
+		}
+		if(op == oend && !commit())
+			return false;
+		u32 n = len;
+		if(n > (u32)(iend - ip)) n = iend - ip;
+		if(n > (u32)(oend - op)) n = oend - op;
+		memcpy(op, ip, n);
+		op += n;
+		ip += n;
+		len -= n;
+	}
+	return true;
+}
+
+bool Decoder::dynamic(void) {
+	static const u8 order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+	u8 lengths[MAX_LITLEN + MAX_DIST];
+
+	if(!need(14))
+		return false;
+	int nlen = bits(5) + 257;
+	int ndist = bits(5) + 1;
+	int ncode = bits(4) + 4;
+	if(nlen > 286 || ndist > 30)
+		return false;
+
+	memset(lengths, 0, 19);
+	for(int i = 0; i < ncode; i++) {
+		if(!need(3))
+			return false;
+		lengths[order[i]] = bits(3);
+	}
+	if(!build(&lengthCode, lengths, 19))
+		return false;
+
+	for(int i = 0; i < nlen + ndist;) {
+		int sym = decode(&lengthCode);
+		if(sym < 0)
+			return false;
+		if(sym < 16) {
+			lengths[i++] = sym;
+			continue;
+		}
+
+		u8 len = 0;
+		int repeat;
+		if(sym == 16) {
+			if(i == 0 || !need(2))
+				return false;
+			len = lengths[i - 1];
+			repeat = 3 + bits(2);
+		} else if(sym == 17) {
+			if(!need(3))
+				return false;
+			repeat = 3 + bits(3);
+		} else {
+			if(!need(7))
+				return false;
+			repeat = 11 + bits(7);
+		}
+		if(i + repeat > nlen + ndist)
+			return false;
+		while(repeat--)
+			lengths[i++] = len;
+	}
+
+	// Without an end of block code the block could never finish
+	if(lengths[256] == 0)
+		return false;
+	return build(&litlenCode, lengths, nlen) && build(&distCode, lengths + nlen, ndist)
+		&& codes(&litlenCode, &distCode);
+}
+
+// Room for one match and its codes without checking on every step
+#define FAST_IN 8
+#define FAST_OUT 258
+
+HOT_CODE bool Decoder::copy(u32 distance, u32 len) {
+	if(distance > total + (op - ostart))
+		return false;
+
+	const u8 *src = op - distance;
+	if(src < ring)
+		src += ringEnd - ring;
+
+	// The common case, neither wrapping around the ring nor leaving the slot
+	if(len <= (u32)(oend - op) && len <= (u32)(ringEnd - src)) {
+		if(distance >= len) {
+			memcpy(op, src, len);
+			op += len;
+		} else {
+			// Overlapping, forwards byte order repeats the pattern
+			while(len--)
+				*op++ = *src++;
+		}
+		return true;
+	}
+
+	while(len) {
+		if(op == oend && !commit())
+			return false;
+		u32 n = len;
+		if(n > (u32)(oend - op)) n = oend - op;
+		if(n > (u32)(ringEnd - src)) n = ringEnd - src;
+		for(u32 i = 0; i < n; i++)
+			*op++ = *src++;
+		if(src == ringEnd)
+			src = ring;
+		len -= n;
+	}
+	return true;
+}
+
+HOT_CODE bool Decoder::codes(const Huffman *litlen, const Huffman *dist) {
+	const u32 mask = (1 << FAST_BITS) - 1;
+
+	while(true) {
+		// With enough input and output at hand, decode a whole symbol and its
+		// match with unchecked two byte refills
+		if(iend - ip >= FAST_IN && oend - op >= FAST_OUT) {
+			if(bitcount < 16) {
+				bitbuf |= (u32)(ip[0] | ip[1] << 8) << bitcount;
+				ip += 2;
+				bitcount += 16;
+			}
+			u32 entry = litlen->fast[bitbuf & mask];
+			int sym;
+			if(entry) {
+				bits(entry >> 9);
+				sym = entry & 0x1FF;
+			} else {
+				sym = decode(litlen);
+				if(sym < 0)
+					return false;
+			}
+
+			if(sym < 256) {
+				*op++ = sym;
+				continue;
+			}
+			if(sym == 256)
+				return true;
+
+			sym -= 257;
+			if(sym >= 29)
+				return false;
+			if(bitcount < 16) {
+				bitbuf |= (u32)(ip[0] | ip[1] << 8) << bitcount;
+				ip += 2;
+				bitcount += 16;
+			}
+			u32 len = lengthBase[sym] + bits(lengthExtra[sym]);
+
+			if(bitcount < 16) {
+				bitbuf |= (u32)(ip[0] | ip[1] << 8) << bitcount;
+				ip += 2;
+				bitcount += 16;
+			}
+			entry = dist->fast[bitbuf & mask];
+			int dsym;
+			if(entry) {
+				bits(entry >> 9);
+				dsym = entry & 0x1FF;
+			} else {
+				dsym = decode(dist);
+				if(dsym < 0)
+					return false;
+			}
+			if(dsym >= 30)
+				return false;
+			if(bitcount < 16) {
+				bitbuf |= (u32)(ip[0] | ip[1] << 8) << bitcount;
+				ip += 2;
+				bitcount += 16;
+			}
+			if(!copy(distBase[dsym] + bits(distExtra[dsym]), len))
+				return false;
+			continue;
+		}
+
+		int sym = decode(litlen);
+		if(sym < 0)
+			return false;
+
+		if(sym < 256) {
+			if(op == oend && !commit())
+				return false;
+			*op++ = sym;
+			continue;
+		}
+		if(sym == 256)
+			return true;
+
+		sym -= 257;
+		if(sym >= 29 || !need(lengthExtra[sym]))
+			return false;
+		u32 len = lengthBase[sym] + bits(lengthExtra[sym]);
+
+		int dsym = decode(dist);
+		if(dsym < 0 || dsym >= 30 || !need(distExtra[dsym]))
+			return false;
+		if(!copy(distBase[dsym] + bits(distExtra[dsym]), len))
+			return false;
+	}
+}
+
+int inflateStream(InflateIo *io) {
+	if(!fixedBuilt) {
+		u8 lengths[MAX_LITLEN];
+		memset(lengths, 8, 144);
+		memset(lengths + 144, 9, 112);
+		memset(lengths + 256, 7, 24);
+		memset(lengths + 280, 8, 8);
+		build(&fixedLitlen, lengths, MAX_LITLEN);
+		memset(lengths, 5, 30);
+		build(&fixedDist, lengths, 30);
+		fixedBuilt = true;
+	}
+
+	Decoder d = {};
+	d.io = io;
+	d.ring = io->ring;
+	d.ringEnd = io->ring + io->ringSize;
+	d.adler = ADLER_INIT;
+	u32 avail;
+	d.ostart = d.op = io->output(io->ctx, 0, &avail);
+	if(!d.op)
+		return -1;
+	d.oend = d.op + avail;
+
+	// zlib header: deflate, no preset dictionary
+	if(!d.need(16))
+		return -1;
+	u32 cmf = d.bits(8), flg = d.bits(8);
+	if((cmf & 0x0F) != 8 || (cmf >> 4) > 7 || (cmf << 8 | flg) % 31 != 0 || (flg & 0x20))
+		return -1;
+
+	bool last;
+	do {
+		if(!d.need(3))
+			return -1;
+		last = d.bits(1);
+		bool ok;
+		switch(d.bits(2)) {
+			case 0: ok = d.stored(); break;
+			case 1: ok = d.codes(&fixedLitlen, &fixedDist); break;
+			case 2: ok = d.dynamic(); break;
+			default: ok = false; break;
+		}
+		if(!ok)
+			return -1;
+	} while(!last);
+
+	if(!d.commit())
+		return -1;
+
+	// Big endian adler32 of the output
+	d.bits(d.bitcount & 7);
+	u32 check = 0;
+	for(int i = 0; i < 4; i++) {
+		if(!d.need(8))
+			return -1;
+		check = check << 8 | d.bits(8);
+	}
+	if(check != d.adler)
+		return -1;
+
+	// Whole bytes still buffered were never part of the stream
+	io->unused = (d.iend - d.ip) + d.bitcount / 8;
+	return 0;
+}
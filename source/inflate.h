@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#ifndef INFLATE_H
+#define INFLATE_H
+
+#include "platform.h"
+
+// Largest distance a deflate match can reach back
+#define INFLATE_HISTORY (32 * 1024)
+
+// Where a zlib stream is decoded from and to. Output is written straight
+// into the caller's ring, which doubles as the history for matches, so
+// unlike inflate() nothing is copied into a separate window. The ring must
+// keep at least INFLATE_HISTORY bytes intact behind the write position.
+struct InflateIo {
+	void *ctx;
+
+	// Returns more input, NULL on error. The decoder is done with everything
+	// returned before, except unused bytes of the last call once it finishes.
+	const u8 *(*input)(void *ctx, u32 *size);
+
+	// Takes the used bytes written at the last position returned and returns
+	// where to write next, with at least one byte of room up to *avail.
+	// NULL on error.
+	u8 *(*output)(void *ctx, u32 used, u32 *avail);
+
+	u8 *ring;
+	u32 ringSize;
+
+	u32 unused; // of the last input, set when the stream ends
+};
+
+// Decodes one zlib stream, checking its adler32. Never asks for input past
+// the stream's end. Returns 0, or -1 for malformed data or an io error.
+int inflateStream(InflateIo *io);
+
+#endif // INFLATE_H
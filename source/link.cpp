@@ -3,401 +3,770 @@
 // Copyright (c) 2024 Evie "Pk11"
 
 #include "link.h"
-#include "nds/interrupts.h"
-
-#include <nds.h>
-#include <dswifi9.h>
-#include <sys/errno.h>
-#include <sys/ioctl.h>
-#include <sys/socket.h>
+#include "adler.h"
+#include "cache.h"
+#include "clock.h"
+#include "fleet.h"
+#include "manifest.h"
+#include "netio.h"
+#include "platform.h"
+#include "progress.h"
+#include "protocol.h"
+#include "resume.h"
+#include "signature.h"
+#include "sync.h"
+#include "task.h"
+#include "trace.h"
+#include "transfer.h"
+
+#include <dirent.h>
 #include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <zlib.h>
-#include "xdelta3.h"
-
-#define RECV_MAGIC_3DS "3dsboot"
-#define SEND_MAGIC_3DS "boot3ds"
-#define RECV_MAGIC_DELTA "dslink-delta-host"
-#define SEND_MAGIC_DELTA "dslink-delta-client"
-#define PORT 17491
-
-#define CHUNK_SIZE (16 * 1024)
-unsigned char in[CHUNK_SIZE];
-unsigned char out[CHUNK_SIZE];
-static volatile size_t filelen, filetotal;
-
-static int recvall(int sock, void* buffer, int size, int flags) {
-	u8 *ptr = (u8 *)buffer;
-	int len, sizeleft = size;
-
-	while(sizeleft) {
-		len = recv(sock, ptr, sizeleft, flags);
-		if(!len) {
-			size = 0;
-			break;
-		} else if(len < 0) {
-			if(errno != EAGAIN && errno != EWOULDBLOCK) {
-				iprintf("recv %d\n", errno);
-				break;
-			}
-		} else {
-			sizeleft -= len;
-			ptr += len;
-		}
-	}
-	return size;
-}
-
-static int receiveAndDecompress(int sock, FILE* fh, size_t filesize) {
-	int ret;
-	unsigned have;
-	z_stream strm;
-	size_t chunksize;
-
-	// allocate inflate state
-	strm.zalloc = Z_NULL;
-	strm.zfree = Z_NULL;
-	strm.opaque = Z_NULL;
-	strm.avail_in = 0;
-	strm.next_in = Z_NULL;
-	ret = inflateInit(&strm);
-	if(ret != Z_OK) {
-		iprintf("inflateInit %d\n", ret);
-		return ret;
-	}
-
-	size_t total = 0;
-	// decompress until deflate stream ends or end of file
-	do {
-		int len = recvall(sock, &chunksize, 4, 0);
-		if(len != 4) {
-			inflateEnd(&strm);
-			iprintf("chunksize %d\n", len);
-			return Z_DATA_ERROR;
-		}
-
-		strm.avail_in = recvall(sock,in,chunksize,0);
-		if(strm.avail_in == 0) {
-			inflateEnd(&strm);
-			iprintf("closed %d\n", 0);
-			return Z_DATA_ERROR;
-		}
-
-		strm.next_in = in;
 
-		// run inflate() on input until output buffer not full
-		do {
-			strm.avail_out = CHUNK_SIZE;
-			strm.next_out = out;
-			ret = inflate(&strm, Z_NO_FLUSH);
-
-			switch(ret) {
-				case Z_NEED_DICT:
-					ret = Z_DATA_ERROR; // and fall through
-				case Z_DATA_ERROR:
-				case Z_MEM_ERROR:
-				case Z_STREAM_ERROR:
-					inflateEnd(&strm);
-					iprintf("inflate %d\n", ret);
-					return ret;
-			}
-
-			have = CHUNK_SIZE - strm.avail_out;
-
-			if(fwrite(out, 1, have, fh) != have || ferror(fh)) {
-				inflateEnd(&strm);
-				iprintf("fwrite");
-				return Z_ERRNO;
-			}
-
-			total += have;
-			filetotal = total;
-			iprintf("Progress: %zu (%d%%)\r", total, (100 * total) / filesize);
-			//netloader_draw_progress();
-		} while(strm.avail_out == 0);
+static volatile size_t filelen;
 
-		// done when inflate() says it's done
-	} while(ret != Z_STREAM_END);
+// A transfer is running, the spinner keeps out of its way
+static bool busy;
 
-	// clean up and return
-	inflateEnd(&strm);
-	iprintf("Done!                           ");
-	return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
-}
-
-static int receiveAndPatch(int sock, FILE *outFile, FILE *srcFile, size_t filesize) {
-	xd3_stream stream;
-	xd3_config config;
-	xd3_init_config(&config, XD3_ADLER32);
-	config.winsize = 64 * 1024;
-	if (xd3_config_stream(&stream, &config) != 0) {
-		iprintf("Error initializing xdelta stream\n");
-		return -1;
-	}
-
-	xd3_source source = {0};
-	source.name = "src";
-	source.ioh = srcFile;
-	source.blksize = CHUNK_SIZE;
-	source.curblkno = (xoff_t) -1;
-	source.curblk = NULL;
-	xd3_set_source(&stream, &source);
-
-	int retval = 0, len, chunksize = -1;
-	int status = XD3_INPUT;
-	size_t total = 0;
-
-	while (total < filesize || status != XD3_INPUT) {
-		switch (status) {
-		case XD3_INPUT:
-			len = recvall(sock, &chunksize, 4, 0);
-			if (len != 4) {
-				iprintf("chunksize\n");
-				retval = -1;
-				goto xdelta_cleanup;
-			}
-			len = recvall(sock, in, chunksize, 0);
-			if (len == 0 || len != chunksize) {
-				iprintf("closed \n");
-				retval = -1;
-				goto xdelta_cleanup;
-			}
-			xd3_avail_input(&stream, in, chunksize);
-			break;
-		case XD3_OUTPUT:
-			if (fwrite(stream.next_out, 1, stream.avail_out, outFile) != stream.avail_out) {
-				iprintf("fwrite\n");
-				retval = -1;
-				goto xdelta_cleanup;
-			}
-			total += stream.avail_out;
-			filetotal = total;
-			iprintf("Progress: %zu (%d%%)\r", total, (100 * total) / filesize);
-			xd3_consume_output(&stream);
-			break;
-		case XD3_GETSRCBLK:
-			fseek(srcFile, source.blksize * source.getblkno, SEEK_SET);
-			source.onblk = fread(out, 1, source.blksize, srcFile);
-			source.curblk = out;
-			source.curblkno = source.getblkno;
-			break;
-		case XD3_GOTHEADER:
-		case XD3_WINSTART:
+// Draws the spinner while searching, stops everything when the system wants
+// to exit and cancels the link task on B
+static Task uiTask(int link) {
+	const char *spinner = "|/-\\";
+	const int spinLen = strlen(spinner);
+	int spinPos = 0;
+	while(true) {
+		int ready = co_await taskFrame();
+		if(ready != NET_OK)
 			break;
-		case XD3_WINFINISH:
-			if (total == filesize) xd3_set_flags(&stream, XD3_FLUSH | stream.flags);
+		if(!busy) {
+			iprintf("Searching... %c\r", spinner[spinPos >> 2]);
+			spinPos = (spinPos + 1) % (spinLen << 2);
+		}
+		if(!pmMainLoop()) {
+			netCancel();
 			break;
-		default:
-			iprintf("xdelta error!\n");
-			retval = status;
-			goto xdelta_cleanup;
 		}
-		status = xd3_decode_input(&stream);
+#ifdef ARM9
+		scanKeys();
+		if(keysDown() & KEY_B) {
+			iprintf("Cancelled\n");
+			taskCancel(link);
+		}
+#endif
 	}
+	co_return 0;
+}
 
-xdelta_cleanup:
-	if (xd3_close_stream(&stream) != 0) {
-		iprintf("Something wrong when closing stream\n");
+// Reads ahead at what the host may ask for next while nothing else happens,
+// a slice a frame for as long as the walk is started, then hashes the builds
+// the cache took in. Paused during a transfer.
+static Task idleTask(void) {
+	while(true) {
+		int ready = co_await taskFrame();
+		if(ready != NET_OK)
+			break;
+		if(!manifestIdleStep(MANIFEST_IDLE_SLICE_MS))
+			cacheIdleStep(MANIFEST_IDLE_SLICE_MS);
 	}
-	xd3_free_stream(&stream);
-	
-	if (retval == 0) iprintf("Done!                           ");
-	return retval;
+	co_return 0;
 }
 
-//---------------------------------------------------------------------------------
-bool receive(char *filename, char *arg0) {
-//---------------------------------------------------------------------------------
-	if(!filename) {
-		iprintf("filename null\n");
-		return false;
-	}
+bool LinkSession::associate(void) {
+#ifdef ARM9
+	if(associated && Wifi_AssocStatus() == ASSOCSTATUS_ASSOCIATED)
+		return true;
 
 	iprintf("Connecting...\r");
-	if(!Wifi_InitDefault(WFC_CONNECT)) {
-		iprintf("Failed to connect!\n");
-		return false;
+	if(!initialized) {
+		if(!Wifi_InitDefault(WFC_CONNECT)) {
+			iprintf("Failed to connect!\n");
+			return false;
+		}
+		initialized = true;
+	} else {
+		// Lost the AP since the last transfer, the old sockets went with it
+		closeListeners();
+		Wifi_AutoConnect();
+		int status;
+		do {
+			swiWaitForVBlank();
+			status = Wifi_AssocStatus();
+		} while(status != ASSOCSTATUS_ASSOCIATED && status != ASSOCSTATUS_CANNOTCONNECT);
+		if(status != ASSOCSTATUS_ASSOCIATED) {
+			iprintf("Failed to connect!\n");
+			return false;
+		}
 	}
+	associations++;
 
 	struct in_addr ip, gateway, mask, dns1, dns2;
 	ip = Wifi_GetIPInfo(&gateway, &mask, &dns1, &dns2);
 	iprintf("Connected: %s\n",inet_ntoa(ip));
-	
-	int sock_udp = socket(PF_INET, SOCK_DGRAM, 0);
-	struct sockaddr_in sa_udp, sa_udp_remote;
+#else
+	if(!associated) {
+		iprintf("Listening on port %d\n", PORT);
+		associations++;
+	}
+#endif
+	associated = true;
+	return true;
+}
+
+bool LinkSession::openListeners(void) {
+	if(sockUdp != -1 && sockTcp != -1)
+		return true;
+
+	int i = 1;
+	sockUdp = socket(PF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in sa_udp;
 
 	sa_udp.sin_family = AF_INET;
-	sa_udp.sin_addr.s_addr = INADDR_ANY;
-	sa_udp.sin_port = htons(17491);
+	sa_udp.sin_addr.s_addr = bindAddress;
+	sa_udp.sin_port = htons(PORT);
 
-	if(bind(sock_udp, (struct sockaddr*) &sa_udp, sizeof(sa_udp)) < 0) {
+#ifndef ARM9
+	setsockopt(sockUdp, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i));
+#endif
+	if(bind(sockUdp, (struct sockaddr*) &sa_udp, sizeof(sa_udp)) < 0) {
 		iprintf(" UDP socket error\n");
+		closeListeners();
 		return false;
 	}
 
 	struct sockaddr_in sa_tcp;
-	sa_tcp.sin_addr.s_addr = INADDR_ANY;
+	sa_tcp.sin_addr.s_addr = bindAddress;
 	sa_tcp.sin_family = AF_INET;
-	sa_tcp.sin_port = htons(17491);
-	int sock_tcp = socket(AF_INET,SOCK_STREAM,0);
-	if (bind(sock_tcp, (struct sockaddr *)&sa_tcp, sizeof(sa_tcp)) < 0) {
+	sa_tcp.sin_port = htons(PORT);
+	sockTcp = socket(AF_INET,SOCK_STREAM,0);
+#ifndef ARM9
+	setsockopt(sockTcp, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i));
+#endif
+	if (bind(sockTcp, (struct sockaddr *)&sa_tcp, sizeof(sa_tcp)) < 0) {
 		iprintf(" TCP socket error\n");
+		closeListeners();
 		return false;
 	}
-	int i = 1;
-	ioctl(sock_tcp, FIONBIO, &i);
-	ioctl(sock_udp, FIONBIO, &i);
-	listen(sock_tcp,2);
-
-	u32 dummy;
-	int sock_tcp_remote;
-	char recvbuf[256];
-	int spinPos = 0;
-	const char *spinner = "|/-\\";
-	const int spinLen = strlen(spinner);
+	ioctl(sockTcp, FIONBIO, &i);
+	ioctl(sockUdp, FIONBIO, &i);
+	listen(sockTcp,2);
+	return true;
+}
 
-	bool hostIsDelta = false;
+void LinkSession::closeListeners(void) {
+	if(sockUdp != -1)
+		closesocket(sockUdp);
+	if(sockTcp != -1)
+		closesocket(sockTcp);
+	sockUdp = sockTcp = -1;
+}
 
-	while(pmMainLoop()) {
-		swiWaitForVBlank();
-		iprintf("Searching... %c\r", spinner[spinPos >> 2]);
-		spinPos = (spinPos + 1) % (spinLen << 2);
+void LinkSession::disconnect(void) {
+	closeListeners();
+#ifdef ARM9
+	if(initialized)
+		Wifi_DisconnectAP();
+#endif
+	associated = false;
+}
 
-		int len = recvfrom(sock_udp, recvbuf, sizeof(recvbuf), 0, (struct sockaddr*) &sa_udp_remote, &dummy);
+static u8 *put(u8 *p, const void *data, int size) {
+	memcpy(p, data, size);
+	return p + size;
+}
 
-		if(len!=-1) {
-			if (strncmp(recvbuf, RECV_MAGIC_3DS, sizeof(RECV_MAGIC_3DS) - 1) == 0) {
-				sa_udp_remote.sin_family = AF_INET;
-				sa_udp_remote.sin_port = htons(PORT);
-				sendto(sock_udp, SEND_MAGIC_3DS, sizeof(SEND_MAGIC_3DS) - 1, 0, (struct sockaddr*) &sa_udp_remote, sizeof(sa_udp_remote));
-			}
-			else if (strncmp(recvbuf, RECV_MAGIC_DELTA, sizeof(RECV_MAGIC_DELTA) -1) == 0) {
-				sa_udp_remote.sin_family = AF_INET;
-				sa_udp_remote.sin_port = htons(PORT);
-				sendto(sock_udp, SEND_MAGIC_DELTA, sizeof(SEND_MAGIC_DELTA) - 1, 0, (struct sockaddr*) &sa_udp_remote, sizeof(sa_udp_remote));
-				hostIsDelta = true;
+// What the beacon says about the card. A search sees a ping every few hundred
+// ms and walking /nds or counting free clusters can take a while on a big
+// card, so it is gathered once per receive().
+static struct {
+	bool valid;
+	u32 freeKiB;
+	u16 files, count;
+	u32 entries[2 * BEACON_MAX_FILES];
+} beacon;
+
+static void beaconWalk(char *path, int rootLen) {
+	DIR *dir = opendir(path);
+	if(!dir)
+		return;
+	int len = strlen(path);
+	struct dirent *ent;
+	while((ent = readdir(dir)) != NULL) {
+		if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+		if(len + 1 + strlen(ent->d_name) >= 256)
+			continue;
+		sniprintf(path + len, 256 - len, "/%s", ent->d_name);
+		struct stat st;
+		if(stat(path, &st) == 0) {
+			if(S_ISDIR(st.st_mode)) {
+				beaconWalk(path, rootLen);
+			} else if(S_ISREG(st.st_mode)) {
+				if(beacon.count < BEACON_MAX_FILES) {
+					const char *rel = path + rootLen;
+					beacon.entries[2 * beacon.count] = crc32(0, (const Bytef *)rel, strlen(rel));
+					beacon.entries[2 * beacon.count + 1] = st.st_size;
+					beacon.count++;
+				}
+				if(beacon.files < 0xFFFF)
+					beacon.files++;
 			}
 		}
+		path[len] = 0;
+	}
+	closedir(dir);
+}
 
-		sock_tcp_remote = accept(sock_tcp, (struct sockaddr *)&sa_tcp, &dummy);
-		if(sock_tcp_remote != -1) {
-			int response = 0;
-			u32 len;
-
-			bool deltaMode = false;
-			if (hostIsDelta) {
-				u8 mode;
-				len = recvall(sock_tcp_remote, &mode, sizeof(u8), 0);
-				if (len != sizeof(u8) || mode > 2) {
-					iprintf("mode %d\n", errno);
-					return false;
-				}
-				deltaMode = mode;
-			}
+static void beaconGather(void) {
+	if(beacon.valid)
+		return;
+	beacon.freeKiB = freeStorage();
+	beacon.files = beacon.count = 0;
+	char path[256];
+	int rootLen = sniprintf(path, sizeof(path), "%s/nds", storageRoot()) + 1;
+	beaconWalk(path, rootLen);
+	beacon.valid = true;
+}
 
-			u32 namelen;
-// SPDX-FileNotice: Modified from the original version by the BlocksDS project.
-			len = recvall(sock_tcp_remote, &namelen, 4, 0);
-			if(len != 4 || namelen >= 256) {
-				iprintf("namelen %d\n", errno);
-				return false;
+// The v2 hello, see protocol.h. Returns its length.
+static int buildHello(u8 *buf, const char *query) {
+	u8 *p = buf;
+	u8 version = PROTOCOL_V2, flags = HELLO_RESUME | HELLO_CHECKED | HELLO_STORED | HELLO_FLEET | HELLO_BEACON | HELLO_STATS | HELLO_CACHE;
+	u8 secondary = 0;
+	u16 codecs = 1 << MODE_ZLIB | 1 << MODE_DELTA | 1 << MODE_SYNC | 1 << MODE_LZ4 | 1 << MODE_FLEET | 1 << MODE_SIGNATURE | 1 << MODE_CACHED;
+	u32 limits[4] = {CHUNK_SIZE, freeMemory(), XDELTA_SRC_BLOCK, XDELTA_WINSIZE};
+	// Same defaults as xdelta3.c, which only builds what it is asked for
+#if SECONDARY_DJW
+	secondary |= HELLO_SEC_DJW;
+#endif
+#if SECONDARY_FGK
+	secondary |= HELLO_SEC_FGK;
+#endif
+#if defined(SECONDARY_LZMA) ? SECONDARY_LZMA : defined(HAVE_LZMA_H)
+	secondary |= HELLO_SEC_LZMA;
+#endif
+	p = put(p, &version, 1);
+	p = put(p, &flags, 1);
+	p = put(p, &codecs, 2);
+	p = put(p, limits, sizeof(limits));
+	p = put(p, &secondary, 1);
+
+	// Offer the interrupted transfer up front so the host can pick the start
+	ResumeRecord rec;
+	char prefix[16];
+	int prefixLen = sniprintf(prefix, sizeof(prefix), "%s/nds/", storageRoot());
+	u8 mode = 0, namelen = 0;
+	u32 state[4] = {};
+	if (resumeLoad(&rec) && strncmp(rec.name, prefix, prefixLen) == 0) {
+		mode = rec.mode;
+		namelen = strlen(rec.name + prefixLen);
+		state[0] = rec.filelen;
+		state[1] = rec.baseChecksum;
+		state[2] = rec.offset;
+		state[3] = rec.checksum;
+	}
+	p = put(p, &mode, 1);
+	p = put(p, state, sizeof(state));
+	p = put(p, &namelen, 1);
+	p = put(p, rec.name + prefixLen, namelen);
+
+	beaconGather();
+	u8 console = consoleType(), fileState = BEACON_FILE_UNASKED;
+	u32 file[2] = {};
+	if(query) {
+		char path[256];
+		sniprintf(path, sizeof(path), "%s/nds/%s", storageRoot(), query);
+		fileState = manifestChecksum(path, &file[0], &file[1]) ? BEACON_FILE_PRESENT : BEACON_FILE_MISSING;
+	}
+	p = put(p, &console, 1);
+	p = put(p, &beacon.freeKiB, 4);
+	p = put(p, &fileState, 1);
+	p = put(p, file, sizeof(file));
+	p = put(p, &beacon.files, 2);
+	p = put(p, &beacon.count, 2);
+	p = put(p, beacon.entries, 8 * beacon.count);
+
+	u32 cached[2 * BEACON_MAX_CACHED];
+	u8 cachedCount = cacheList(cached);
+	p = put(p, &cachedCount, 1);
+	p = put(p, cached, 8 * cachedCount);
+	return p - buf;
+}
+
+void LinkSession::handleDiscovery(void) {
+	struct sockaddr_in sa_udp_remote;
+	u32 dummy = sizeof(sa_udp_remote);
+	char recvbuf[256];
+	int len = recvfrom(sockUdp, recvbuf, sizeof(recvbuf), 0, (struct sockaddr*) &sa_udp_remote, &dummy);
+	if(len == -1)
+		return;
+
+	if (strncmp(recvbuf, RECV_MAGIC_3DS, sizeof(RECV_MAGIC_3DS) - 1) == 0) {
+		sa_udp_remote.sin_family = AF_INET;
+		if (!DISCOVERY_REPLY_TO_SENDER) sa_udp_remote.sin_port = htons(PORT);
+		sendto(sockUdp, SEND_MAGIC_3DS, sizeof(SEND_MAGIC_3DS) - 1, 0, (struct sockaddr*) &sa_udp_remote, sizeof(sa_udp_remote));
+		if (!netStats.pingTicks) netStats.pingTicks = clockTicks();
+	}
+	else if (strncmp(recvbuf, RECV_MAGIC_DELTA, sizeof(RECV_MAGIC_DELTA) -1) == 0) {
+		const int magicLen = sizeof(RECV_MAGIC_DELTA) - 1;
+		hostVersion = len > magicLen && recvbuf[magicLen] >= PROTOCOL_V2 ? PROTOCOL_V2 : PROTOCOL_V1;
+
+		// v2 hosts may name the file they are about to send
+		const char *query = NULL;
+		if (hostVersion >= PROTOCOL_V2 && len > magicLen + 1) {
+			int namelen = (u8)recvbuf[magicLen + 1];
+			if (namelen > 0 && magicLen + 2 + namelen < (int)sizeof(recvbuf) && magicLen + 2 + namelen <= len) {
+				recvbuf[magicLen + 2 + namelen] = 0;
+				query = recvbuf + magicLen + 2;
 			}
+		}
+		strcpy(hostQuery, query ? query : "");
+
+		static u8 reply[sizeof(SEND_MAGIC_DELTA) - 1 + 64 + 256 + 32 + 8 * BEACON_MAX_FILES + 1 + 8 * BEACON_MAX_CACHED];
+		int replyLen = sizeof(SEND_MAGIC_DELTA) - 1;
+		memcpy(reply, SEND_MAGIC_DELTA, replyLen);
+		if (hostVersion >= PROTOCOL_V2)
+			replyLen += buildHello(reply + replyLen, query);
+
+		sa_udp_remote.sin_family = AF_INET;
+		if (!DISCOVERY_REPLY_TO_SENDER) sa_udp_remote.sin_port = htons(PORT);
+		sendto(sockUdp, reply, replyLen, 0, (struct sockaddr*) &sa_udp_remote, sizeof(sa_udp_remote));
+		if (!netStats.pingTicks) netStats.pingTicks = clockTicks();
+		// Whatever the hello had to read is kept for next time
+		manifestFlush();
+	}
+}
 
-			len = recvall(sock_tcp_remote, recvbuf, namelen, 0);
-			if(len != namelen) {
-				iprintf("name %d\n", errno);
-				return false;
+static void receiveArgs(int sock, char *arg0) {
+	char recvbuf[256];
+	u32 cmdlen;
+	int len = netRecvAll(sock, &cmdlen, 4);
+	if(len == 4 && cmdlen < sizeof(recvbuf)) {
+		len = netRecvAll(sock, recvbuf, cmdlen);
+		if(len == (int)cmdlen) {
+			recvbuf[cmdlen] = 0;
+			if(memcmp(recvbuf, "sdmc:/3ds/", 10) == 0) {
+				sniprintf(arg0, 256, "%s/nds/%s", storageRoot(), recvbuf + 10);
+			} else {
+				strcpy(arg0, recvbuf);
 			}
-			recvbuf[namelen] = 0;
-			sniprintf(filename, 256, "%s:/nds/%s", isDSiMode() ? "sd" : "fat", recvbuf);
+		}
+	}
+}
 
-			len = recvall(sock_tcp_remote, (int*)&filelen, 4, 0);
-			if(len != 4) {
-				iprintf("filelen %d\n", errno);
+// Reads and discards until the host closes, so our response isn't lost to a
+// reset from closing with its payload still unread
+static void drain(int sock) {
+	u64 deadline = clockTicks() + msToTicks(2000);
+	while(netWaitReadable(&sock, 1, deadline) == 0) {
+		int len = netRecv(sock, in, CHUNK_SIZE);
+		if(len == 0 || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+			break;
+	}
+}
+
+bool LinkSession::handleConnection(int sock, char *filename, char *arg0) {
+	int response = 0;
+	u32 len;
+	char recvbuf[256];
+
+	// v2 hosts send the whole request up front and never wait for us before
+	// the payload, the only response is the final one
+	bool v2 = hostVersion >= PROTOCOL_V2;
+	bool deltaMode = false, lz4Mode = false, fleetMode = false, signatureMode = false, cachedMode = false, resumable = false, stats = false;
+	u32 pipeFlags = 0;
+	if (hostVersion >= PROTOCOL_V1) {
+		u8 mode;
+		len = netRecvAll(sock, &mode, sizeof(u8));
+		resumable = mode & MODE_FLAG_RESUME;
+		stats = v2 && (mode & MODE_FLAG_STATS);
+		if (mode & MODE_FLAG_CHECKED) pipeFlags |= PIPE_CHECKED;
+		if (mode & MODE_FLAG_STORED) pipeFlags |= PIPE_STORED;
+		mode &= MODE_MASK;
+		if (len != sizeof(u8) || mode > MODE_CACHED || ((mode == MODE_FLEET || mode == MODE_SIGNATURE || mode == MODE_CACHED) && !v2)) {
+			iprintf("mode %d\n", errno);
+			return false;
+		}
+		if (mode == MODE_SYNC) {
+			if (v2) receiveArgs(sock, arg0);
+			response = receiveTree(sock, filename, pipeFlags);
+			netSendAll(sock, &response, sizeof(response));
+			if (response != RESPONSE_OK)
 				return false;
-			}
+			if (!v2) receiveArgs(sock, arg0);
+			return true;
+		}
+		deltaMode = mode == MODE_DELTA || mode == MODE_LEGACY;
+		lz4Mode = mode == MODE_LZ4;
+		fleetMode = mode == MODE_FLEET;
+		signatureMode = mode == MODE_SIGNATURE;
+		cachedMode = mode == MODE_CACHED;
+	}
 
-			iprintf("Receiving %s,\n          %d bytes\n", filename, filelen);
+	u32 namelen;
+// SPDX-FileNotice: Modified from the original version by the BlocksDS project.
+	len = netRecvAll(sock, &namelen, 4);
+	if(len != 4 || namelen >= 256) {
+		iprintf("namelen %d\n", errno);
+		return false;
+	}
 
-			FILE *sourceFile = NULL;
-			if (deltaMode) {
-				sourceFile = fopen(filename, "rb");
-				if (!sourceFile) {
-					iprintf("Failed to open %s\n", filename);
-					response = -4;
-					deltaMode = false;
-				}
-				else {
-					uint32_t hostChecksum;
-					len = recvall(sock_tcp_remote, &hostChecksum, 4, 0);
-					if (len != 4) {
-						iprintf("hostChecksum %d\n", errno);
-						return false;
-					}
-					uint32_t checksum = adler32(0, NULL, 0);
-					while (!feof(sourceFile)) {
-						size_t read = fread(in, 1, CHUNK_SIZE, sourceFile);
-						checksum = adler32(checksum, in, read);
-					}
-					fseek(sourceFile, 0, SEEK_SET);
-					if (checksum != hostChecksum) {
-						iprintf("Mismatched checksum\n");
-						response = -5;
-						deltaMode = false;
-						fclose(sourceFile);
-						sourceFile = NULL;
-					}
-				}
-			}
+	len = netRecvAll(sock, recvbuf, namelen);
+	if(len != namelen) {
+		iprintf("name %d\n", errno);
+		return false;
+	}
+	recvbuf[namelen] = 0;
+	if(sniprintf(filename, 256, "%s/nds/%s", storageRoot(), recvbuf) >= 256) {
+		iprintf("Name too long\n");
+		response = RESPONSE_BAD_PATH;
+		netSendAll(sock, &response, sizeof(response));
+		drain(sock);
+		return false;
+	}
 
-			FILE *outfile = fopen(deltaMode ? "dslink.out" : filename, "wb");
-			if(!outfile) {
-				iprintf("Failed to open %s\n", deltaMode ? "dslink.out" : filename);
-				response = -1;
-			}
+	len = netRecvAll(sock, (int*)&filelen, 4);
+	if(len != 4) {
+		iprintf("filelen %d\n", errno);
+		return false;
+	}
 
-			send(sock_tcp_remote, &response, sizeof(response), 0);
+	// v2 delta bases and cached builds come with their size and crc32 too
+	uint32_t hostChecksum = 0, hostStart = 0, baseSize = 0, baseCrc = 0;
+	if (v2) {
+		u32 fields[4] = {};
+		int size = deltaMode || cachedMode ? 16 : 8;
+		if (netRecvAll(sock, fields, size) != size) {
+			iprintf("request %d\n", errno);
+			return false;
+		}
+		hostChecksum = fields[0];
+		hostStart = fields[1];
+		baseSize = fields[2];
+		baseCrc = fields[3];
+		receiveArgs(sock, arg0);
+	}
 
-			int res = 0;
-			if (deltaMode) res = receiveAndPatch(sock_tcp_remote, outfile, sourceFile, filelen);
-			else res = receiveAndDecompress(sock_tcp_remote, outfile, filelen);
+	// A build the beacon listed, put back without a payload
+	if (cachedMode) {
+		iprintf("Restoring %s\n", filename);
+		response = cacheRestore(filename, filelen, hostChecksum, baseCrc);
+		hostRetries = response == RESPONSE_NO_BASE;
+		netMarkRequest();
+		netSendAll(sock, &response, sizeof(response));
+		return response == RESPONSE_OK;
+	}
 
-			fclose(outfile);
-			if (sourceFile) fclose(sourceFile);
+	iprintf("Receiving %s,\n          %d bytes\n", filename, (int)filelen);
+
+	// The payload comes by broadcast, the connection only carries repairs
+	if (fleetMode)
+		return receiveFleet(sock, filename, filelen, hostChecksum) == RESPONSE_OK;
 
-			if (deltaMode) {
-				if (res != 0) {
-					iprintf("delta patch failed %d\n", res);
+	// Built from the client's own file, a mismatch is sent again as zlib
+	if (signatureMode) {
+		response = receiveSignature(sock, filename, filelen, hostChecksum, pipeFlags, stats);
+		hostRetries = response == RESPONSE_BAD_BASE;
+		return response == RESPONSE_OK;
+	}
+
+	FILE *sourceFile = NULL;
+	if (deltaMode) {
+		sourceFile = fopen(filename, "rb");
+		if (!sourceFile && !v2) {
+			iprintf("Failed to open %s\n", filename);
+			response = RESPONSE_NO_BASE;
+		}
+		else {
+			if (!v2) {
+				len = netRecvAll(sock, &hostChecksum, 4);
+				if (len != 4) {
+					iprintf("hostChecksum %d\n", errno);
+					fclose(sourceFile);
 					return false;
 				}
-				remove(filename);
-				rename("dslink.out", filename);
 			}
-			else if(res != Z_OK) {
-				iprintf("decompress failed %d\n", res);
-				return false;
+			// Usually answered from the manifest without reading the base
+			bool present = sourceFile != NULL;
+			u32 size, checksum;
+			if (!present || !manifestChecksum(filename, &size, &checksum))
+				checksum = ~hostChecksum;
+			if (present && (checksum != hostChecksum || (v2 && size != baseSize))) {
+				fclose(sourceFile);
+				sourceFile = NULL;
 			}
 
-			send(sock_tcp_remote, &response, sizeof(response), 0);
-
-			u32 cmdlen;
-			len = recvall(sock_tcp_remote, &cmdlen, 4, 0);
-			if(len == 4 && cmdlen <= sizeof(recvbuf)) {
-				len = recvall(sock_tcp_remote, recvbuf, cmdlen, 0);
-				if(len == cmdlen) {
-					recvbuf[cmdlen] = 0;
-					if(memcmp(recvbuf, "sdmc:/3ds/", 10) == 0) {
-						sniprintf(arg0, 256, "%s:/nds/%s", isDSiMode() ? "sd" : "fat", recvbuf + 10);
-					} else {
-						strcpy(arg0, recvbuf);
-					}
-				}
+			// Or against an older build that was kept
+			char cached[64];
+			if (!sourceFile && v2 && cacheLookup(baseSize, hostChecksum, baseCrc, cached, sizeof(cached)))
+				sourceFile = fopen(cached, "rb");
+			if (!sourceFile && present) {
+				iprintf("Mismatched checksum\n");
+				response = RESPONSE_BAD_BASE;
+			} else if (!sourceFile) {
+				iprintf("Failed to open %s\n", filename);
+				response = RESPONSE_NO_BASE;
 			}
-			shutdown(sock_tcp_remote, 0);
-			closesocket(sock_tcp_remote);
+		}
+		deltaMode = sourceFile != NULL;
+	}
 
-			return true;
+	// The v2 delta payload is already on its way, the host sends zlib on a
+	// new connection once it sees why we stopped
+	if (v2 && response != RESPONSE_OK) {
+		netSendAll(sock, &response, sizeof(response));
+		drain(sock);
+		hostRetries = true;
+		return false;
+	}
+
+	// Pick up where an interrupted transfer of the same file left off
+	u32 codec = deltaMode ? MODE_DELTA : lz4Mode ? MODE_LZ4 : MODE_ZLIB;
+	ResumeRecord rec;
+	if (resumable) {
+		ResumeRecord saved;
+		if (!resumeLoad(&saved) || saved.mode != codec || saved.filelen != filelen
+				|| saved.baseChecksum != (deltaMode ? hostChecksum : 0) || strcmp(saved.name, filename) != 0) {
+			memset(&saved, 0, sizeof(saved));
+			saved.mode = codec;
+			saved.filelen = filelen;
+			saved.baseChecksum = deltaMode ? hostChecksum : 0;
+			saved.checksum = ADLER_INIT;
+			strcpy(saved.name, filename);
+		}
+		rec = saved;
+	}
+
+	// Written in place, whatever happens next the old checksum is gone. A
+	// build that is replaced from the start is kept first.
+	if (!deltaMode && !(resumable && rec.offset)) cacheKeep(filename);
+	if (!deltaMode) manifestForget(filename);
+
+	char patched[32];
+	dataPath(patched, sizeof(patched), "dslink.out");
+	const char *outname = deltaMode ? patched : filename;
+	FILE *outfile = NULL;
+	if (resumable && rec.offset) {
+		outfile = fopen(outname, "r+b");
+		if (outfile && fseek(outfile, 0, SEEK_END) == 0 && ftell(outfile) < (long)rec.offset) {
+			fclose(outfile);
+			outfile = NULL;
+		}
+		if (!outfile || fseek(outfile, rec.offset, SEEK_SET) != 0) {
+			if (outfile) fclose(outfile);
+			outfile = NULL;
+			rec.offset = 0;
+			rec.checksum = ADLER_INIT;
 		}
 	}
+	if (!outfile) outfile = fopen(outname, "wb");
+	if(!outfile) {
+		iprintf("Failed to open %s\n", outname);
+		response = RESPONSE_OPEN_FAILED;
+	}
+
+	if (!v2) {
+		netMarkRequest();
+		netSendAll(sock, &response, sizeof(response));
+	}
+	if(!outfile) {
+		if (v2) {
+			netSendAll(sock, &response, sizeof(response));
+			drain(sock);
+		}
+		if (sourceFile) fclose(sourceFile);
+		return false;
+	}
+
+	if (resumable) {
+		u32 start = hostStart;
+		if (!v2) {
+			u32 offer[2] = {rec.offset, rec.checksum};
+			if (netSendAll(sock, offer, sizeof(offer)) != sizeof(offer) || netRecvAll(sock, &start, 4) != 4)
+				start = ~0u;
+		}
+		if (start != 0 && start != rec.offset) {
+			iprintf("resume %d\n", errno);
+			resumeClear();
+			fclose(outfile);
+			if (sourceFile) fclose(sourceFile);
+			return false;
+		}
+		if (start != rec.offset) {
+			// The host's copy differs from what we have, start over
+			fseek(outfile, 0, SEEK_SET);
+			rec.offset = 0;
+			rec.checksum = ADLER_INIT;
+		}
+		// Anything past the offset was never committed
+		fflush(outfile);
+		ftruncate(fileno(outfile), rec.offset);
+		if (rec.offset) iprintf("Resuming at %u\n", (unsigned)rec.offset);
+		resumeSave(&rec);
+	}
+
+	int res = 0;
+	pipeline.begin(sock, outfile, pipeFlags);
+	if (resumable) pipeline.setResume(&rec);
+	size_t remaining = filelen - (resumable ? rec.offset : 0);
+	progressBegin(remaining);
+	if (deltaMode) res = receiveAndPatch(pipeline, sourceFile, remaining);
+	else if (lz4Mode) res = receiveLz4(pipeline, remaining);
+	else res = receiveAndDecompress(pipeline, remaining);
+	progressEnd(res == 0);
+
+	fclose(outfile);
+	if (sourceFile) fclose(sourceFile);
+
+	// Whatever happened the record on the card says how far we got, drop it
+	// once the file is complete
+	if (resumable && res == 0) resumeClear();
+	else if (resumable) resumeClose();
+
+	if (deltaMode) {
+		if (res != 0) {
+			iprintf("delta patch failed %d\n", res);
+			return false;
+		}
+		cacheKeep(filename);
+		manifestForget(filename);
+		remove(filename);
+		rename(patched, filename);
+	}
+	else if(res != Z_OK) {
+		iprintf("decompress failed %d\n", res);
+		return false;
+	}
+
+	netMarkRequest();
+	if (stats) sendTransferStats(sock);
+	netSendAll(sock, &response, sizeof(response));
+
+	// Resumable transfers checksum what they write, which saves reading the
+	// file back when it is the next delta base
+	if (resumable) manifestRecord(filename, rec.checksum);
+
+	if (!v2) receiveArgs(sock, arg0);
+	return true;
+}
+
+//---------------------------------------------------------------------------------
+bool LinkSession::receive(char *filename, char *arg0) {
+//---------------------------------------------------------------------------------
+	if(!filename) {
+		iprintf("filename null\n");
+		return false;
+	}
+
+	u32 before = associations;
+	if(!associate() || !openListeners())
+		return false;
+	reassociated = associations != before;
+
+	// Re-arm for the next host, which may speak a different protocol
+	hostVersion = 0;
+	hostQuery[0] = 0;
+	arg0[0] = 0;
+	// Files may have changed since the last transfer
+	beacon.valid = false;
+
+	// The tasks sleep in select() until a socket has something for them
+	// instead of polling once per frame
+	netStatsReset();
+	netCancelClear();
+	manifestStats = {};
+	manifestIdleStart();
+	taskReset();
+	int link = taskSpawn(linkTask(filename, arg0), "link");
+	discoveryId = taskSpawn(discoveryTask(), "discovery");
+	idleId = taskSpawn(idleTask(), "idle");
+	taskSpawn(uiTask(link), "ui");
+	bool ret = taskRun(link) > 0;
+	manifestIdleStop();
+	cacheIdleStop();
+	return ret;
+}
+
+Task LinkSession::discoveryTask(void) {
+	while(true) {
+		int ready = co_await taskReadable(sockUdp, 0);
+		if(ready != NET_OK)
+			break;
+		handleDiscovery();
+	}
+	co_return 0;
+}
+
+// Accepts transfers until one ends in a way the host won't retry
+Task LinkSession::linkTask(char *filename, char *arg0) {
+	while(true) {
+		int ready = co_await taskReadable(sockTcp, 0);
+		if(ready < 0)
+			co_return false;
+
+		struct sockaddr_in sa_tcp;
+		u32 dummy = sizeof(sa_tcp);
+		int sock = accept(sockTcp, (struct sockaddr *)&sa_tcp, &dummy);
+		if(sock == -1)
+			continue;
+
+		netStats.acceptTicks = clockTicks();
+		// The transfer is about to change files under the walk
+		manifestIdleStop();
+		cacheIdleStop();
+		pingToAcceptMs = netStats.pingTicks ? ticksToMs(netStats.acceptTicks - netStats.pingTicks) : 0;
+		int i = 1;
+		ioctl(sock, FIONBIO, &i);
+
+		hostRetries = false;
+		if(tracePath)
+			traceStart(tracePath, hostVersion, hostQuery);
+		// A ping mid-transfer would rewrite what the host said it is and
+		// read files being written, it waits until the transfer is over
+		busy = true;
+		taskPause(discoveryId, true);
+		taskPause(idleId, true);
+		bool ret = handleConnection(sock, filename, arg0);
+		taskPause(discoveryId, false);
+		taskPause(idleId, false);
+		busy = false;
+		traceStop();
+
+		shutdown(sock, 0);
+		closesocket(sock);
+		if(!ret && hostRetries && !taskCancelled()) {
+			// Wait for the same host to come back with a payload we can use
+			arg0[0] = 0;
+			manifestIdleStart();
+			continue;
+		}
+		co_return ret;
+	}
+}
+
+Task LinkSession::replayTask(char *filename, char *arg0) {
+	busy = true;
+	bool ret = handleConnection(-1, filename, arg0);
+	busy = false;
+	co_return ret;
+}
+
+bool LinkSession::replay(const char *path, bool realtime, char *filename, char *arg0) {
+	if(!traceReplayOpen(path, realtime, &hostVersion))
+		return false;
 
-	return false;
+	arg0[0] = 0;
+	netStatsReset();
+	netCancelClear();
+	manifestStats = {};
+	netStats.acceptTicks = clockTicks();
+	hostRetries = false;
+	taskReset();
+	int link = taskSpawn(replayTask(filename, arg0), "replay");
+	taskSpawn(uiTask(link), "ui");
+	bool ret = taskRun(link) > 0;
+	traceReplayClose();
+	return ret;
 }
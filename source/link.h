@@ -5,6 +5,45 @@
 #ifndef LINK_H
 #define LINK_H
 
-bool receive(char *filename, char *arg0);
+#include "platform.h"
+#include "task.h"
+
+// Owns the Wi-Fi association and the listening sockets for as long as the
+// program runs, so a second push after a failed launch skips association,
+// DHCP and socket setup.
+class LinkSession {
+	bool initialized = false, associated = false;
+	int sockUdp = -1, sockTcp = -1;
+	u8 hostVersion = 0;  // 0 for 3dslink, else the PROTOCOL_ version from the ping
+	char hostQuery[256] = ""; // the file the v2 ping named, kept for traces
+	bool hostRetries = false; // the v2 host will reconnect after this failure
+	u32 associations = 0;
+	int discoveryId = -1, idleId = -1; // paused while a connection is handled
+
+	bool associate(void);
+	bool openListeners(void);
+	void closeListeners(void);
+	void handleDiscovery(void);
+	bool handleConnection(int sock, char *filename, char *arg0);
+	Task discoveryTask(void);
+	Task linkTask(char *filename, char *arg0);
+	Task replayTask(char *filename, char *arg0);
+
+public:
+	// Host ping to TCP accept of the last transfer, 0 if it connected without pinging
+	u32 pingToAcceptMs = 0;
+	// Whether the last receive() had to associate with the AP
+	bool reassociated = false;
+	// Where the listeners bind, so several POSIX clients can share a machine
+	// on loopback addresses of their own
+	u32 bindAddress = INADDR_ANY;
+	// Where receive() records what the host sent, see trace.h
+	const char *tracePath = NULL;
+
+	bool receive(char *filename, char *arg0);
+	// Runs a recorded transfer through the same path without a network
+	bool replay(const char *path, bool realtime, char *filename, char *arg0);
+	void disconnect(void);
+};
 
 #endif // LINK_H
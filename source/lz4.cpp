@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#include "lz4.h"
+
+#include <string.h>
+
+static inline bool readLength(const u8 *&ip, const u8 *iend, u32 &len) {
+	u8 b;
+	do {
+		if(ip == iend)
+			return false;
+		b = *ip++;
+		len += b;
+	} while(b == 255);
+	return true;
+}
+
+HOT_CODE int lz4DecodeBlock(const u8 *src, u32 srcSize, u8 *dst, u32 dstSize) {
+	const u8 *ip = src, *iend = src + srcSize;
+	u8 *op = dst, *oend = dst + dstSize;
+
+	while(ip < iend) {
+		u32 token = *ip++;
+
+		u32 len = token >> 4;
+		if(len == 15 && !readLength(ip, iend, len))
+			return -1;
+		if(len > (u32)(iend - ip) || len > (u32)(oend - op))
+			return -1;
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		// The last sequence is literals only
+		if(ip == iend)
+			break;
+
+		if(iend - ip < 2)
+			return -1;
+		u32 offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if(offset == 0 || offset > (u32)(op - dst))
+			return -1;
+
+		len = token & 15;
+		if(len == 15 && !readLength(ip, iend, len))
+			return -1;
+		len += 4;
+		if(len > (u32)(oend - op))
+			return -1;
+
+		// Matches may overlap their own output, a word at a time is only safe
+		// when the source stays at least a word behind
+		const u8 *match = op - offset;
+		if(offset >= 4) {
+			while(len >= 4) {
+				memcpy(op, match, 4);
+				op += 4;
+				match += 4;
+				len -= 4;
+			}
+		}
+		while(len--)
+			*op++ = *match++;
+	}
+
+	return op == oend ? (int)dstSize : -1;
+}
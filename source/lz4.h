@@ -0,0 +1,23 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#ifndef LZ4_H
+#define LZ4_H
+
+#include "platform.h"
+
+// Output of every MODE_LZ4 block but the last. Half a write slot, so blocks
+// always land whole in the pipeline's output ring, and small enough that an
+// incompressible one still fits in a receive chunk.
+#define LZ4_BLOCK_SIZE (8 * 1024)
+
+// Worst case size of a compressed LZ4_BLOCK_SIZE block
+#define LZ4_BOUND(n) ((n) + (n) / 255 + 16)
+
+// Decodes one independent LZ4 block (no dictionary, no frame) that must
+// expand to exactly dstSize bytes. Returns dstSize or -1 if the block is
+// malformed, never reading or writing out of bounds.
+int lz4DecodeBlock(const u8 *src, u32 srcSize, u8 *dst, u32 dstSize);
+
+#endif // LZ4_H
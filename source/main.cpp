@@ -5,6 +5,7 @@
 // Copyright (c) 2005 - 2013 Claudio "sverx"
 // Copyright (c) 2024 Evie "Pk11"
 
+#include "clock.h"
 #include "iconTitle.h"
 #include "link.h"
 #include "nds/arm9/console.h"
@@ -25,6 +26,8 @@ void waitforA(void) {
 	}
 }
 
+static LinkSession session;
+
 //---------------------------------------------------------------------------------
 int main(int argc, char **argv) {
 //---------------------------------------------------------------------------------
@@ -36,6 +39,9 @@ int main(int argc, char **argv) {
 	// install exception stub
 	defaultExceptionHandler();
 
+	// Before anything that times itself, the network code above all
+	clockInit();
+
 	iconTitleInit();
 
 	// Subscreen as a console
@@ -59,15 +65,34 @@ int main(int argc, char **argv) {
 		iprintf("================================");
 		iprintf("dslink-delta " VER_NUMBER "\n");
 
+		// SELECT records the transfer to dslink.trace at the root, X replays
+		// it at the recorded pace and Y as fast as it decodes
+		scanKeys();
+		u32 held = keysHeld();
+		static char tracePath[32];
+		dataPath(tracePath, sizeof(tracePath), "dslink.trace");
+		session.tracePath = held & KEY_SELECT ? tracePath : NULL;
+
 		char filename[256];
 		char arg0[256];
-		bool ret = receive(filename, arg0);
+		bool ret;
+		if (held & (KEY_X | KEY_Y))
+			ret = session.replay(tracePath, held & KEY_X, filename, arg0);
+		else
+			ret = session.receive(filename, arg0);
 
 		iprintf("================================");
 		if(!ret) {
+			// The session stays up, the host can simply push again
 			iprintf("!!Failed!!\n");
 			waitforA();
-			return 1;
+			continue;
+		}
+		if(!filename[0]) {
+			// A sync that didn't ask for anything to be launched
+			iprintf("Nothing to run\n");
+			waitforA();
+			continue;
 		}
 		iprintf("Running:\n- %s\n", filename);
 		iprintf("Args:\n- %s\n", arg0);
@@ -0,0 +1,287 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#include "manifest.h"
+#include "adler.h"
+#include "clock.h"
+#include "platform.h"
+#include "transfer.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define MANIFEST_FILE "dslink.manifest"
+#define MANIFEST_NEW  "dslink.manifest.new"
+#define MANIFEST_MAGIC 0x314e414d // "MAN1"
+#define IDLE_DEPTH 8
+#define IDLE_FLUSH_FILES 16 // hashed files kept only in memory at most
+
+struct ManifestEntry {
+	u32 path;    // crc32 of the full path
+	u32 size;
+	u32 mtime;
+	u32 cluster; // st_ino, which libfat fills with the first cluster
+	u32 checksum;
+};
+
+// Oldest first, the oldest is dropped when it is full
+static ManifestEntry entries[MANIFEST_MAX_ENTRIES];
+static u32 count;
+static bool loaded, dirty;
+
+ManifestStats manifestStats;
+
+// The idle walk, open directories from /nds down and the file being hashed
+static struct {
+	bool active;
+	DIR *dirs[IDLE_DEPTH];
+	int lens[IDLE_DEPTH]; // of path at each level
+	int depth;
+	char path[256];
+	FILE *fh;
+	struct stat st;
+	u32 sum;
+	u32 unsaved;
+} idle;
+
+static bool loadFrom(const char *name) {
+	FILE *fh = fopen(name, "rb");
+	if(!fh)
+		return false;
+	u32 header[3];
+	bool ok = fread(header, sizeof(header), 1, fh) == 1 && header[0] == MANIFEST_MAGIC && header[1] <= MANIFEST_MAX_ENTRIES
+	          && fread(entries, sizeof(ManifestEntry), header[1], fh) == header[1]
+	          && crc32(0, (const Bytef *)entries, header[1] * sizeof(ManifestEntry)) == header[2];
+	fclose(fh);
+	count = ok ? header[1] : 0;
+	return ok;
+}
+
+static void load(void) {
+	if(loaded)
+		return;
+	loaded = true;
+	// A save that died between its remove and rename leaves only the new one
+	char file[32], fresh[32];
+	dataPath(file, sizeof(file), MANIFEST_FILE);
+	dataPath(fresh, sizeof(fresh), MANIFEST_NEW);
+	if(!loadFrom(file) && !loadFrom(fresh))
+		count = 0;
+}
+
+// Written aside and renamed over the old one, FAT can't rename onto an
+// existing file so it is removed first. A torn write fails the CRC.
+static void save(void) {
+	char file[32], fresh[32];
+	dataPath(file, sizeof(file), MANIFEST_FILE);
+	dataPath(fresh, sizeof(fresh), MANIFEST_NEW);
+	FILE *fh = fopen(fresh, "wb");
+	if(!fh)
+		return;
+	u32 header[3] = {MANIFEST_MAGIC, count, (u32)crc32(0, (const Bytef *)entries, count * sizeof(ManifestEntry))};
+	bool ok = fwrite(header, sizeof(header), 1, fh) == 1 && fwrite(entries, sizeof(ManifestEntry), count, fh) == count;
+	if(fclose(fh) != 0 || !ok) {
+		remove(fresh);
+		return;
+	}
+	remove(file);
+	rename(fresh, file);
+	dirty = false;
+}
+
+static int find(u32 path) {
+	for(u32 i = 0; i < count; i++) {
+		if(entries[i].path == path)
+			return i;
+	}
+	return -1;
+}
+
+static void drop(int i) {
+	memmove(entries + i, entries + i + 1, (count - i - 1) * sizeof(ManifestEntry));
+	count--;
+}
+
+static void add(u32 path, const struct stat &st, u32 checksum) {
+	int i = find(path);
+	if(i >= 0)
+		drop(i);
+	else if(count == MANIFEST_MAX_ENTRIES)
+		drop(0);
+	entries[count++] = {path, (u32)st.st_size, (u32)st.st_mtime, (u32)st.st_ino, checksum};
+}
+
+static u32 pathHash(const char *path) {
+	return crc32(0, (const Bytef *)path, strlen(path));
+}
+
+static bool known(int i, const struct stat &st) {
+	return i >= 0 && entries[i].size == (u32)st.st_size && entries[i].mtime == (u32)st.st_mtime && entries[i].cluster == (u32)st.st_ino;
+}
+
+bool manifestChecksum(const char *path, u32 *size, u32 *checksum) {
+	struct stat st;
+	if(stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+		return false;
+	*size = st.st_size;
+
+	load();
+	u32 hash = pathHash(path);
+	int i = find(hash);
+	if(known(i, st)) {
+		*checksum = entries[i].checksum;
+		manifestStats.hits++;
+		return true;
+	}
+	manifestStats.reads++;
+
+	FILE *fh = fopen(path, "rb");
+	if(!fh)
+		return false;
+	u32 sum = ADLER_INIT;
+	size_t read;
+	while((read = fread(in, 1, CHUNK_SIZE, fh)) > 0)
+		sum = adlerUpdate(sum, in, read);
+	bool ok = !ferror(fh);
+	fclose(fh);
+	if(!ok)
+		return false;
+
+	add(hash, st, sum);
+	dirty = true;
+	*checksum = sum;
+	return true;
+}
+
+bool manifestKnown(const char *path, u32 *size, u32 *checksum) {
+	struct stat st;
+	if(stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+		return false;
+	load();
+	int i = find(pathHash(path));
+	if(!known(i, st))
+		return false;
+	*size = st.st_size;
+	*checksum = entries[i].checksum;
+	manifestStats.hits++;
+	return true;
+}
+
+void manifestRecord(const char *path, u32 checksum) {
+	struct stat st;
+	load();
+	if(stat(path, &st) == 0)
+		add(pathHash(path), st, checksum);
+	save();
+}
+
+void manifestForget(const char *path) {
+	load();
+	int i = find(pathHash(path));
+	if(i < 0)
+		return;
+	drop(i);
+	save();
+}
+
+void manifestFlush(void) {
+	if(dirty)
+		save();
+}
+
+void manifestIdleStart(void) {
+	manifestIdleStop();
+	sniprintf(idle.path, sizeof(idle.path), "%s/nds", storageRoot());
+	idle.dirs[0] = opendir(idle.path);
+	if(!idle.dirs[0])
+		return;
+	idle.lens[0] = strlen(idle.path);
+	idle.depth = 1;
+	idle.active = true;
+}
+
+void manifestIdleStop(void) {
+	if(idle.fh)
+		fclose(idle.fh);
+	idle.fh = NULL;
+	while(idle.depth)
+		closedir(idle.dirs[--idle.depth]);
+	idle.active = false;
+}
+
+// Looks at one more directory entry and opens it if it is a file that needs
+// hashing. False once the walk is over.
+static bool idleAdvance(void) {
+	if(!idle.depth)
+		return false;
+	DIR *dir = idle.dirs[idle.depth - 1];
+	int len = idle.lens[idle.depth - 1];
+	struct dirent *ent = readdir(dir);
+	if(!ent) {
+		closedir(dir);
+		idle.depth--;
+		return idle.depth > 0;
+	}
+	if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0 || len + 1 + strlen(ent->d_name) >= sizeof(idle.path))
+		return true;
+	sniprintf(idle.path + len, sizeof(idle.path) - len, "/%s", ent->d_name);
+
+	struct stat st;
+	if(stat(idle.path, &st) != 0)
+		return true;
+	if(S_ISDIR(st.st_mode)) {
+		if(idle.depth < IDLE_DEPTH && (dir = opendir(idle.path)) != NULL) {
+			idle.dirs[idle.depth] = dir;
+			idle.lens[idle.depth] = strlen(idle.path);
+			idle.depth++;
+		}
+	} else if(S_ISREG(st.st_mode) && !known(find(pathHash(idle.path)), st)) {
+		idle.fh = fopen(idle.path, "rb");
+		idle.st = st;
+		idle.sum = ADLER_INIT;
+	}
+	return true;
+}
+
+bool manifestIdleStep(u32 budgetMs) {
+	if(!idle.active)
+		return false;
+	load();
+	u64 start = clockTicks(), until = start + msToTicks(budgetMs);
+	do {
+		if(!idle.fh) {
+			if(!idleAdvance()) {
+				idle.active = false;
+				manifestFlush();
+				idle.unsaved = 0;
+				break;
+			}
+			continue;
+		}
+
+		size_t read = fread(in, 1, CHUNK_SIZE, idle.fh);
+		if(read > 0) {
+			idle.sum = adlerUpdate(idle.sum, in, read);
+			manifestStats.idleBytes += read;
+			continue;
+		}
+		bool ok = !ferror(idle.fh);
+		fclose(idle.fh);
+		idle.fh = NULL;
+		if(ok) {
+			add(pathHash(idle.path), idle.st, idle.sum);
+			dirty = true;
+			manifestStats.idleFiles++;
+			if(++idle.unsaved >= IDLE_FLUSH_FILES) {
+				manifestFlush();
+				idle.unsaved = 0;
+			}
+		}
+	} while(clockTicks() < until);
+	manifestStats.idleTicks += clockTicks() - start;
+	return idle.active;
+}
@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include "platform.h"
+
+// Checksums of files on the card, kept in dslink.manifest at the root so a
+// delta base doesn't have to be read in full just to be checked. An entry
+// only counts while the file's size, mtime and first cluster are what they
+// were when it was recorded. Anything else, or a manifest that is missing or
+// torn, means reading the file again.
+#define MANIFEST_MAX_ENTRIES 1024
+
+// Adler32 of the whole file at path, false if it isn't a regular file. What
+// had to be read is remembered until manifestFlush().
+bool manifestChecksum(const char *path, u32 *size, u32 *checksum);
+
+// The same, but false rather than reading the file if it isn't known
+bool manifestKnown(const char *path, u32 *size, u32 *checksum);
+
+// The file at path was just written with this checksum, or is about to be
+// written. Both go to the card straight away.
+void manifestRecord(const char *path, u32 checksum);
+void manifestForget(const char *path);
+
+// Writes out what manifestChecksum() learned
+void manifestFlush(void);
+
+// Hashing in idle time: a walk of /nds that reads the files the manifest
+// doesn't know a slice at a time, so a delta base is usually known before
+// the host asks. Steps run for about budgetMs and return false once the walk
+// is over. Stop before anything on the card changes.
+#define MANIFEST_IDLE_SLICE_MS 4 // a quarter of a frame
+
+void manifestIdleStart(void);
+bool manifestIdleStep(u32 budgetMs);
+void manifestIdleStop(void);
+
+struct ManifestStats {
+	u32 hits;        // checksums answered without reading the file
+	u32 reads;       // files read in full to answer
+	u32 idleFiles;   // hashed in idle time
+	size_t idleBytes;
+	u64 idleTicks;
+};
+
+extern ManifestStats manifestStats;
+
+#endif // MANIFEST_H
@@ -0,0 +1,132 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#include "netio.h"
+#include "clock.h"
+#include "task.h"
+#include "trace.h"
+
+#include <string.h>
+
+NetStats netStats;
+
+static volatile bool cancelled;
+static u64 requestTicks;
+
+void netStatsReset(void) {
+	memset(&netStats, 0, sizeof(netStats));
+	netStats.startTicks = clockTicks();
+}
+
+void netCancel(void) {
+	cancelled = true;
+}
+
+void netCancelClear(void) {
+	cancelled = false;
+}
+
+bool netCancelled(void) {
+	return cancelled;
+}
+
+void netMarkRequest(void) {
+	requestTicks = clockTicks();
+}
+
+// A replay has one connection, readable when the trace says so and always
+// writable
+static int waitReplay(bool write, u64 deadline) {
+	u64 arrival = write ? 0 : traceNextArrival();
+	if(!arrival)
+		return 0;
+	if(deadline && deadline < arrival)
+		arrival = deadline;
+	return taskPoll(NULL, 0, false, arrival) == NET_ERROR ? NET_ERROR : NET_TIMEOUT;
+}
+
+// The other tasks run while this one waits
+static int waitSockets(const int *socks, int count, bool write, u64 deadline) {
+	while(true) {
+		if(cancelled || taskCancelled())
+			return NET_CANCELLED;
+		if(deadline && clockTicks() >= deadline)
+			return NET_TIMEOUT;
+		int ready = traceReplaying() ? waitReplay(write, deadline) : taskPoll(socks, count, write, deadline);
+		if(ready != NET_TIMEOUT)
+			return ready;
+	}
+}
+
+int netWaitReadable(const int *socks, int count, u64 deadline) {
+	return waitSockets(socks, count, false, deadline);
+}
+
+int netWaitWritable(int sock, u64 deadline) {
+	return waitSockets(&sock, 1, true, deadline);
+}
+
+int netRecv(int sock, void *buffer, int size, int flags) {
+	if(traceReplaying())
+		return traceRecv(buffer, size, flags);
+	int len = recv(sock, buffer, size, flags);
+	if(len >= 0 && traceRecording() && !(flags & MSG_PEEK))
+		traceRecord(buffer, len);
+	return len;
+}
+
+int netRecvAll(int sock, void *buffer, int size, u32 timeoutMs) {
+	u8 *ptr = (u8 *)buffer;
+	int sizeleft = size;
+	u64 deadline = clockTicks() + msToTicks(timeoutMs);
+
+	while(sizeleft) {
+		int len = netRecv(sock, ptr, sizeleft);
+		if(len == 0) {
+			return 0;
+		} else if(len < 0) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK) {
+				iprintf("recv %d\n", errno);
+				return NET_ERROR;
+			}
+			int ret = netWaitReadable(&sock, 1, deadline);
+			if(ret < 0)
+				return ret;
+		} else {
+			if(requestTicks) {
+				netStats.rttTicks += clockTicks() - requestTicks;
+				netStats.rtts++;
+				requestTicks = 0;
+			}
+			sizeleft -= len;
+			ptr += len;
+		}
+	}
+	return size;
+}
+
+int netSendAll(int sock, const void *buffer, int size, u32 timeoutMs) {
+	const u8 *ptr = (const u8 *)buffer;
+	int sizeleft = size;
+	u64 deadline = clockTicks() + msToTicks(timeoutMs);
+	if(traceReplaying())
+		return size;
+
+	while(sizeleft) {
+		int len = send(sock, ptr, sizeleft, 0);
+		if(len < 0) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK) {
+				iprintf("send %d\n", errno);
+				return NET_ERROR;
+			}
+			int ret = netWaitWritable(sock, deadline);
+			if(ret < 0)
+				return ret;
+		} else {
+			sizeleft -= len;
+			ptr += len;
+		}
+	}
+	return size;
+}
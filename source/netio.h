@@ -0,0 +1,59 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#ifndef NETIO_H
+#define NETIO_H
+
+#include "platform.h"
+
+// Results of the blocking helpers, a positive value is a byte count
+#define NET_OK         0
+#define NET_ERROR     -1
+#define NET_TIMEOUT   -2
+#define NET_CANCELLED -3
+
+// Default deadlines for a single operation
+#define NET_RECV_TIMEOUT_MS  15000
+#define NET_SEND_TIMEOUT_MS  15000
+
+struct NetStats {
+	u64 startTicks;  // when the stats were last reset
+	u64 waitTicks;   // time spent asleep in select()
+	u32 waits;       // number of select() calls
+	u32 yields;      // number of frames the tasks were paced to
+	u64 pingTicks;   // first discovery ping seen, 0 if none
+	u64 acceptTicks; // TCP connection accepted
+	u64 rttTicks;    // sum of request -> first response byte times
+	u32 rtts;        // number of round trips in rttTicks
+};
+
+extern NetStats netStats;
+
+void netStatsReset(void);
+
+// Cancels every task until netCancelClear(), from a signal handler or when
+// the system wants the program to exit
+void netCancel(void);
+void netCancelClear(void);
+bool netCancelled(void);
+
+// Sleeps until one of socks is readable or the deadline (in clock ticks, 0 for
+// none) passes, running the other tasks (task.h) meanwhile. Returns the index
+// of the ready socket or a negative NET_ result, NET_CANCELLED once the task
+// running it is cancelled.
+int netWaitReadable(const int *socks, int count, u64 deadline);
+int netWaitWritable(int sock, u64 deadline);
+
+// recv() on a transfer connection, recorded or replayed when tracing (trace.h)
+int netRecv(int sock, void *buffer, int size, int flags = 0);
+
+// Receives exactly size bytes. Returns size, 0 if the peer closed the
+// connection, or a negative NET_ result.
+int netRecvAll(int sock, void *buffer, int size, u32 timeoutMs = NET_RECV_TIMEOUT_MS);
+int netSendAll(int sock, const void *buffer, int size, u32 timeoutMs = NET_SEND_TIMEOUT_MS);
+
+// Marks the start of a round trip, the next netRecvAll() that sees data ends it
+void netMarkRequest(void);
+
+#endif // NETIO_H
@@ -0,0 +1,350 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#include "pipeline.h"
+#include "adler.h"
+#include "clock.h"
+#include "netio.h"
+#include "protocol.h"
+
+#include <string.h>
+#include <zlib.h>
+
+static_assert(RX_SLOTS >= CHECKED_WINDOW,
+	"checked mode needs a receive slot for every chunk the host may send ahead");
+
+PipelineStats pipelineStats;
+
+bool Pipeline::begin(int sock, FILE *fh, u32 flags) {
+	this->sock = sock;
+	this->fh = fh;
+	this->flags = flags;
+	terminated = flags & PIPE_TERMINATED;
+	checked = flags & PIPE_CHECKED;
+	eof = false;
+	ended = false;
+	rxHead = rxReady = 0;
+	rxHeadSeq = 0;
+	rxHdrGot = rxFilled = 0;
+	rxTarget = NULL;
+	rxConsumed = 0;
+	for(int i = 0; i < RX_SLOTS; i++)
+		rx[i].valid = false;
+	outHead = outQueued = 0;
+	outFill = 0;
+	resume = NULL;
+	written = 0;
+
+	memset(&pipelineStats, 0, sizeof(pipelineStats));
+	pipelineStats.startTicks = clockTicks();
+	return true;
+}
+
+void Pipeline::setResume(ResumeRecord *rec) {
+	resume = rec;
+	resumeEvery = resumeInterval(rec->filelen);
+	written = rec->offset;
+}
+
+bool Pipeline::writeOut(const u8 *data, size_t size) {
+	u64 start = clockTicks();
+	size_t ret = fwrite(data, 1, size, fh);
+	pipelineStats.writeTicks += clockTicks() - start;
+	pipelineStats.writes++;
+	if(ret != size || ferror(fh)) {
+		iprintf("fwrite\n");
+		return false;
+	}
+
+	if(resume) {
+		start = clockTicks();
+		resume->checksum = adlerUpdate(resume->checksum, data, size);
+		written += size;
+		if(written - resume->offset >= resumeEvery) {
+			// Only record what is really on the card
+			fileCommit(fh);
+			resume->offset = written;
+			resumeSave(resume);
+		}
+		pipelineStats.resumeTicks += clockTicks() - start;
+	}
+	return true;
+}
+
+Pipeline::RxSlot *Pipeline::slotFor(void) {
+	if(!checked)
+		return &rx[(rxHead + rxReady) % RX_SLOTS];
+
+	// Resends put a chunk ahead of ones we still need, the window keeps it
+	// within the ring. Stale duplicates wrap around to a huge distance.
+	u32 ahead = rxHdr[1] - rxHeadSeq;
+	if(ahead >= RX_SLOTS)
+		return NULL;
+	RxSlot *slot = &rx[(rxHead + ahead) % RX_SLOTS];
+	return slot->valid ? NULL : slot;
+}
+
+void Pipeline::chunkDone(void) {
+	u32 size = rxHdr[0];
+
+	if(!checked) {
+		rxReady++;
+	} else if(rxTarget && crc32(0, rxTarget->data, size) == rxHdr[2]) {
+		rxTarget->valid = true;
+		while(rxReady < RX_SLOTS && rx[(rxHead + rxReady) % RX_SLOTS].valid)
+			rxReady++;
+	} else if(rxTarget) {
+		// Only this one is resent, the decoder state is untouched
+		pipelineStats.badChunks++;
+		pipelineStats.nacks++;
+		pipelineStats.retransmitBytes += size;
+		u32 nack[2] = {NACK_MAGIC, rxHdr[1]};
+		netSendAll(sock, nack, sizeof(nack));
+	}
+
+	rxHdrGot = rxFilled = 0;
+	rxTarget = NULL;
+}
+
+int Pipeline::pump(void) {
+	static u8 discard[512];
+	const u32 hdrSize = checked ? 12 : 4;
+
+	while(!eof && !ended) {
+		if(rxHdrGot == 0 && rxReady == RX_SLOTS) {
+			// Only count it if the network actually had more for us
+			u8 peek;
+			if(netRecv(sock, &peek, 1, MSG_PEEK) > 0)
+				pipelineStats.ringFull++;
+			return NET_OK;
+		}
+
+		u8 *dst;
+		u32 want;
+		if(rxHdrGot < hdrSize) {
+			dst = (u8 *)rxHdr + rxHdrGot;
+			want = hdrSize - rxHdrGot;
+		} else if(rxTarget) {
+			dst = rxTarget->data + rxFilled;
+			want = rxHdr[0] - rxFilled;
+		} else {
+			dst = discard;
+			want = rxHdr[0] - rxFilled;
+			if(want > sizeof(discard))
+				want = sizeof(discard);
+		}
+
+		if(want) {
+			u64 start = clockTicks();
+			int len = netRecv(sock, dst, want);
+			pipelineStats.recvTicks += clockTicks() - start;
+			if(len == 0) {
+				eof = true;
+				break;
+			} else if(len < 0) {
+				if(errno != EAGAIN && errno != EWOULDBLOCK) {
+					iprintf("recv %d\n", errno);
+					return NET_ERROR;
+				}
+				break;
+			}
+
+			pipelineStats.bytesIn += len;
+			if(rxHdrGot < hdrSize) {
+				rxHdrGot += len;
+				if(rxHdrGot < hdrSize)
+					continue;
+				u32 chunkFlags = rxHdr[0] & CHUNK_FLAGS;
+				rxHdr[0] &= ~CHUNK_FLAGS;
+				if(chunkFlags && !(flags & PIPE_STORED)) {
+					iprintf("chunk flags %x\n", (unsigned)chunkFlags);
+					return NET_ERROR;
+				}
+				if(rxHdr[0] > CHUNK_SIZE) {
+					iprintf("chunksize %u\n", (unsigned)rxHdr[0]);
+					return NET_ERROR;
+				}
+				if(rxHdr[0] == 0 && terminated) {
+					ended = true;
+					rxHdrGot = 0;
+					continue;
+				}
+				rxTarget = slotFor();
+				if(checked && !rxTarget && rxHdr[1] - rxHeadSeq >= RX_SLOTS && rxHdr[1] - rxHeadSeq < 0x80000000u) {
+					iprintf("chunk %u past the window\n", (unsigned)rxHdr[1]);
+					return NET_ERROR;
+				}
+				if(rxTarget) {
+					rxTarget->size = rxHdr[0];
+					rxTarget->flags = chunkFlags;
+				}
+			} else {
+				rxFilled += len;
+			}
+		}
+
+		if(rxFilled == rxHdr[0])
+			chunkDone();
+	}
+
+	return NET_OK;
+}
+
+const u8 *Pipeline::nextData(u32 *size, bool whole) {
+	u64 deadline = clockTicks() + msToTicks(NET_RECV_TIMEOUT_MS);
+
+	while(true) {
+		size_t before = pipelineStats.bytesIn;
+		if(pump() < 0)
+			return NULL;
+
+		// Drop the front slot once it has arrived in full and been consumed
+		if(rxReady && rxConsumed == rx[rxHead].size) {
+			rx[rxHead].valid = false;
+			rxHead = (rxHead + 1) % RX_SLOTS;
+			rxHeadSeq++;
+			rxReady--;
+			rxConsumed = 0;
+			if(checked) {
+				u32 ack[2] = {ACK_MAGIC, rxHeadSeq};
+				if(netSendAll(sock, ack, sizeof(ack)) < 0)
+					return NULL;
+			}
+			continue;
+		}
+
+		u32 avail = 0;
+		if(rxReady)
+			avail = rx[rxHead].size - rxConsumed;
+		else if(!checked && !whole && rxHdrGot == 4)
+			avail = rxFilled - rxConsumed;
+		if(avail) {
+			*size = avail;
+			return rx[rxHead].data + rxConsumed;
+		}
+
+		if(ended)
+			return NULL;
+		if(eof) {
+			iprintf("closed\n");
+			return NULL;
+		}
+		if(pipelineStats.bytesIn != before)
+			deadline = clockTicks() + msToTicks(NET_RECV_TIMEOUT_MS);
+
+		// Waiting on the network anyway, use the time to write to SD
+		if(outQueued) {
+			if(flushOne(OUT_SLOTS) < 0)
+				return NULL;
+			continue;
+		}
+
+		u64 start = clockTicks();
+		int ret = netWaitReadable(&sock, 1, deadline);
+		pipelineStats.netStalls++;
+		pipelineStats.netStallTicks += clockTicks() - start;
+		if(ret < 0)
+			return NULL;
+	}
+}
+
+void Pipeline::consume(u32 size) {
+	rxConsumed += size;
+}
+
+int Pipeline::flushOne(int limit) {
+	// Write as many queued slots as are contiguous in memory in one go
+	int count = outQueued < limit ? outQueued : limit;
+	if(outHead + count > OUT_SLOTS)
+		count = OUT_SLOTS - outHead;
+	size_t size = count * OUT_SLOT_SIZE;
+
+	if(pump() < 0)
+		return NET_ERROR;
+
+	if(!writeOut(out[outHead], size))
+		return NET_ERROR;
+
+	outHead = (outHead + count) % OUT_SLOTS;
+	outQueued -= count;
+	return pump();
+}
+
+u8 *Pipeline::outBuffer(u32 *avail) {
+	if(outFill == OUT_SLOT_SIZE) {
+		outQueued++;
+		outFill = 0;
+	}
+
+	if(outQueued == OUT_SLOTS) {
+		u64 start = clockTicks();
+		pipelineStats.writeStalls++;
+		int ret = flushOne(OUT_SLOTS);
+		pipelineStats.writeStallTicks += clockTicks() - start;
+		if(ret < 0)
+			return NULL;
+	}
+
+	*avail = OUT_SLOT_SIZE - outFill;
+	return out[(outHead + outQueued) % OUT_SLOTS] + outFill;
+}
+
+void Pipeline::commitOutput(u32 size) {
+	if(size && !pipelineStats.firstOutTicks)
+		pipelineStats.firstOutTicks = clockTicks();
+	outFill += size;
+	pipelineStats.bytesOut += size;
+}
+
+int Pipeline::write(const void *data, u32 size) {
+	const u8 *ptr = (const u8 *)data;
+	while(size) {
+		u32 avail;
+		u8 *dst = outBuffer(&avail);
+		if(!dst)
+			return NET_ERROR;
+		if(avail > size)
+			avail = size;
+		memcpy(dst, ptr, avail);
+		commitOutput(avail);
+		ptr += avail;
+		size -= avail;
+	}
+	if(pump() < 0)
+		return NET_ERROR;
+	return NET_OK;
+}
+
+bool Pipeline::finish(void) {
+	if(outFill) {
+		outQueued++;
+		// The last slot is partial, write it on its own
+		while(outQueued > 1) {
+			if(flushOne(outQueued - 1) < 0)
+				return false;
+		}
+		if(!writeOut(out[outHead], outFill))
+			return false;
+		outHead = (outHead + 1) % OUT_SLOTS;
+		outQueued = 0;
+		outFill = 0;
+	}
+
+	while(outQueued) {
+		if(flushOne(OUT_SLOTS) < 0)
+			return false;
+	}
+
+	pipelineStats.endTicks = clockTicks();
+	return true;
+}
+
+bool Pipeline::skipToEnd(void) {
+	u32 size;
+	if(nextData(&size)) {
+		iprintf("trailing data\n");
+		return false;
+	}
+	return ended;
+}
@@ -0,0 +1,137 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "platform.h"
+#include "resume.h"
+
+#include <stdio.h>
+
+#define CHUNK_SIZE (16 * 1024)
+
+#define RX_SLOTS 4
+#define OUT_SLOTS 4
+#define OUT_SLOT_SIZE (16 * 1024)
+
+// Pipeline::begin() flags
+#define PIPE_TERMINATED 1 // payload ends with an empty chunk
+#define PIPE_CHECKED    2 // chunks carry a sequence number and CRC32
+#define PIPE_STORED     4 // chunks may be CHUNK_STORED
+
+struct PipelineStats {
+	u64 startTicks, endTicks;
+	u64 firstOutTicks;   // first decoded byte handed to the write ring
+	u32 netStalls;       // decoder had nothing to do and nothing to write
+	u64 netStallTicks;
+	u32 ringFull;        // receive ring was full when data was waiting
+	u32 writeStalls;     // decoder had to wait for SD because the output ring was full
+	u64 writeStallTicks;
+	u64 writeTicks;      // total time in fwrite
+	u32 writes;
+	u64 recvTicks;       // copying out of the network stack
+	u64 resumeTicks;     // checksumming the output and saving the resume record
+	u64 decodeTicks;     // in inflate, xdelta or LZ4 themselves
+	u64 sourceTicks;     // reading delta source blocks
+	u32 sourceReads;     // xdelta source block misses, signature block copies
+	size_t sourceBytes;
+	size_t bytesIn, bytesOut;
+	size_t storedBytes;  // sent as CHUNK_STORED and copied without inflate
+	u32 badChunks;       // failed their CRC
+	u32 nacks;
+	size_t retransmitBytes; // payload bytes thrown away and asked for again
+};
+
+extern PipelineStats pipelineStats;
+
+// Cooperative transfer engine. Length-prefixed chunks are read from the socket
+// into a ring of receive slots whenever the decoder yields, and decoded output
+// is queued in a ring of write slots that get flushed to SD while the decoder
+// waits for the network. This keeps the TCP window open during inflate and
+// fwrite instead of alternating between them.
+class Pipeline {
+	struct RxSlot {
+		u32 size;
+		u32 flags;  // CHUNK_ flags from the size field
+		bool valid; // checked mode: arrived intact, possibly ahead of the head
+		u8 data[CHUNK_SIZE];
+	};
+
+	int sock;
+	FILE *fh;
+	bool eof;
+	u32 flags;
+	bool terminated, checked, ended;
+
+	RxSlot rx[RX_SLOTS];
+	int rxHead, rxReady;
+	u32 rxHeadSeq;  // sequence number of the head slot
+	u32 rxHdr[3];   // size, and in checked mode seq and crc
+	u32 rxHdrGot, rxFilled;
+	RxSlot *rxTarget; // where the incoming payload goes, NULL to drop it
+	u32 rxConsumed; // of the front slot, which may still be filling
+
+	u8 out[OUT_SLOTS][OUT_SLOT_SIZE];
+	int outHead, outQueued;
+	u32 outFill;
+
+	ResumeRecord *resume;
+	u32 resumeEvery;
+	u32 written;
+
+	int flushOne(int limit);
+	bool writeOut(const u8 *data, size_t size);
+	RxSlot *slotFor(void);
+	void chunkDone(void);
+
+public:
+	// With PIPE_TERMINATED nothing past the closing empty chunk is read from
+	// the socket, so the caller can take over again. With PIPE_CHECKED a chunk
+	// is only handed on once its CRC matches, bad ones are NACKed and good
+	// ones that arrive while waiting for the resend are kept in the ring. The
+	// host is ACKed as each slot frees up, which keeps it within the ring.
+	bool begin(int sock, FILE *fh, u32 flags = 0);
+
+	// Keeps rec up to date with the output that has reached the card. The
+	// file must already be positioned at rec->offset.
+	void setResume(ResumeRecord *rec);
+
+	// Reads whatever the socket has into free receive slots without blocking.
+	// Returns a negative NET_ result on error.
+	int pump(void);
+
+	// Blocks until at least one byte of the next chunk has arrived and returns
+	// everything received of it so far, NULL on error or early close. Decoders
+	// see data as TCP segments arrive rather than a whole chunk at a time,
+	// except in checked mode where a chunk must be whole to be verified, or
+	// when asked for the whole chunk because it is a block of its own.
+	const u8 *nextData(u32 *size, bool whole = false);
+	void consume(u32 size);
+
+	// CHUNK_ flags of the chunk nextData() last returned data from
+	u32 chunkFlags(void) const { return rx[rxHead].flags; }
+
+	// PIPE_ flags given to begin()
+	u32 beginFlags(void) const { return flags; }
+
+	// The write slots are contiguous, so decoders can use the output they
+	// have already written as history. Only the slot returned by outBuffer()
+	// changes until it is committed.
+	u8 *outRing(void) { return out[0]; }
+
+	// Space left in the current write slot, blocks on SD if the ring is full
+	u8 *outBuffer(u32 *avail);
+	void commitOutput(u32 size);
+	int write(const void *data, u32 size);
+
+	// Writes all queued output, returns false on SD errors
+	bool finish(void);
+
+	// Consumes the empty chunk ending a terminated payload, false if the
+	// decoder finished before all of the payload was used
+	bool skipToEnd(void);
+};
+
+#endif // PIPELINE_H
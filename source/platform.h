@@ -0,0 +1,127 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#ifndef PLATFORM_H
+#define PLATFORM_H
+
+// The link code is built for the DS (ARM9 defined by the Makefile) and as a
+// plain POSIX program for measuring it over loopback. Everything that differs
+// between the two lives here so link.cpp and friends stay free of #ifdefs.
+
+#include "protocol.h"
+
+#ifdef ARM9
+
+#include <nds.h>
+#include <dswifi9.h>
+#include <sys/errno.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+// Root of the storage device, prepended to "/nds/..."
+static inline const char *storageRoot(void) { return isDSiMode() ? "sd:" : "fat:"; }
+
+// Free heap plus what the heap can still grow into
+static inline u32 freeMemory(void) {
+	return mallinfo().fordblks + (getHeapLimit() - getHeapEnd());
+}
+
+// Free space on the card in KiB
+static inline u32 freeStorage(void) {
+	struct statvfs st;
+	if(statvfs(isDSiMode() ? "sd:/" : "fat:/", &st) != 0)
+		return BEACON_FREE_UNKNOWN;
+	return (u64)st.f_bfree * st.f_bsize / 1024;
+}
+
+static inline u8 consoleType(void) { return isDSiMode() ? CONSOLE_DSI : CONSOLE_DS; }
+
+// Hosts listen for the discovery reply on the link port
+#define DISCOVERY_REPLY_TO_SENDER 0
+
+// Decoder inner loops: ARM code in ITCM, away from the thumb build and the
+// small instruction cache
+#define HOT_CODE ITCM_CODE __attribute__((target("arm")))
+
+// Gets what was written to fh onto the card, libfat keeps it in its sector
+// cache until the file is closed otherwise
+static inline void fileCommit(FILE *fh) {
+	fflush(fh);
+	fsync(fileno(fh));
+}
+
+#else
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef int64_t s64;
+
+#define iprintf printf
+#define sniprintf snprintf
+#define closesocket close
+
+static inline bool isDSiMode(void) { return false; }
+static inline bool pmMainLoop(void) { return true; }
+static inline void swiWaitForVBlank(void) { usleep(1000000 / 60); }
+
+// The page cache outlives the process, which is all a test needs
+static inline void fileCommit(FILE *fh) { fflush(fh); }
+
+static inline const char *storageRoot(void) { return "."; }
+
+static inline u32 freeMemory(void) {
+	u64 avail = (u64)sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+	return avail > 0xFFFFFFFF ? 0xFFFFFFFF : avail;
+}
+
+static inline u32 freeStorage(void) {
+	struct statvfs st;
+	if(statvfs(".", &st) != 0)
+		return BEACON_FREE_UNKNOWN;
+	u64 kib = (u64)st.f_bavail * st.f_frsize / 1024;
+	return kib >= BEACON_FREE_UNKNOWN ? BEACON_FREE_UNKNOWN - 1 : kib;
+}
+
+static inline u8 consoleType(void) { return CONSOLE_POSIX; }
+
+// Over loopback the client already owns the link port, so reply to wherever
+// the ping came from instead
+#define DISCOVERY_REPLY_TO_SENDER 1
+
+#define HOT_CODE
+
+#endif
+
+// dslink's own files, at the root of the card beside dslink.cache. Kept out
+// of /nds, where the idle walk would hash them and the beacon and sync
+// manifests would list them.
+static inline void dataPath(char *path, int size, const char *name) {
+	sniprintf(path, size, "%s/%s", storageRoot(), name);
+}
+
+#endif // PLATFORM_H
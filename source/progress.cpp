@@ -0,0 +1,87 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#include "progress.h"
+#include "transfer.h"
+
+#ifdef ARM9
+
+#include "iconTitle.h"
+
+#define PROGRESS_EVERY   6  // frames between redraws
+#define PROGRESS_SAMPLES 16 // redraws the rate is taken over
+#define FRAMES_PER_SEC   60
+
+static volatile bool active;
+static size_t goal;
+static size_t samples[PROGRESS_SAMPLES];
+static u32 frames, taken;
+// done >> shift times scale, shifted down by 15, is done / goal as 16.16.
+// Worked out once so the interrupt only multiplies.
+static u32 shift, scale;
+
+static u32 fraction(size_t done) {
+	if(!goal)
+		return PROGRESS_NONE;
+	if(done >= goal)
+		return PROGRESS_ONE;
+	return ((done >> shift) * scale) >> 15;
+}
+
+// Counts frames rather than reading the clock, which isn't safe to use from
+// an interrupt. Keeps to 32-bit math, a 64-bit divide is a slow library call.
+static void progressVBlank(void) {
+	if(!active || ++frames % PROGRESS_EVERY)
+		return;
+	size_t done = filetotal;
+	samples[taken % PROGRESS_SAMPLES] = done;
+	taken++;
+
+	u32 span = taken < PROGRESS_SAMPLES ? taken - 1 : PROGRESS_SAMPLES - 1;
+	size_t first = samples[(taken - 1 - span) % PROGRESS_SAMPLES];
+	u32 rate = span ? (done - first) / (span * PROGRESS_EVERY) * FRAMES_PER_SEC : 0;
+	u32 eta = rate && done < goal ? (goal - done) / rate : 0;
+	iconTitleProgress(fraction(done), rate, eta);
+}
+
+void progressBegin(size_t total) {
+	static bool installed;
+	active = false;
+	goal = total;
+	// Down to 16 bits so the product fits
+	for(shift = 0; (total >> shift) > 0xFFFF; shift++)
+		;
+	scale = total ? (1u << 31) / (total >> shift) : 0;
+	filetotal = 0;
+	frames = taken = 0;
+	if(!installed) {
+		// Replaces any handler, the link owns VBlank (progress.h)
+		irqSet(IRQ_VBLANK, progressVBlank);
+		irqEnable(IRQ_VBLANK);
+		installed = true;
+	}
+	iconTitleProgress(fraction(0), 0, 0);
+	active = true;
+}
+
+void progressEnd(bool done) {
+	active = false;
+	iconTitleProgress(fraction(filetotal), 0, 0);
+	if(done)
+		iprintf("Done!                           ");
+}
+
+#else
+
+// Nothing to draw on, the POSIX client prints its stats at the end instead
+void progressBegin(size_t) {
+	filetotal = 0;
+}
+
+void progressEnd(bool done) {
+	if(done)
+		iprintf("Done!                           ");
+}
+
+#endif
@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include "platform.h"
+
+#include <stddef.h>
+
+// Transfer progress is drawn from the VBlank interrupt, the receive loops only
+// store how far they got in filetotal (transfer.h). Between begin and end the
+// bar, rate and time left are redrawn a few times a second. End prints Done!
+// when the payload came through, outside the decode the stats time. The first
+// begin takes the VBlank handler for good, nothing else in the client sets one.
+void progressBegin(size_t total);
+void progressEnd(bool done);
+
+#endif // PROGRESS_H
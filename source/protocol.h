@@ -0,0 +1,219 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+// Wire constants shared by the client and the host tool. All integers are
+// little endian.
+
+#define RECV_MAGIC_3DS "3dsboot"
+#define SEND_MAGIC_3DS "boot3ds"
+#define RECV_MAGIC_DELTA "dslink-delta-host"
+#define SEND_MAGIC_DELTA "dslink-delta-client"
+#define PORT 17491
+
+// Protocol v2. A host pings with RECV_MAGIC_DELTA followed by u8 version,
+// which older clients ignore as they only compare the magic, and optionally
+// u8 namelen and the name under /nds of the file it is about to send. A v2
+// client answers with SEND_MAGIC_DELTA followed by its hello, so the host
+// learns what it may send without another round trip:
+//   u8 version, u8 flags (HELLO_), u16 codecs (1 << MODE_), u32 max chunk
+//   size, u32 free RAM, u32 xdelta source cache, u32 xdelta window, u8
+//   secondary compressors (HELLO_SEC_), then the interrupted transfer this
+//   client can resume: u8 mode, u32 filelen, u32 base adler32, u32 offset,
+//   u32 adler32 of the first offset bytes, u8 namelen, name under /nds
+//   (namelen 0 for none).
+// Clients with HELLO_BEACON go on with what they hold, so the host can pick
+// the mode and delta base before it connects:
+//   u8 console (CONSOLE_), u32 free storage in KiB (BEACON_FREE_UNKNOWN if
+//   it can't tell), the file named in the ping: u8 state (BEACON_FILE_), u32
+//   size, u32 adler32, then u16 files under /nds, u16 count and count pairs
+//   of u32 crc32 of the path relative to /nds and u32 size. At most
+//   BEACON_MAX_FILES are listed.
+// Clients with HELLO_CACHE end it with the builds they keep (cache.h): u8
+// count and count pairs of u32 size and u32 adler32, at most
+// BEACON_MAX_CACHED.
+// The request is then sent in one go with no acknowledgement before the
+// payload:
+//   u8 mode, u32 namelen, name, u32 filelen, u32 base adler32 (0 for zlib),
+//   u32 start (resume offset from the hello, or 0), u32 cmdlen, cmdline,
+//   payload chunks
+// and the client sends a single s32 response once the file is written. If
+// the delta base turns out to be missing or different the client answers
+// straight away and closes, the host reconnects and sends zlib instead.
+// MODE_SYNC requests are u8 mode, u32 cmdlen, cmdline and then the sync
+// exchange below, without the trailing cmdline.
+#define PROTOCOL_V1 1
+#define PROTOCOL_V2 2
+
+#define HELLO_RESUME  0x01
+#define HELLO_CHECKED 0x02
+#define HELLO_STORED  0x04
+#define HELLO_FLEET   0x08
+#define HELLO_BEACON  0x10
+#define HELLO_STATS   0x20
+#define HELLO_CACHE   0x40
+
+#define CONSOLE_DS    0
+#define CONSOLE_DSI   1
+#define CONSOLE_POSIX 2
+
+#define BEACON_FILE_UNASKED 0
+#define BEACON_FILE_MISSING 1
+#define BEACON_FILE_PRESENT 2
+#define BEACON_FREE_UNKNOWN 0xFFFFFFFF
+#define BEACON_MAX_FILES 128 // keeps the hello in one unfragmented datagram
+#define BEACON_MAX_CACHED 8  // so do these
+
+#define HELLO_SEC_DJW  0x01
+#define HELLO_SEC_FGK  0x02
+#define HELLO_SEC_LZMA 0x04
+
+// First byte from a dslink-delta host
+#define MODE_ZLIB  0
+#define MODE_DELTA 1
+#define MODE_LEGACY 2 // accepted by older clients, behaves like MODE_DELTA
+#define MODE_SYNC  3
+#define MODE_LZ4   4
+#define MODE_FLEET 5
+#define MODE_SIGNATURE 6
+#define MODE_CACHED 7
+#define MODE_MASK  0x0F
+
+// MODE_LZ4 payload chunks each hold one independent LZ4 block (lz4.h), which
+// expands to LZ4_BLOCK_SIZE bytes or whatever is left of the file. Only v2
+// clients that list it in their hello take it.
+
+// Flags or'd into the mode byte, only sent to clients known to support them
+#define MODE_FLAG_RESUME  0x80
+#define MODE_FLAG_CHECKED 0x40
+#define MODE_FLAG_STORED  0x20 // the payload may use CHUNK_STORED
+#define MODE_FLAG_STATS   0x10 // report STATS_ before the final response
+
+// Or'd into a MODE_ZLIB chunk size: the chunk is raw output that was not
+// worth deflating, and is not part of the deflate stream. The stream carries
+// on in the next deflated chunk and still ends the payload. Only sent to
+// clients with HELLO_STORED, with MODE_FLAG_STORED set, as the client
+// decodes plain streams with a faster decoder that can't interleave them.
+#define CHUNK_STORED 0x80000000
+#define CHUNK_FLAGS  CHUNK_STORED
+
+// Checked framing: every payload chunk header is u32 size, u32 seq, u32
+// crc32 of the payload, with seq counting from 0 in each payload. A chunk
+// that fails its CRC is NACKed with u32 NACK_MAGIC, u32 seq and the host
+// sends just that chunk again. Each chunk the client is done with is ACKed
+// with u32 ACK_MAGIC, u32 chunks done so far, and the host never sends a
+// chunk CHECKED_WINDOW or more past that, so whatever arrives while a resend
+// is on its way has a receive slot. NACKs and ACKs can arrive at any point
+// until the client's final response.
+#define NACK_MAGIC 0x4b43414e // "NACK"
+#define ACK_MAGIC  0x204b4341 // "ACK "
+#define CHECKED_WINDOW 4
+
+// Resume, for MODE_ZLIB and MODE_DELTA: after the first response the client
+// sends u32 offset and u32 adler32 of the output it already has. The host
+// answers with u32 start, either that offset if the checksum matches its
+// target or 0, and then sends a fresh stream for target[start:]. Hosts
+// don't ask for it for files under RESUME_MIN_SIZE unless told to.
+#define RESUME_MIN_SIZE (1 << 20)
+
+// Transfer stats, for v2 clients with HELLO_STATS in the zlib, delta, LZ4
+// and signature modes. With MODE_FLAG_STATS the final response of a payload
+// that was decoded in full comes right after u32 STATS_MAGIC, u32 count and
+// count u32 fields in STATS_ order. Times are in microseconds, and whatever
+// total leaves after the phases went to CRCs, copies between the rings and
+// progress output. Hosts skip fields past the ones they know. Early responses, before
+// any payload was decoded, come without a record.
+#define STATS_MAGIC 0x54415453 // "STAT", no response looks like it
+#define STATS_TOTAL_US         0  // first byte of the payload to the last write
+#define STATS_NET_US           1  // waiting on the network with nothing to write
+#define STATS_RECV_US          2  // recv(), copying out of the network stack
+#define STATS_DECODE_US        3  // inflate, xdelta or LZ4
+#define STATS_SOURCE_US        4  // reading delta source blocks
+#define STATS_WRITE_US         5  // fwrite
+#define STATS_RESUME_US        6  // checksumming output and saving resume records
+#define STATS_BYTES_IN         7  // payload bytes received
+#define STATS_BYTES_OUT        8  // bytes written
+#define STATS_SOURCE_READS     9  // xdelta source block misses, signature copies
+#define STATS_SOURCE_BYTES     10
+#define STATS_NET_STALLS       11
+#define STATS_WRITES           12
+#define STATS_RETRANSMIT_BYTES 13 // thrown away and NACKed in checked mode
+#define STATS_COUNT            14
+
+// s32 responses from the client
+#define RESPONSE_OK            0
+#define RESPONSE_OPEN_FAILED  -1
+#define RESPONSE_NO_BASE      -4
+#define RESPONSE_BAD_BASE     -5
+#define RESPONSE_BAD_PATH     -6
+#define RESPONSE_FAILED       -7
+
+// Sync mode, after the mode byte:
+//   host:   u16 rootlen, root         directory under /nds to sync
+//   client: manifest entries          u32 size, u32 adler32, u16 pathlen, path
+//           ended by a zero pathlen   paths are relative to root
+//   host:   ops until SYNC_END        u8 op, u16 pathlen, path, then for
+//                                     the payload ops u32 filelen and the
+//                                     payload chunks ended by an empty chunk
+//   client: s32 response              0 or the first error
+//   host:   u32 cmdlen, cmdline       as in the single file modes
+// SYNC_END carries the path of the file to launch, empty for none.
+#define SYNC_END    0
+#define SYNC_ZLIB   1
+#define SYNC_DELTA  2
+#define SYNC_DELETE 3
+#define SYNC_LZ4    4
+
+#define SYNC_MAX_PATH 255
+
+// Fleet mode, for v2 clients with HELLO_FLEET: one payload broadcast to many
+// clients at once, each with its own TCP connection for repairs. The request
+// is the v2 request with MODE_FLEET, the file's adler32 and start 0 and no
+// payload, followed by u32 session, u16 data port and u32 datagram count. The
+// client binds the data port and answers s32 0, or an error and closes.
+// Datagrams to the port are then
+//   u32 session, u32 seq, u32 offset, u16 size, u16 packed, data
+// with file[offset:offset+size] as an LZ4 block of packed bytes, or as is
+// when packed == size. After each pass the host sends u32 FLEET_ROUND on
+// every connection and the client answers u32 count and count pairs of u32
+// first and last seq it still misses, at most FLEET_MAX_RANGES, for the host
+// to broadcast again. Count 0 ends the transfer and is followed by the final
+// s32 response, sent once the file matched the adler32.
+#define FLEET_PORT (PORT + 2)
+#define FLEET_HEADER 16
+#define FLEET_PAYLOAD 1400          // packed bytes, keeps datagrams unfragmented
+#define FLEET_MAX_SLICE (16 * 1024) // a client scratch chunk
+#define FLEET_ROUND 0x444e5552      // "RUND"
+#define FLEET_MAX_RANGES 64
+
+// Signature mode, for v2 clients that list MODE_SIGNATURE: a delta against
+// whatever the client has, for when the host has no copy of it. The request
+// is the v2 request with the adler32 of the new file in place of the base
+// checksum, start 0 and no payload, followed by u32 block size. The client
+// answers s32 0, u32 count and count pairs of u32 rolling checksum
+// (signature.h) and u32 crc32 of each whole block of the file it has, or an
+// error and closes. The payload then rebuilds the file from ops, which never
+// straddle a chunk:
+//   u32 SIG_COPY | n, u32 first    n blocks of the old file from first on
+//   u32 size, u32 packed, data     new bytes, at most LZ4_BLOCK_SIZE, as an
+//                                  LZ4 block when packed != size
+// and the client sends the final response, RESPONSE_BAD_BASE if the result
+// doesn't match the checksum. It then waits for the host to send zlib.
+#define SIG_COPY      0x80000000
+#define SIG_MIN_BLOCK 256 // up to CHUNK_SIZE
+
+// Cached builds, for v2 clients with HELLO_CACHE that list MODE_CACHED. The
+// request is the v2 request with MODE_CACHED, the size and adler32 of a
+// build from the beacon as filelen and base adler32, start 0 and no payload.
+// The client puts that build at the name, keeping what was there, and sends
+// the final response. RESPONSE_NO_BASE means it no longer has it and waits
+// for the file to be sent as usual. A delta base adler32 that doesn't match
+// the file at the name may also name a cached build. For clients with
+// HELLO_CACHE, MODE_DELTA and MODE_CACHED requests carry u32 size and u32
+// crc32 of the base or build right after start, so a build is never picked
+// by its adler32 alone.
+
+#endif // PROTOCOL_H
@@ -0,0 +1,54 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#include "resume.h"
+
+#include <stdio.h>
+
+#define RESUME_FILE "dslink.resume"
+#define RESUME_MAGIC 0x31534552 // "RES1"
+
+bool resumeLoad(ResumeRecord *rec) {
+	char path[32];
+	dataPath(path, sizeof(path), RESUME_FILE);
+	FILE *fh = fopen(path, "rb");
+	if(!fh)
+		return false;
+	bool ok = fread(rec, sizeof(*rec), 1, fh) == 1 && rec->magic == RESUME_MAGIC;
+	fclose(fh);
+	rec->name[sizeof(rec->name) - 1] = 0;
+	return ok;
+}
+
+static FILE *recordFh;
+
+bool resumeSave(const ResumeRecord *rec) {
+	// Small enough to be rewritten in place, a torn write fails the magic
+	// check or the host's checksum and just means starting over
+	if(!recordFh) {
+		char path[32];
+		dataPath(path, sizeof(path), RESUME_FILE);
+		recordFh = fopen(path, "wb");
+	}
+	if(!recordFh)
+		return false;
+	ResumeRecord copy = *rec;
+	copy.magic = RESUME_MAGIC;
+	bool ok = fseek(recordFh, 0, SEEK_SET) == 0 && fwrite(&copy, sizeof(copy), 1, recordFh) == 1;
+	fileCommit(recordFh);
+	return ok;
+}
+
+void resumeClose(void) {
+	if(recordFh)
+		fclose(recordFh);
+	recordFh = NULL;
+}
+
+void resumeClear(void) {
+	resumeClose();
+	char path[32];
+	dataPath(path, sizeof(path), RESUME_FILE);
+	remove(path);
+}
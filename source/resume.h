@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#ifndef RESUME_H
+#define RESUME_H
+
+#include "platform.h"
+
+// Committed output is recorded about RESUME_RECORDS times a transfer, but
+// no more often than RESUME_INTERVAL_MIN and no less than RESUME_INTERVAL_MAX
+#define RESUME_RECORDS      32
+#define RESUME_INTERVAL_MIN (256 * 1024)
+#define RESUME_INTERVAL_MAX (4 << 20)
+
+static inline u32 resumeInterval(u32 filelen) {
+	u32 interval = filelen / RESUME_RECORDS;
+	return interval < RESUME_INTERVAL_MIN ? RESUME_INTERVAL_MIN : interval > RESUME_INTERVAL_MAX ? RESUME_INTERVAL_MAX : interval;
+}
+
+// What is needed to pick up an interrupted transfer. Rather than saving the
+// inflate or xdelta state, the host restarts a fresh stream at offset, so all
+// we keep is how much output is safely on the card and its checksum.
+struct ResumeRecord {
+	u32 magic;
+	u32 mode;         // MODE_ZLIB, MODE_DELTA or MODE_LZ4, after any fallback
+	u32 filelen;
+	u32 baseChecksum; // of the delta base, 0 for zlib
+	u32 offset;       // output bytes flushed to the card
+	u32 checksum;     // adler32 of those bytes
+	char name[256];
+};
+
+// The record file stays open from the first save until it is closed or
+// cleared, each save rewrites it in place
+bool resumeLoad(ResumeRecord *rec);
+bool resumeSave(const ResumeRecord *rec);
+void resumeClose(void);
+void resumeClear(void);
+
+#endif // RESUME_H
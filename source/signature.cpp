@@ -0,0 +1,199 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#include "signature.h"
+#include "adler.h"
+#include "cache.h"
+#include "clock.h"
+#include "lz4.h"
+#include "manifest.h"
+#include "netio.h"
+#include "progress.h"
+#include "protocol.h"
+#include "transfer.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+// Every whole block of the current file, sent as it is read. No file is an
+// empty signature and the host sends everything as new bytes. The number of
+// blocks signed goes in *blocks.
+static bool sendSignature(int sock, FILE *base, u32 blockSize, u32 *blocks) {
+	long size = 0;
+	if(base && fseek(base, 0, SEEK_END) == 0)
+		size = ftell(base);
+	u32 count = size > 0 ? size / blockSize : 0;
+	*blocks = count;
+	if(count)
+		iprintf("Signing %u blocks\n", (unsigned)count);
+	if(base)
+		fseek(base, 0, SEEK_SET);
+
+	// The answer goes out with the first entries, two small sends would wait
+	// out the host's delayed ACK
+	u32 *words = (u32 *)out, queued = 2;
+	words[0] = RESPONSE_OK;
+	words[1] = count;
+	for(u32 i = 0; i <= count; i++) {
+		if(i < count) {
+			// The count may be out already, a short read can only end the transfer
+			if(fread(in, 1, blockSize, base) != blockSize) {
+				iprintf("signature read\n");
+				return false;
+			}
+			words[queued++] = rollingChecksum(in, blockSize);
+			words[queued++] = crc32(0, in, blockSize);
+		}
+		if(queued == CHUNK_SIZE / 4 || (i == count && queued)) {
+			if(netSendAll(sock, words, 4 * queued) != (int)(4 * queued))
+				return false;
+			queued = 0;
+		}
+	}
+	return true;
+}
+
+// Copies and new bytes, see protocol.h. Ops never straddle a chunk, so each
+// one is decoded straight from its receive slot. Copies only reach the blocks
+// that were signed.
+static int applyOps(Pipeline &pipeline, FILE *base, u32 blockSize, u32 blocks, size_t filesize, u32 *checksum) {
+	size_t total = 0;
+	long position = -1; // of base, seeking flushes the stdio buffer
+	u32 sum = ADLER_INIT;
+	while(total < filesize) {
+		u32 size;
+		const u8 *data = pipeline.nextData(&size, true);
+		if(!data) {
+			iprintf("chunk\n");
+			return -1;
+		}
+
+		for(u32 pos = 0; pos < size;) {
+			u32 op[2];
+			if(size - pos < sizeof(op))
+				goto bad;
+			memcpy(op, data + pos, sizeof(op));
+			pos += sizeof(op);
+
+			if(op[0] & SIG_COPY) {
+				u32 run = op[0] & ~SIG_COPY;
+				if(!base || op[1] > blocks || run > blocks - op[1] || (u64)run * blockSize > filesize - total)
+					goto bad;
+				for(u32 i = 0; i < run; i++) {
+					// Inside what ftell() measured, so it fits a long
+					long at = (long)((u64)(op[1] + i) * blockSize);
+					u64 start = clockTicks();
+					if((at != position && fseek(base, at, SEEK_SET) != 0) || fread(out, 1, blockSize, base) != blockSize) {
+						iprintf("signature base read\n");
+						return -1;
+					}
+					pipelineStats.sourceTicks += clockTicks() - start;
+					pipelineStats.sourceReads++;
+					pipelineStats.sourceBytes += blockSize;
+					position = at + blockSize;
+					if(pipeline.write(out, blockSize) < 0 || pipeline.pump() < 0)
+						return -1;
+					sum = adlerUpdate(sum, out, blockSize);
+					total += blockSize;
+				}
+			} else {
+				u32 n = op[0], packed = op[1];
+				if(n > LZ4_BLOCK_SIZE || n > filesize - total || packed > size - pos)
+					goto bad;
+				const u8 *bytes = data + pos;
+				if(packed != n) {
+					u64 start = clockTicks();
+					int decoded = lz4DecodeBlock(bytes, packed, out, n);
+					pipelineStats.decodeTicks += clockTicks() - start;
+					if(decoded < 0)
+						goto bad;
+					bytes = out;
+				}
+				if(pipeline.write(bytes, n) < 0)
+					return -1;
+				sum = adlerUpdate(sum, bytes, n);
+				total += n;
+				pos += packed;
+			}
+			filetotal = total;
+		}
+		pipeline.consume(size);
+		if(pipeline.pump() < 0)
+			return -1;
+	}
+
+	if(!pipeline.finish())
+		return -1;
+	*checksum = sum;
+	return 0;
+
+bad:
+	iprintf("signature op at %zu\n", total);
+	return -1;
+}
+
+int receiveSignature(int sock, const char *filename, u32 filelen, u32 checksum, u32 pipeFlags, bool stats) {
+	u32 blockSize;
+	if(netRecvAll(sock, &blockSize, 4) != 4) {
+		iprintf("block size %d\n", errno);
+		return RESPONSE_FAILED;
+	}
+
+	s32 response = RESPONSE_OK;
+	FILE *base = fopen(filename, "rb");
+	char patched[32];
+	dataPath(patched, sizeof(patched), "dslink.out");
+	FILE *outfile = fopen(patched, "wb");
+	if(blockSize < SIG_MIN_BLOCK || blockSize > CHUNK_SIZE) {
+		iprintf("block size %u\n", (unsigned)blockSize);
+		response = RESPONSE_FAILED;
+	} else if(!outfile) {
+		iprintf("Failed to open %s\n", patched);
+		response = RESPONSE_OPEN_FAILED;
+	}
+
+	// The host waits for the signature before it encodes anything
+	u32 blocks = 0;
+	bool connected = response == RESPONSE_OK ? sendSignature(sock, base, blockSize, &blocks)
+	                                         : netSendAll(sock, &response, sizeof(response)) == sizeof(response);
+	u32 result = 0;
+	int res = -1;
+	if(connected && response == RESPONSE_OK) {
+		pipeline.begin(sock, outfile, pipeFlags);
+		progressBegin(filelen);
+		res = applyOps(pipeline, base, blockSize, blocks, filelen, &result);
+		progressEnd(res == 0);
+	}
+
+	if(base)
+		fclose(base);
+	if(outfile && fclose(outfile) != 0)
+		res = -1;
+	if(!connected || response != RESPONSE_OK)
+		return response != RESPONSE_OK ? response : RESPONSE_FAILED;
+
+	if(res != 0) {
+		iprintf("signature patch failed %d\n", res);
+		response = RESPONSE_FAILED;
+	} else if(result != checksum) {
+		// The file changed between the signature and the ops, or a block
+		// collided. The host sends it again as zlib.
+		iprintf("Mismatched checksum\n");
+		response = RESPONSE_BAD_BASE;
+	} else {
+		cacheKeep(filename);
+		manifestForget(filename);
+		remove(filename);
+		rename(patched, filename);
+	}
+
+	netMarkRequest();
+	if(stats && res == 0)
+		sendTransferStats(sock);
+	netSendAll(sock, &response, sizeof(response));
+	if(response == RESPONSE_OK)
+		manifestRecord(filename, result);
+	return response;
+}
@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#ifndef SIGNATURE_H
+#define SIGNATURE_H
+
+#include "platform.h"
+
+// rsync's weak checksum: the byte sum in the low half and the sum of the
+// running byte sums in the high half, each mod 2^16
+static inline u32 rollingChecksum(const u8 *data, u32 size) {
+	u32 s1 = 0, s2 = 0;
+	for(u32 i = 0; i < size; i++) {
+		s1 += data[i];
+		s2 += s1;
+	}
+	return (s1 & 0xFFFF) | s2 << 16;
+}
+
+// Moves a size byte window one byte on, dropping first and taking last
+static inline u32 rollChecksum(u32 sum, u8 first, u8 last, u32 size) {
+	u32 s1 = ((sum & 0xFFFF) - first + last) & 0xFFFF;
+	u32 s2 = ((sum >> 16) - size * first + s1) & 0xFFFF;
+	return s1 | s2 << 16;
+}
+
+// Runs a MODE_SIGNATURE transfer on sock after the v2 request: sends the
+// signature of the current filename, rebuilds it from the ops the host sends
+// back and sends the final response, RESPONSE_BAD_BASE if the result isn't
+// the file with the given adler32, after the stats record if asked for.
+// Returns that response.
+int receiveSignature(int sock, const char *filename, u32 filelen, u32 checksum, u32 pipeFlags, bool stats);
+
+#endif // SIGNATURE_H
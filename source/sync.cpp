@@ -0,0 +1,229 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#include "sync.h"
+#include "adler.h"
+#include "manifest.h"
+#include "netio.h"
+#include "platform.h"
+#include "progress.h"
+#include "protocol.h"
+#include "transfer.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define PATH_BUF 512
+
+static u8 batch[2048];
+static u32 batchLen;
+
+static bool flushBatch(int sock) {
+	bool ok = netSendAll(sock, batch, batchLen) == (int)batchLen;
+	batchLen = 0;
+	return ok;
+}
+
+static bool addEntry(int sock, const char *path, u32 size, u32 checksum) {
+	u16 pathlen = strlen(path);
+	if(batchLen + 10 + pathlen > sizeof(batch) && !flushBatch(sock))
+		return false;
+
+	memcpy(batch + batchLen, &size, 4);
+	memcpy(batch + batchLen + 4, &checksum, 4);
+	memcpy(batch + batchLen + 8, &pathlen, 2);
+	memcpy(batch + batchLen + 10, path, pathlen);
+	batchLen += 10 + pathlen;
+	return true;
+}
+
+// Walks path recursively, rootLen is where the part sent to the host starts
+static bool sendManifest(int sock, char *path, size_t rootLen) {
+	DIR *dir = opendir(path);
+	if(!dir)
+		return true; // nothing there yet
+
+	size_t len = strlen(path);
+	bool ok = true;
+	struct dirent *ent;
+	while(ok && (ent = readdir(dir)) != NULL) {
+		if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+			continue;
+		if(len + 1 + strlen(ent->d_name) >= PATH_BUF)
+			continue;
+		sniprintf(path + len, PATH_BUF - len, "/%s", ent->d_name);
+
+		struct stat st;
+		if(stat(path, &st) == 0) {
+			if(S_ISDIR(st.st_mode))
+				ok = sendManifest(sock, path, rootLen);
+			else if(strlen(path + rootLen) <= SYNC_MAX_PATH) {
+				u32 size, checksum = ADLER_INIT;
+				if(!manifestChecksum(path, &size, &checksum))
+					size = st.st_size;
+				ok = addEntry(sock, path + rootLen, size, checksum);
+			}
+		}
+		path[len] = 0;
+	}
+	closedir(dir);
+	return ok;
+}
+
+// Relative, no empty, "." or ".." components
+static bool validPath(const char *path) {
+	if(path[0] == 0 || path[0] == '/')
+		return false;
+	const char *part = path;
+	while(true) {
+		const char *end = strchr(part, '/');
+		size_t len = end ? (size_t)(end - part) : strlen(part);
+		if(len == 0 || (len == 1 && part[0] == '.') || (len == 2 && part[0] == '.' && part[1] == '.'))
+			return false;
+		if(!end)
+			return true;
+		part = end + 1;
+	}
+}
+
+static void makeParents(char *path) {
+	for(char *p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = 0;
+		mkdir(path, 0777);
+		*p = '/';
+	}
+}
+
+static bool receivePath(int sock, char *buf, u16 *pathlen) {
+	if(netRecvAll(sock, pathlen, 2) != 2 || *pathlen > SYNC_MAX_PATH)
+		return false;
+	if(netRecvAll(sock, buf, *pathlen) != *pathlen)
+		return false;
+	buf[*pathlen] = 0;
+	return true;
+}
+
+static int receiveFile(int sock, u8 op, char *path, u32 pipeFlags) {
+	u32 filelen;
+	if(netRecvAll(sock, &filelen, 4) != 4)
+		return RESPONSE_FAILED;
+
+	iprintf("%s\n", path);
+	makeParents(path);
+	manifestForget(path);
+
+	FILE *sourceFile = NULL;
+	if(op == SYNC_DELTA) {
+		// Picked from our manifest, which can be stale. The patch's window
+		// checksums tell.
+		sourceFile = fopen(path, "rb");
+		if(!sourceFile)
+			return RESPONSE_NO_BASE;
+	}
+
+	char patched[32];
+	dataPath(patched, sizeof(patched), "dslink.out");
+	FILE *outfile = fopen(sourceFile ? patched : path, "wb");
+	if(!outfile) {
+		if(sourceFile) fclose(sourceFile);
+		return RESPONSE_OPEN_FAILED;
+	}
+
+	int res;
+	pipeline.begin(sock, outfile, pipeFlags | PIPE_TERMINATED);
+	progressBegin(filelen);
+	if(sourceFile) res = receiveAndPatch(pipeline, sourceFile, filelen);
+	else if(op == SYNC_LZ4) res = receiveLz4(pipeline, filelen);
+	else res = receiveAndDecompress(pipeline, filelen);
+	progressEnd(res == 0);
+	if(res == 0 && !pipeline.skipToEnd())
+		res = -1;
+
+	fclose(outfile);
+	if(sourceFile) {
+		fclose(sourceFile);
+		if(res == 0) {
+			remove(path);
+			rename(patched, path);
+		}
+	}
+
+	iprintf("\n");
+	if(res == PATCH_BAD_BASE)
+		return RESPONSE_BAD_BASE;
+	return res == 0 ? RESPONSE_OK : RESPONSE_FAILED;
+}
+
+int receiveTree(int sock, char *launch, u32 pipeFlags) {
+	static char path[PATH_BUF];
+	char name[SYNC_MAX_PATH + 1];
+	u16 pathlen;
+
+	launch[0] = 0;
+	if(!receivePath(sock, name, &pathlen) || (pathlen && !validPath(name)))
+		return RESPONSE_BAD_PATH;
+
+	int rootLen = sniprintf(path, PATH_BUF, "%s/nds%s%s", storageRoot(), pathlen ? "/" : "", name);
+	iprintf("Syncing %s\n", path);
+	mkdir(path, 0777);
+
+	// The walk appends "/name" to root, skip the slash too
+	batchLen = 0;
+	bool sent = sendManifest(sock, path, rootLen + 1) && addEntry(sock, "", 0, 0) && flushBatch(sock);
+	manifestFlush();
+	if(!sent)
+		return RESPONSE_FAILED;
+
+	u32 files = 0;
+	while(true) {
+		u8 op;
+		if(netRecvAll(sock, &op, 1) != 1 || !receivePath(sock, name, &pathlen))
+			return RESPONSE_FAILED;
+		if(pathlen && !validPath(name))
+			return RESPONSE_BAD_PATH;
+
+		// Cut short it would write or delete some other file
+		path[rootLen] = 0;
+		if(pathlen && sniprintf(path + rootLen, PATH_BUF - rootLen, "/%s", name) >= PATH_BUF - rootLen) {
+			iprintf("Path too long\n");
+			return RESPONSE_BAD_PATH;
+		}
+
+		int res = RESPONSE_OK;
+		switch(op) {
+			case SYNC_END:
+				if(pathlen) {
+					// Truncated it would launch some other file
+					size_t len = strlen(path);
+					if(len >= SYNC_LAUNCH_MAX) {
+						iprintf("Launch path too long\n");
+						return RESPONSE_BAD_PATH;
+					}
+					memcpy(launch, path, len + 1);
+				}
+				iprintf("Synced %u files\n", (unsigned)files);
+				return RESPONSE_OK;
+			case SYNC_DELETE:
+				manifestForget(path);
+				remove(path);
+				break;
+			case SYNC_ZLIB:
+			case SYNC_DELTA:
+			case SYNC_LZ4:
+				res = receiveFile(sock, op, path, pipeFlags);
+				files++;
+				break;
+			default:
+				iprintf("sync op %d\n", op);
+				res = RESPONSE_FAILED;
+				break;
+		}
+
+		// A failed payload leaves the stream out of step, give up on the session
+		if(res != RESPONSE_OK)
+			return res;
+	}
+}
@@ -0,0 +1,19 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#ifndef SYNC_H
+#define SYNC_H
+
+#include "platform.h"
+
+// Runs a MODE_SYNC session on sock after the mode byte: reports what is under
+// the requested directory and receives the files the host sends back. launch
+// gets the full path of the file to run, or an empty string. Returns 0 or a
+// negative error for the host, RESPONSE_BAD_PATH if the path to run doesn't
+// fit in launch. pipeFlags are passed on to each payload.
+#define SYNC_LAUNCH_MAX 256 // the size of launch
+
+int receiveTree(int sock, char *launch, u32 pipeFlags);
+
+#endif // SYNC_H
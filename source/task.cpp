@@ -0,0 +1,208 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#include "task.h"
+#include "clock.h"
+#include "netio.h"
+
+#include <string.h>
+
+#define FRAME_TICKS (CLOCK_HZ / 60)
+
+struct TaskSlot {
+	std::coroutine_handle<Task::promise_type> root;
+	std::coroutine_handle<> waiting; // where it suspended, NULL while it runs or once done
+	TaskWait wait;
+	int result;  // for the awaiter
+	bool ready;  // spawned and not started yet
+	bool cancelled, paused, done;
+	TaskStats stats;
+};
+
+static TaskSlot slots[TASK_MAX];
+static int count;
+static int current = -1; // the task running now, -1 for none
+static u64 sliceStart, nextFrame;
+
+// Charges the time since the last switch to whoever had it
+static int switchTo(int id) {
+	u64 now = clockTicks();
+	if(current >= 0)
+		slots[current].stats.cpuTicks += now - sliceStart;
+	sliceStart = now;
+	int prev = current;
+	current = id;
+	return prev;
+}
+
+void taskReset(void) {
+	for(int i = 0; i < count; i++)
+		slots[i].root.destroy();
+	count = 0;
+	current = -1;
+}
+
+int taskSpawn(Task task, const char *name) {
+	if(count == TASK_MAX)
+		return -1;
+	TaskSlot &t = slots[count];
+	t = {};
+	t.root = task.release();
+	t.waiting = t.root;
+	t.ready = true;
+	t.stats.name = name;
+	return count++;
+}
+
+static void resume(int id, int result) {
+	TaskSlot &t = slots[id];
+	std::coroutine_handle<> handle = t.waiting;
+	t.waiting = nullptr;
+	t.ready = false;
+	t.result = result;
+	t.stats.resumes++;
+	int prev = switchTo(id);
+	handle.resume();
+	switchTo(prev);
+	t.done = t.root.done();
+}
+
+bool TaskWait::await_ready(void) {
+	if(current < 0 || !(slots[current].cancelled || netCancelled()))
+		return false;
+	slots[current].result = NET_CANCELLED;
+	return true;
+}
+
+void TaskWait::await_suspend(std::coroutine_handle<> handle) {
+	slots[current].waiting = handle;
+	slots[current].wait = *this;
+}
+
+int TaskWait::await_resume(void) {
+	return slots[current].result;
+}
+
+void taskCancel(int id) {
+	if(id >= 0 && id < count)
+		slots[id].cancelled = true;
+}
+
+void taskPause(int id, bool paused) {
+	if(id >= 0 && id < count)
+		slots[id].paused = paused;
+}
+
+bool taskCancelled(void) {
+	return current >= 0 && slots[current].cancelled;
+}
+
+bool taskDone(int id) {
+	return id < 0 || id >= count || slots[id].done;
+}
+
+int taskRun(int id) {
+	while(!slots[id].done) {
+		if(taskPoll(NULL, 0, false, 0) == NET_ERROR)
+			return NET_ERROR;
+	}
+	return slots[id].root.promise().result;
+}
+
+static void add(int sock, fd_set *set, int *maxfd) {
+	FD_SET(sock, set);
+	if(sock > *maxfd)
+		*maxfd = sock;
+}
+
+int taskPoll(const int *socks, int nsocks, bool write, u64 until) {
+	fd_set readSet, writeSet;
+	FD_ZERO(&readSet);
+	FD_ZERO(&writeSet);
+	int maxfd = -1;
+	for(int i = 0; i < nsocks; i++)
+		add(socks[i], write ? &writeSet : &readSet, &maxfd);
+
+	// Sleep until whichever comes first, the next frame, the caller's
+	// deadline or a task's. Only tasks waiting now count as woken by the
+	// sockets, one resumed below may wait on something else.
+	u64 now = clockTicks();
+	u64 wake = nextFrame > now ? nextFrame : now;
+	if(until && until < wake)
+		wake = until;
+	bool armed[TASK_MAX] = {};
+	bool cancelled = netCancelled();
+	for(int i = 0; i < count; i++) {
+		TaskSlot &t = slots[i];
+		if(!t.waiting || t.paused)
+			continue;
+		if(t.ready || t.cancelled || cancelled)
+			wake = now;
+		if(t.wait.deadline && t.wait.deadline < wake)
+			wake = t.wait.deadline > now ? t.wait.deadline : now;
+		if(t.wait.sock >= 0) {
+			add(t.wait.sock, t.wait.write ? &writeSet : &readSet, &maxfd);
+			armed[i] = true;
+		}
+	}
+
+	u64 us = wake > now ? ticksToUs(wake - now) : 0;
+	int ret = 0;
+	int prev = switchTo(-1);
+	if(maxfd >= 0) {
+		struct timeval tv;
+		tv.tv_sec = us / 1000000;
+		tv.tv_usec = us % 1000000;
+		ret = select(maxfd + 1, &readSet, &writeSet, NULL, &tv);
+	} else if(us) {
+		// Nothing to select() on: the frame, a task's deadline or a replay's
+		// data arriving on the tick it was recorded at
+		clockSleepUntil(wake);
+	}
+	netStats.waitTicks += clockTicks() - now;
+	netStats.waits++;
+	switchTo(prev);
+	if(ret < 0) {
+		if(errno != EINTR) {
+			iprintf("select %d\n", errno);
+			return NET_ERROR;
+		}
+		FD_ZERO(&readSet);
+		FD_ZERO(&writeSet);
+	}
+
+	int ready = NET_TIMEOUT;
+	for(int i = 0; i < nsocks && ready < 0; i++) {
+		if(FD_ISSET(socks[i], write ? &writeSet : &readSet))
+			ready = i;
+	}
+
+	now = clockTicks();
+	bool frame = now >= nextFrame;
+	if(frame) {
+		nextFrame = now + FRAME_TICKS;
+		netStats.yields++;
+	}
+	cancelled = netCancelled();
+	for(int i = 0; i < count; i++) {
+		TaskSlot &t = slots[i];
+		if(!t.waiting || t.paused)
+			continue;
+		if(t.ready)
+			resume(i, 0);
+		else if(t.cancelled || cancelled)
+			resume(i, NET_CANCELLED);
+		else if(armed[i] && FD_ISSET(t.wait.sock, t.wait.write ? &writeSet : &readSet))
+			resume(i, 0);
+		else if(t.wait.frame && frame)
+			resume(i, 0);
+		else if(t.wait.deadline && now >= t.wait.deadline)
+			resume(i, NET_TIMEOUT);
+	}
+	return ready;
+}
+
+const TaskStats *taskStats(int id) {
+	return id >= 0 && id < count ? &slots[id].stats : NULL;
+}
@@ -0,0 +1,115 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#ifndef TASK_H
+#define TASK_H
+
+#include "platform.h"
+
+#include <coroutine>
+
+// Cooperative tasks for the receive loop: C++20 coroutines resumed by one
+// frame-paced scheduler. A task suspends until a socket is ready, the next
+// frame or a deadline and gets back 0 or a negative NET_ result, NET_TIMEOUT
+// or NET_CANCELLED included. Plain code running inside a task, like the
+// decoders under a transfer, waits with taskPoll() through netio instead,
+// which keeps the other tasks going meanwhile.
+#define TASK_MAX 6
+
+class Task {
+public:
+	struct promise_type {
+		int result = 0;
+		std::coroutine_handle<> caller; // a task awaiting this one, if any
+
+		Task get_return_object(void) { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		std::suspend_always initial_suspend(void) { return {}; }
+		void return_value(int value) { result = value; }
+		void unhandled_exception(void) {}
+
+		// Back to the caller, or to the scheduler for a task of its own
+		struct FinalAwaiter {
+			bool await_ready(void) noexcept { return false; }
+			std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+				std::coroutine_handle<> caller = handle.promise().caller;
+				return caller ? caller : std::noop_coroutine();
+			}
+			void await_resume(void) noexcept {}
+		};
+		FinalAwaiter final_suspend(void) noexcept { return {}; }
+	};
+
+	explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+	Task(Task &&other) : handle(other.handle) { other.handle = nullptr; }
+	Task(const Task &) = delete;
+	~Task() {
+		if(handle)
+			handle.destroy();
+	}
+
+	// co_await runs another coroutine as part of the awaiting task
+	bool await_ready(void) { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) {
+		handle.promise().caller = caller;
+		return handle;
+	}
+	int await_resume(void) { return handle.promise().result; }
+
+	std::coroutine_handle<promise_type> release(void) {
+		std::coroutine_handle<promise_type> h = handle;
+		handle = nullptr;
+		return h;
+	}
+
+private:
+	std::coroutine_handle<promise_type> handle;
+};
+
+// What a suspended task waits for, from the functions below
+struct TaskWait {
+	int sock;     // -1 for none
+	bool write;
+	bool frame;   // the start of the next frame
+	u64 deadline; // clock ticks, 0 for none
+
+	bool await_ready(void);
+	void await_suspend(std::coroutine_handle<> handle);
+	int await_resume(void);
+};
+
+static inline TaskWait taskReadable(int sock, u64 deadline) { return {sock, false, false, deadline}; }
+static inline TaskWait taskWritable(int sock, u64 deadline) { return {sock, true, false, deadline}; }
+static inline TaskWait taskFrame(void) { return {-1, false, true, 0}; }
+static inline TaskWait taskSleep(u64 deadline) { return {-1, false, false, deadline}; }
+
+struct TaskStats {
+	const char *name;
+	u64 cpuTicks; // resumed, not counting other tasks run from its waits
+	u32 resumes;
+};
+
+// Drops every task, then starts new ones. Returns the task id, -1 if full.
+void taskReset(void);
+int taskSpawn(Task task, const char *name);
+
+// Runs the scheduler until the task finishes, returns what it returned
+int taskRun(int id);
+
+// Its waits return NET_CANCELLED from now on, plain code in it sees
+// taskCancelled()
+void taskCancel(int id);
+// A paused task isn't resumed, whatever it waits for, until unpaused
+void taskPause(int id, bool paused);
+bool taskCancelled(void);
+bool taskDone(int id);
+
+// Resumes the other tasks that are due, sleeping in select() at most until
+// the next frame or until (0 for none). Returns the index of the first of
+// socks that is ready, NET_TIMEOUT if none is yet or NET_ERROR.
+int taskPoll(const int *socks, int count, bool write, u64 until);
+
+// For the tasks spawned since the last reset, NULL past the last
+const TaskStats *taskStats(int id);
+
+#endif // TASK_H
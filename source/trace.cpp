@@ -0,0 +1,134 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#include "trace.h"
+#include "clock.h"
+#include "pipeline.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static FILE *recording, *replaying;
+static u64 startTicks;
+static bool realtime;
+
+// The replayed segment being read
+static u8 segment[CHUNK_SIZE];
+static u32 segmentAt;  // microseconds since accept
+static s32 segmentLen; // 0 once the host closed
+static s32 segmentPos;
+static bool loaded;
+
+bool traceStart(const char *path, u8 hostVersion, const char *query) {
+	traceStop();
+	recording = fopen(path, "wb");
+	if(!recording) {
+		iprintf("trace %s\n", path);
+		return false;
+	}
+	u32 magic = TRACE_MAGIC;
+	u8 namelen = query ? strlen(query) : 0;
+	fwrite(&magic, 4, 1, recording);
+	fwrite(&hostVersion, 1, 1, recording);
+	fwrite(&namelen, 1, 1, recording);
+	fwrite(query, 1, namelen, recording);
+	startTicks = clockTicks();
+	return true;
+}
+
+void traceStop(void) {
+	if(recording)
+		fclose(recording);
+	recording = NULL;
+}
+
+bool traceRecording(void) {
+	return recording != NULL;
+}
+
+void traceRecord(const void *data, int len) {
+	// Longer reads are split to fit the replay segment
+	const u8 *ptr = (const u8 *)data;
+	u32 at = ticksToUs(clockTicks() - startTicks);
+	do {
+		int part = len < (int)sizeof(segment) ? len : sizeof(segment);
+		u32 header[2] = {at, (u32)part};
+		if(fwrite(header, sizeof(header), 1, recording) != 1 || fwrite(ptr, 1, part, recording) != (size_t)part) {
+			iprintf("trace write\n");
+			traceStop();
+			return;
+		}
+		ptr += part;
+		len -= part;
+	} while(len > 0);
+}
+
+bool traceReplayOpen(const char *path, bool live, u8 *hostVersion) {
+	traceReplayClose();
+	replaying = fopen(path, "rb");
+	u32 magic;
+	u8 namelen;
+	char name[256];
+	if(!replaying || fread(&magic, 4, 1, replaying) != 1 || magic != TRACE_MAGIC || fread(hostVersion, 1, 1, replaying) != 1
+			|| fread(&namelen, 1, 1, replaying) != 1 || fread(name, 1, namelen, replaying) != namelen) {
+		iprintf("Not a trace: %s\n", path);
+		traceReplayClose();
+		return false;
+	}
+	realtime = live;
+	loaded = false;
+	startTicks = clockTicks();
+	return true;
+}
+
+void traceReplayClose(void) {
+	if(replaying)
+		fclose(replaying);
+	replaying = NULL;
+}
+
+bool traceReplaying(void) {
+	return replaying != NULL;
+}
+
+// The next segment with data left, the end of the trace counts as a close
+static void load(void) {
+	while(!loaded || (segmentLen > 0 && segmentPos == segmentLen)) {
+		u32 header[2];
+		segmentPos = 0;
+		loaded = true;
+		if(fread(header, sizeof(header), 1, replaying) != 1) {
+			segmentLen = 0;
+			return;
+		}
+		segmentAt = header[0];
+		segmentLen = header[1];
+		if(segmentLen < 0 || segmentLen > (s32)sizeof(segment) || fread(segment, 1, segmentLen, replaying) != (size_t)segmentLen) {
+			iprintf("trace damaged\n");
+			segmentLen = 0;
+		}
+	}
+}
+
+u64 traceNextArrival(void) {
+	load();
+	if(!realtime)
+		return 0;
+	u64 at = startTicks + (u64)segmentAt * CLOCK_HZ / 1000000;
+	return at > clockTicks() ? at : 0;
+}
+
+int traceRecv(void *buffer, int size, int flags) {
+	if(traceNextArrival()) {
+		errno = EAGAIN;
+		return -1;
+	}
+	if(segmentLen == 0)
+		return 0;
+	int len = segmentLen - segmentPos < size ? segmentLen - segmentPos : size;
+	memcpy(buffer, segment + segmentPos, len);
+	if(!(flags & MSG_PEEK))
+		segmentPos += len;
+	return len;
+}
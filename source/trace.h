@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "platform.h"
+
+// Recording of what a transfer connection received and when, and replay of
+// it into the same receive and decode path, so a change can be measured
+// against a real session. A trace is u32 TRACE_MAGIC, u8 host protocol
+// version, u8 namelen and the name under /nds the host pinged about, then a
+// record per recv() that got anything: u32 microseconds since accept, s32
+// length (0 for the host closing) and the bytes. What the client sends isn't
+// kept, replays drop it. Fleet datagrams aren't traced.
+#define TRACE_MAGIC 0x31525444 // "DTR1"
+
+// Records the connection accepted just now until traceStop()
+bool traceStart(const char *path, u8 hostVersion, const char *query);
+void traceStop(void);
+
+// Replays a trace, data becomes readable at the recorded times or, without
+// realtime, as fast as the client takes it. Segments keep their recorded
+// boundaries either way. A realtime replay sleeps until each segment is due
+// (clockSleepUntil), so the CPU time it reports is the client's own.
+bool traceReplayOpen(const char *path, bool realtime, u8 *hostVersion);
+void traceReplayClose(void);
+
+bool traceRecording(void);
+bool traceReplaying(void);
+
+// Used by netio
+void traceRecord(const void *data, int len);
+int traceRecv(void *buffer, int size, int flags);
+// Clock ticks when the next replayed data arrives, 0 if it is readable now
+u64 traceNextArrival(void);
+
+#endif // TRACE_H
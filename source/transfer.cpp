@@ -0,0 +1,351 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#include "transfer.h"
+#include "adler.h"
+#include "clock.h"
+#include "inflate.h"
+#include "lz4.h"
+#include "netio.h"
+#include "platform.h"
+#include "protocol.h"
+
+#include <stdio.h>
+#include <zlib.h>
+#include "xdelta3.h"
+
+// VCD_ADLER32, which xdelta3.c keeps to itself
+#define XD3_WINDOW_ADLER32 (1U << 2)
+
+unsigned char in[CHUNK_SIZE];
+unsigned char out[CHUNK_SIZE];
+volatile size_t filetotal;
+Pipeline pipeline;
+
+static_assert(OUT_SLOTS * OUT_SLOT_SIZE >= INFLATE_HISTORY + OUT_SLOT_SIZE,
+	"the write ring must hold the inflate history besides the slot being filled");
+
+struct FastIo {
+	Pipeline *pipeline;
+	u32 lastSize;
+	size_t total;
+	u64 ioTicks; // spent in the callbacks rather than inflating
+};
+
+static const u8 *fastInput(void *ctx, u32 *size) {
+	FastIo *io = (FastIo *)ctx;
+	u64 start = clockTicks();
+	io->pipeline->consume(io->lastSize);
+	const u8 *data = io->pipeline->nextData(size);
+	io->lastSize = data ? *size : 0;
+	if(!data)
+		iprintf("chunk\n");
+	io->ioTicks += clockTicks() - start;
+	return data;
+}
+
+static u8 *fastOutput(void *ctx, u32 used, u32 *avail) {
+	FastIo *io = (FastIo *)ctx;
+	u64 start = clockTicks();
+	io->pipeline->commitOutput(used);
+	if(used) {
+		// keep the socket drained between slots
+		if(io->pipeline->pump() < 0)
+			return NULL;
+		io->total += used;
+		filetotal = io->total;
+	}
+	u8 *dst = io->pipeline->outBuffer(avail);
+	io->ioTicks += clockTicks() - start;
+	return dst;
+}
+
+// Decodes straight into the write ring, see inflate.h
+static int inflateFast(Pipeline &pipeline, size_t filesize) {
+	FastIo fast = {&pipeline, 0, 0, 0};
+	InflateIo io = {&fast, fastInput, fastOutput, pipeline.outRing(), OUT_SLOTS * OUT_SLOT_SIZE, 0};
+	u64 start = clockTicks();
+	int ret = inflateStream(&io);
+	pipelineStats.decodeTicks += clockTicks() - start - fast.ioTicks;
+	if(ret < 0) {
+		iprintf("inflate at %zu\n", fast.total);
+		return Z_DATA_ERROR;
+	}
+	pipeline.consume(fast.lastSize - io.unused);
+	if(!pipeline.finish())
+		return Z_ERRNO;
+	return Z_OK;
+}
+
+// zlib's inflate(), which can step around stored chunks
+static int inflateChunks(Pipeline &pipeline, size_t filesize) {
+	int ret;
+	unsigned have;
+	z_stream strm;
+
+	// allocate inflate state
+	strm.zalloc = Z_NULL;
+	strm.zfree = Z_NULL;
+	strm.opaque = Z_NULL;
+	strm.avail_in = 0;
+	strm.next_in = Z_NULL;
+	ret = inflateInit(&strm);
+	if(ret != Z_OK) {
+		iprintf("inflateInit %d\n", ret);
+		return ret;
+	}
+
+	size_t total = 0;
+	// decompress until deflate stream ends or end of file
+	do {
+		u32 size;
+		const u8 *data = pipeline.nextData(&size);
+		if(!data) {
+			inflateEnd(&strm);
+			iprintf("chunk\n");
+			return Z_DATA_ERROR;
+		}
+
+		// Incompressible chunks skip zlib, the deflate stream simply doesn't
+		// include them
+		if(pipeline.chunkFlags() & CHUNK_STORED) {
+			if(pipeline.write(data, size) < 0) {
+				inflateEnd(&strm);
+				return Z_ERRNO;
+			}
+			pipeline.consume(size);
+			pipelineStats.storedBytes += size;
+			total += size;
+			filetotal = total;
+			continue;
+		}
+
+		strm.avail_in = size;
+		strm.next_in = (Bytef *)data;
+
+		// run inflate() on input until output buffer not full
+		do {
+			u32 avail;
+			strm.next_out = pipeline.outBuffer(&avail);
+			if(!strm.next_out) {
+				inflateEnd(&strm);
+				return Z_ERRNO;
+			}
+			strm.avail_out = avail;
+			u64 start = clockTicks();
+			ret = inflate(&strm, Z_NO_FLUSH);
+			pipelineStats.decodeTicks += clockTicks() - start;
+
+			switch(ret) {
+				case Z_NEED_DICT:
+					ret = Z_DATA_ERROR; // and fall through
+				case Z_DATA_ERROR:
+				case Z_MEM_ERROR:
+				case Z_STREAM_ERROR:
+					inflateEnd(&strm);
+					iprintf("inflate %d\n", ret);
+					return ret;
+			}
+
+			have = avail - strm.avail_out;
+			pipeline.commitOutput(have);
+			// keep the socket drained between inflate steps
+			if(pipeline.pump() < 0) {
+				inflateEnd(&strm);
+				return Z_ERRNO;
+			}
+
+			total += have;
+			filetotal = total;
+		} while(strm.avail_out == 0);
+
+		pipeline.consume(size - strm.avail_in);
+		// done when inflate() says it's done
+	} while(ret != Z_STREAM_END);
+
+	// clean up and return
+	inflateEnd(&strm);
+	if(!pipeline.finish())
+		return Z_ERRNO;
+	return ret == Z_STREAM_END ? Z_OK : Z_DATA_ERROR;
+}
+
+int receiveAndDecompress(Pipeline &pipeline, size_t filesize) {
+	if(pipeline.beginFlags() & PIPE_STORED)
+		return inflateChunks(pipeline, filesize);
+	return inflateFast(pipeline, filesize);
+}
+
+int receiveLz4(Pipeline &pipeline, size_t filesize) {
+	size_t total = 0;
+	while(total < filesize) {
+		u32 want = filesize - total < LZ4_BLOCK_SIZE ? filesize - total : LZ4_BLOCK_SIZE;
+
+		// Each chunk is a block of its own, decoded from the receive slot
+		// straight into the write slot
+		u32 size;
+		const u8 *data = pipeline.nextData(&size, true);
+		if(!data) {
+			iprintf("chunk\n");
+			return -1;
+		}
+
+		u32 avail;
+		u8 *dst = pipeline.outBuffer(&avail);
+		if(!dst)
+			return -1;
+		bool direct = avail >= want;
+		u64 start = clockTicks();
+		int decoded = lz4DecodeBlock(data, size, direct ? dst : out, want);
+		pipelineStats.decodeTicks += clockTicks() - start;
+		if(decoded < 0) {
+			iprintf("lz4 block at %zu\n", total);
+			return -1;
+		}
+		if(direct) pipeline.commitOutput(want);
+		else if(pipeline.write(out, want) < 0) return -1;
+		pipeline.consume(size);
+		if(pipeline.pump() < 0)
+			return -1;
+
+		total += want;
+		filetotal = total;
+	}
+
+	if(!pipeline.finish())
+		return -1;
+	return 0;
+}
+
+int receiveAndPatch(Pipeline &pipeline, FILE *srcFile, size_t filesize) {
+	xd3_stream stream;
+	xd3_config config;
+	// The window checksums are checked below, on the shared adler32 kernel
+	xd3_init_config(&config, XD3_ADLER32_NOVER);
+	config.winsize = XDELTA_WINSIZE;
+	if (xd3_config_stream(&stream, &config) != 0) {
+		iprintf("Error initializing xdelta stream\n");
+		return -1;
+	}
+
+	xd3_source source = {0};
+	source.name = "src";
+	source.ioh = srcFile;
+	source.blksize = XDELTA_SRC_BLOCK;
+	source.curblkno = (xoff_t) -1;
+	source.curblk = NULL;
+	xd3_set_source(&stream, &source);
+
+	int retval = 0;
+	u32 size = 0;
+	int status = XD3_INPUT;
+	size_t total = 0;
+
+	while (total < filesize || status != XD3_INPUT) {
+		switch (status) {
+		case XD3_INPUT:
+			{
+				// xdelta only asks for more once it is done with the last piece
+				pipeline.consume(size);
+				const u8 *data = pipeline.nextData(&size);
+				if (!data) {
+					iprintf("chunk\n");
+					retval = -1;
+					goto xdelta_cleanup;
+				}
+				xd3_avail_input(&stream, data, size);
+			}
+			break;
+		case XD3_OUTPUT:
+			// Each output is one whole window
+			if (adlerUpdate(ADLER_INIT, stream.next_out, stream.avail_out) != stream.dec_adler32) {
+				iprintf("Mismatched checksum\n");
+				retval = PATCH_BAD_BASE;
+				goto xdelta_cleanup;
+			}
+			if (pipeline.write(stream.next_out, stream.avail_out) < 0) {
+				retval = -1;
+				goto xdelta_cleanup;
+			}
+			total += stream.avail_out;
+			filetotal = total;
+			xd3_consume_output(&stream);
+			break;
+		case XD3_GETSRCBLK:
+			if (pipeline.pump() < 0) {
+				retval = -1;
+				goto xdelta_cleanup;
+			}
+			{
+				u64 start = clockTicks();
+				fseek(srcFile, source.blksize * source.getblkno, SEEK_SET);
+				source.onblk = fread(out, 1, source.blksize, srcFile);
+				pipelineStats.sourceTicks += clockTicks() - start;
+				pipelineStats.sourceReads++;
+				pipelineStats.sourceBytes += source.onblk;
+			}
+			source.curblk = out;
+			source.curblkno = source.getblkno;
+			break;
+		case XD3_GOTHEADER:
+		case XD3_WINSTART:
+			// The window checksums are all that catches a base other than the
+			// one the host deltaed against
+			if (!(stream.dec_win_ind & XD3_WINDOW_ADLER32)) {
+				iprintf("xdelta window without checksum\n");
+				retval = -1;
+				goto xdelta_cleanup;
+			}
+			break;
+		case XD3_WINFINISH:
+			if (total == filesize) xd3_set_flags(&stream, XD3_FLUSH | stream.flags);
+			break;
+		default:
+			iprintf("xdelta error!\n");
+			retval = status;
+			goto xdelta_cleanup;
+		}
+		u64 start = clockTicks();
+		status = xd3_decode_input(&stream);
+		pipelineStats.decodeTicks += clockTicks() - start;
+	}
+	pipeline.consume(size);
+
+xdelta_cleanup:
+	if (xd3_close_stream(&stream) != 0) {
+		iprintf("Something wrong when closing stream\n");
+	}
+	xd3_free_stream(&stream);
+
+	if (retval == 0 && !pipeline.finish()) retval = -1;
+	return retval;
+}
+
+static u32 toUs(u64 ticks) {
+	u64 us = ticksToUs(ticks);
+	return us > 0xFFFFFFFF ? 0xFFFFFFFF : us;
+}
+
+bool sendTransferStats(int sock) {
+	const PipelineStats &ps = pipelineStats;
+	u32 record[2 + STATS_COUNT];
+	record[0] = STATS_MAGIC;
+	record[1] = STATS_COUNT;
+	u32 *field = record + 2;
+	field[STATS_TOTAL_US] = toUs(ps.endTicks - ps.startTicks);
+	field[STATS_NET_US] = toUs(ps.netStallTicks);
+	field[STATS_RECV_US] = toUs(ps.recvTicks);
+	field[STATS_DECODE_US] = toUs(ps.decodeTicks);
+	field[STATS_SOURCE_US] = toUs(ps.sourceTicks);
+	field[STATS_WRITE_US] = toUs(ps.writeTicks);
+	field[STATS_RESUME_US] = toUs(ps.resumeTicks);
+	field[STATS_BYTES_IN] = ps.bytesIn;
+	field[STATS_BYTES_OUT] = ps.bytesOut;
+	field[STATS_SOURCE_READS] = ps.sourceReads;
+	field[STATS_SOURCE_BYTES] = ps.sourceBytes;
+	field[STATS_NET_STALLS] = ps.netStalls;
+	field[STATS_WRITES] = ps.writes;
+	field[STATS_RETRANSMIT_BYTES] = ps.retransmitBytes;
+	return netSendAll(sock, record, sizeof(record)) == sizeof(record);
+}
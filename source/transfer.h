@@ -0,0 +1,36 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+//
+// Copyright (c) 2024 Evie "Pk11"
+
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include "pipeline.h"
+
+#include <stdio.h>
+
+// xdelta decoder limits, advertised to v2 hosts
+#define XDELTA_WINSIZE (64 * 1024)
+#define XDELTA_SRC_BLOCK CHUNK_SIZE // one block, cached in out
+
+// Scratch buffers shared by the handshake and the decoders
+extern unsigned char in[CHUNK_SIZE];
+extern unsigned char out[CHUNK_SIZE];
+extern volatile size_t filetotal;
+
+extern Pipeline pipeline;
+
+// receiveAndPatch() when a window's adler32 says srcFile isn't the base the
+// host deltaed against
+#define PATCH_BAD_BASE -2
+
+// All read the payload from a pipeline the caller has begun on the socket
+// and output file. Returns Z_OK or 0 on success.
+int receiveAndDecompress(Pipeline &pipeline, size_t filesize);
+int receiveAndPatch(Pipeline &pipeline, FILE *srcFile, size_t filesize);
+int receiveLz4(Pipeline &pipeline, size_t filesize);
+
+// The STATS_ record of the last payload from pipelineStats, see protocol.h
+bool sendTransferStats(int sock);
+
+#endif // TRANSFER_H